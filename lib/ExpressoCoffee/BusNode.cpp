@@ -0,0 +1,142 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include "BusNode.h"
+
+void BusNode::setup() {
+    if (m_driverEnablePin >= 0) {
+        pinMode(m_driverEnablePin, OUTPUT);
+        digitalWrite(m_driverEnablePin, LOW);
+    }
+}
+
+void BusNode::loop() {
+
+    // release the bus once the last byte of the response left the shift register
+    if (m_transmitting && (UCSR0A & _BV(TXC0))) {
+        if (m_driverEnablePin >= 0) {
+            digitalWrite(m_driverEnablePin, LOW);
+        }
+        m_transmitting = false;
+    }
+
+    while (Serial.available() > 0) {
+        uint8_t c = Serial.read();
+        unsigned long now = millis();
+        if (now - m_lastByteMs > BUS_FRAME_GAP_MILLIS) {
+            m_requestLen = 0;
+            m_skipUntilGap = false;
+        }
+        m_lastByteMs = now;
+
+        if (m_skipUntilGap || (m_requestLen == 0 && c != BUS_SYNC)) {
+            continue;
+        }
+        m_request[m_requestLen++] = c;
+        if (m_requestLen == 2 && (c & BUS_RESPONSE)) {
+            m_skipUntilGap = true;                                  //!< response of another node, may contain SYNC bytes
+            m_requestLen = 0;
+        } else if (m_requestLen == BUS_REQUEST_LEN) {
+            handleRequest();
+            m_requestLen = 0;
+        }
+    }
+}
+
+void BusNode::handleRequest() {
+
+    uint8_t crc = 0;
+    for (uint8_t i = 1; i < BUS_REQUEST_LEN - 1; i++) {
+        crc = busCrc8(crc, m_request[i]);
+    }
+    if (crc != m_request[BUS_REQUEST_LEN - 1] || m_request[1] != m_address || m_transmitting) {
+        return;
+    }
+
+    switch (m_request[2]) {
+        case BUS_CMD_STATUS:
+            sendStatus();
+            break;
+        case BUS_CMD_SHOTS:
+            sendShots(m_request[3] | (m_request[4] << 8));
+            break;
+        default:
+            break;
+    }
+}
+
+void BusNode::sendStatus() {
+
+    uint8_t payload[BUS_STATUS_HEADER_LEN + BREW_GROUPS_LEN * BUS_STATUS_GROUP_LEN];
+    uint16_t nextSequence = m_shotLog->getNextSequence();
+
+    payload[0] = nextSequence & 0xFF;
+    payload[1] = nextSequence >> 8;
+    payload[2] = (m_ptrExpressoMachine->isFillingBoiler() ? BUS_STATUS_FILLING_BOILER : 0)
+        | (m_ptrExpressoMachine->isSafetyFault() ? BUS_STATUS_SAFETY_FAULT : 0)
+        | (m_ptrExpressoMachine->isOnProgrammingMode() ? BUS_STATUS_PROGRAMMING : 0);
+
+    uint8_t* p = &payload[BUS_STATUS_HEADER_LEN];
+    for (int8_t i = 0; i < BREW_GROUPS_LEN; i++) {
+        BrewGroup* group = m_ptrExpressoMachine->getBrewGroup(i + 1);
+        *p++ = group->getState();
+        *p++ = group->getBrewingOptionIndex();                      //!< -1 sent as 0xFF
+        *p++ = group->getRecipeBank();
+        *p++ = group->getFlowMeter()->diagnostics.getHealth();
+    }
+
+    sendResponse(BUS_CMD_STATUS, payload, sizeof(payload));
+}
+
+void BusNode::sendShots(uint16_t fromSequence) {
+
+    ShotRecord records[BUS_SHOTS_PER_FRAME];
+    uint8_t payload[BUS_MAX_PAYLOAD_LEN];
+    uint8_t len = m_shotLog->getRecords(fromSequence, records, BUS_SHOTS_PER_FRAME);
+
+    uint8_t* p = payload;
+    for (uint8_t i = 0; i < len; i++) {
+        *p++ = records[i].sequence & 0xFF;
+        *p++ = records[i].sequence >> 8;
+        *p++ = records[i].groupNumber;
+        *p++ = records[i].brewOptionIndex;
+        *p++ = records[i].stopReason;
+        *p++ = records[i].durationDeciseconds & 0xFF;
+        *p++ = records[i].durationDeciseconds >> 8;
+        *p++ = records[i].pulseCount & 0xFF;
+        *p++ = records[i].pulseCount >> 8;
+    }
+
+    sendResponse(BUS_CMD_SHOTS, payload, p - payload);
+}
+
+/*----------------------------------------------------------------------*
+/ queue the whole response in the serial transmit buffer or nothing,    *
+/ Serial.write() would block the loop when the buffer is full           *
+/-----------------------------------------------------------------------*/
+void BusNode::sendResponse(uint8_t command, const uint8_t* payload, uint8_t len) {
+
+    if (Serial.availableForWrite() < BUS_RESPONSE_HEADER_LEN + len + 1) {
+        return;
+    }
+
+    if (m_driverEnablePin >= 0) {
+        digitalWrite(m_driverEnablePin, HIGH);
+    }
+
+    uint8_t header[BUS_RESPONSE_HEADER_LEN] = { BUS_SYNC, (uint8_t) (m_address | BUS_RESPONSE), command, len };
+    uint8_t crc = 0;
+    for (uint8_t i = 1; i < BUS_RESPONSE_HEADER_LEN; i++) {
+        crc = busCrc8(crc, header[i]);
+    }
+    for (uint8_t i = 0; i < len; i++) {
+        crc = busCrc8(crc, payload[i]);
+    }
+
+    Serial.write(header, BUS_RESPONSE_HEADER_LEN);
+    Serial.write(payload, len);
+    Serial.write(crc);
+    m_transmitting = true;
+}
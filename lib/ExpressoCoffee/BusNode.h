@@ -0,0 +1,61 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef BUS_NODE_H_INCLUDED
+#define BUS_NODE_H_INCLUDED
+
+#include "ExpressoCoffee.h"
+#include "BusProtocol.h"
+#include "ShotLog.h"
+
+#ifndef BUS_NODE
+#define BUS_NODE 0                                                  //!< 1 to answer the multi-drop bus on the serial port (takes D0/D1 from group 1 options 3 and 4)
+#endif
+#ifndef BUS_NODE_ADDRESS
+#define BUS_NODE_ADDRESS 1                                          //!< address of this controller on the bus, 1 to BUS_MAX_NODE_ADDRESS
+#endif
+#ifndef BUS_NODE_DE_PIN
+#define BUS_NODE_DE_PIN -1                                          //!< transceiver driver enable pin, -1 for transceivers switching direction by themselves
+#endif
+
+#if BUS_NODE && SERIAL_CONSOLE
+#error "BUS_NODE and SERIAL_CONSOLE both use the serial port"
+#endif
+#if BUS_NODE && DEBUG_LEVEL > DEBUG_NONE
+#error "debug output would corrupt bus frames, build BUS_NODE with DEBUG_LEVEL=DEBUG_NONE"
+#endif
+
+/**
+ * BusNode
+ *
+ * Answers status and shot log requests from the bus host (see BusProtocol.h). Bytes are
+ * consumed as they arrive and a response is only queued when it fits in the serial transmit
+ * buffer, so polling never stalls the machine loop; a response that does not fit is dropped
+ * and the host asks again.
+ */
+class BusNode {
+public:
+    BusNode(ExpressoMachine* expressoMachine, ShotLog* shotLog, uint8_t address, int8_t driverEnablePin)
+        : m_ptrExpressoMachine(expressoMachine), m_shotLog(shotLog), m_address(address), m_driverEnablePin(driverEnablePin) {};
+    void setup();
+    void loop();
+
+private:
+    ExpressoMachine* m_ptrExpressoMachine;
+    ShotLog* m_shotLog;
+    uint8_t m_address;
+    int8_t m_driverEnablePin;
+    uint8_t m_request[BUS_REQUEST_LEN];
+    uint8_t m_requestLen = 0;
+    bool m_skipUntilGap = false;                                    //!< inside the response of another node
+    unsigned long m_lastByteMs = 0;
+    bool m_transmitting = false;
+    void handleRequest();
+    void sendStatus();
+    void sendShots(uint16_t fromSequence);
+    void sendResponse(uint8_t command, const uint8_t* payload, uint8_t len);
+};
+
+#endif
@@ -0,0 +1,64 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef BUS_PROTOCOL_H_INCLUDED
+#define BUS_PROTOCOL_H_INCLUDED
+
+#include <stdint.h>
+
+/**
+ * Multi-drop serial bus protocol (RS-485, half duplex) between the machine controllers
+ * (BusNode) and the host aggregator (tools/bus_aggregator). Only the host talks unsolicited,
+ * a node answers the requests carrying its address. Shared by firmware and host code, so it
+ * must not depend on Arduino headers.
+ *
+ *   request:   SYNC  address          command  sequence(2)            crc
+ *   response:  SYNC  address|RESPONSE command  len  payload[len]      crc
+ *
+ * crc is CRC-8 (polynomial 0x07) of every byte after SYNC. Multi-byte fields are little endian.
+ * A node answers BUS_CMD_SHOTS with up to BUS_SHOTS_PER_FRAME records, oldest first, starting
+ * at the requested sequence or at the oldest record it still holds.
+ */
+const uint8_t BUS_SYNC = 0xA5;
+const uint8_t BUS_RESPONSE = 0x80;                                  //!< set in the address byte of responses
+const uint8_t BUS_REQUEST_LEN = 6;
+const uint8_t BUS_RESPONSE_HEADER_LEN = 4;
+const uint8_t BUS_MAX_NODE_ADDRESS = 0x7F;
+const unsigned long BUS_BAUD = 9600;
+const uint8_t BUS_FRAME_GAP_MILLIS = 20;                            //!< silence that ends a partially received frame
+
+enum BusCommand {
+    BUS_CMD_STATUS = 1,
+    BUS_CMD_SHOTS = 2
+};
+
+/*----------------------------------------------------------------------*
+/ status payload: next shot sequence(2), flags, then for each group:    *
+/ state, brewing option (0xFF none), recipe bank, flowmeter health      *
+/-----------------------------------------------------------------------*/
+const uint8_t BUS_STATUS_FILLING_BOILER = 0x01;
+const uint8_t BUS_STATUS_SAFETY_FAULT = 0x02;
+const uint8_t BUS_STATUS_PROGRAMMING = 0x04;                      //!< any group in programming mode
+const uint8_t BUS_STATUS_HEADER_LEN = 3;
+const uint8_t BUS_STATUS_GROUP_LEN = 4;
+
+/*----------------------------------------------------------------------*
+/ shot record: sequence(2), group number, option index, stop reason,    *
+/ duration in tenths of second(2), flowmeter pulses(2)                  *
+/-----------------------------------------------------------------------*/
+const uint8_t BUS_SHOT_RECORD_LEN = 9;
+const uint8_t BUS_SHOTS_PER_FRAME = 5;
+const uint8_t BUS_MAX_PAYLOAD_LEN = BUS_SHOT_RECORD_LEN * BUS_SHOTS_PER_FRAME;
+const uint8_t BUS_MAX_RESPONSE_LEN = BUS_RESPONSE_HEADER_LEN + BUS_MAX_PAYLOAD_LEN + 1;
+
+static inline uint8_t busCrc8(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = (crc & 0x80) ? (uint8_t) ((crc << 1) ^ 0x07) : (uint8_t) (crc << 1);
+    }
+    return crc;
+}
+
+#endif
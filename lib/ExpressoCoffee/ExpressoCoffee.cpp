@@ -4,18 +4,92 @@
 // GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
 
 #include "ExpressoCoffee.h"
+#include "UsageCounters.h"
+#include "ShotLog.h"
+#include "LoadCell.h"
 #include <EEPromUtils.h>
 
-BrewGroup::BrewGroup(int8_t groupNumber, int8_t pinArray[], SimpleFlowMeter* flowMeter, int8_t solenoidPin) {
+/*----------------------------------------------------------------------*
+/ EEPROM layout: dosage records of every group for bank 0, then bank 1  *
+/ and so on, followed by the recipe bank index                          *
+/-----------------------------------------------------------------------*/
+static int dosageRecordLocation(int8_t groupNumber, uint8_t bank) {
+    return EEPROM_SIZE( sizeof(DosageRecord) ) * (bank * BREW_GROUPS_LEN + groupNumber - 1);
+}
+
+static const int RECIPE_INDEX_LOCATION = EEPROM_SIZE( sizeof(DosageRecord) ) * RECIPE_BANKS_LEN * BREW_GROUPS_LEN;
+static const int USAGE_COUNTERS_LOCATION = RECIPE_INDEX_LOCATION + EEPROM_SIZE( sizeof(RecipeBankIndex) );
+static const int WEIGHT_TARGETS_LOCATION = USAGE_COUNTERS_LOCATION + EEPROM_SIZE( sizeof(UsageRecord) ) * USAGE_COUNTERS_SLOTS;
+
+BrewGroup::BrewGroup(int8_t groupNumber, const int8_t pinArray[], SimpleFlowMeter* flowMeter, int8_t solenoidPin) {
 
     m_groupNumber = groupNumber;
     m_flowMeter = flowMeter;
     m_solenoidPin = solenoidPin;
     m_brewOptionPins = pinArray;
-
-    DEBUG3_VALUELN("Instantiating BrewGroup ", m_groupNumber);
 }
 
+/*----------------------------------------------------------------------*
+/ brew group transitions: next state and action of each state X event   *
+/ pair, packed as (next state << 4) | action. EVT_RECIPE_BANK_PRESSED   *
+/ is only posted on an idle group: in the other states the long press   *
+/ is not armed and the release of the option stops or starts its shot   *
+/-----------------------------------------------------------------------*/
+#define TRANSITION(state, action) (uint8_t) (((state) << 4) | (action))
+
+static const uint8_t GROUP_TRANSITIONS[GROUP_STATES_LEN][GROUP_EVENTS_LEN] PROGMEM = {
+    /* GROUP_IDLE */ {
+        TRANSITION(GROUP_IDLE, ACT_IDLE_LEDS),                                  // EVT_TICK
+        TRANSITION(GROUP_BREWING, ACT_START_BREWING),                           // EVT_OPTION_PRESSED
+        TRANSITION(GROUP_IDLE, ACT_NONE),                                       // EVT_CURRENT_OPTION_PRESSED
+        TRANSITION(GROUP_BREWING, ACT_START_BREWING),                           // EVT_CONTINUOUS_PRESSED
+        TRANSITION(GROUP_PROGRAMMING, ACT_ENTER_PROGRAMMING),                   // EVT_PROGRAM_PRESSED
+        TRANSITION(GROUP_IDLE, ACT_SELECT_RECIPE_BANK),                         // EVT_RECIPE_BANK_PRESSED
+        TRANSITION(GROUP_IDLE, ACT_NONE),                                       // EVT_DOSE_COMPLETE
+        TRANSITION(GROUP_IDLE, ACT_NONE)                                        // EVT_SAFETY_TRIP
+    },
+    /* GROUP_BREWING */ {
+        TRANSITION(GROUP_BREWING, ACT_CHECK_DOSE),
+        TRANSITION(GROUP_BREWING, ACT_QUEUE_SHOT),
+        TRANSITION(GROUP_IDLE, ACT_STOP_BREWING),
+        TRANSITION(GROUP_IDLE, ACT_STOP_BREWING),
+        TRANSITION(GROUP_BREWING_PROGRAMMING_PENDING, ACT_ENTER_PROGRAMMING),
+        TRANSITION(GROUP_BREWING, ACT_NONE),                                    // EVT_RECIPE_BANK_PRESSED, not posted
+        TRANSITION(GROUP_IDLE, ACT_STOP_BREWING),
+        TRANSITION(GROUP_IDLE, ACT_STOP_BREWING)
+    },
+    /* GROUP_PROGRAMMING */ {
+        TRANSITION(GROUP_PROGRAMMING, ACT_PROGRAMMING_LEDS),
+        TRANSITION(GROUP_PROGRAMMING_BREWING, ACT_START_BREWING),
+        TRANSITION(GROUP_PROGRAMMING, ACT_NONE),
+        TRANSITION(GROUP_IDLE, ACT_EXIT_PROGRAMMING),
+        TRANSITION(GROUP_PROGRAMMING, ACT_COPY_DOSAGE),
+        TRANSITION(GROUP_PROGRAMMING, ACT_NONE),                                // EVT_RECIPE_BANK_PRESSED, not posted
+        TRANSITION(GROUP_PROGRAMMING, ACT_NONE),
+        TRANSITION(GROUP_PROGRAMMING, ACT_NONE)
+    },
+    /* GROUP_PROGRAMMING_BREWING */ {
+        TRANSITION(GROUP_PROGRAMMING_BREWING, ACT_NONE),
+        TRANSITION(GROUP_PROGRAMMING_BREWING, ACT_NONE),
+        TRANSITION(GROUP_PROGRAMMING, ACT_STOP_BREWING),
+        TRANSITION(GROUP_BREWING, ACT_EXIT_PROGRAMMING),
+        TRANSITION(GROUP_PROGRAMMING_BREWING, ACT_NONE),
+        TRANSITION(GROUP_PROGRAMMING_BREWING, ACT_NONE),                        // EVT_RECIPE_BANK_PRESSED, not posted
+        TRANSITION(GROUP_PROGRAMMING, ACT_STOP_BREWING),
+        TRANSITION(GROUP_PROGRAMMING, ACT_STOP_BREWING)
+    },
+    /* GROUP_BREWING_PROGRAMMING_PENDING */ {
+        TRANSITION(GROUP_BREWING_PROGRAMMING_PENDING, ACT_CHECK_DOSE),
+        TRANSITION(GROUP_BREWING_PROGRAMMING_PENDING, ACT_NONE),
+        TRANSITION(GROUP_PROGRAMMING, ACT_STOP_BREWING),
+        TRANSITION(GROUP_BREWING, ACT_EXIT_PROGRAMMING),
+        TRANSITION(GROUP_BREWING_PROGRAMMING_PENDING, ACT_NONE),
+        TRANSITION(GROUP_BREWING_PROGRAMMING_PENDING, ACT_NONE),                // EVT_RECIPE_BANK_PRESSED, not posted
+        TRANSITION(GROUP_PROGRAMMING, ACT_STOP_BREWING),
+        TRANSITION(GROUP_PROGRAMMING, ACT_STOP_BREWING)
+    }
+};
+
 /*----------------------------------------------------------------------*
 / this method must be frequently called in loop function to check       *
 / buttons's press, dosage timeouts etc.                                 *
@@ -23,129 +97,330 @@ BrewGroup::BrewGroup(int8_t groupNumber, int8_t pinArray[], SimpleFlowMeter* flo
 void BrewGroup::loop()
 {
 
-    DEBUG4_PRINTLN("BrewGroup::loop()");
+    DEBUG4_PRINTLN(F("BrewGroup::loop()"));
 
-    BrewOption* bopt = NULL;
+    GroupEvent event = EVT_TICK;
+    int8_t optionIndex = -1;
 
     // for each brew option check whether the button was pushed
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++)
     {
 
-        bopt = m_brewOptions[i];
+        BrewOption* bopt = m_brewOptions[i];
+
+        /* a long press selects a recipe bank only on options of a bank and only on an idle group, so
+           holding the option that brews (or programs) still stops it on release. The long press of
+           the continuous option enters programming mode in any state */
+        bool longPressArmed = CONTINUOUS_BREW_OPTION_INDEX == i || (i < RECIPE_BANKS_LEN && m_state == GROUP_IDLE);
+        ButtonAction pressed = bopt->loop(longPressArmed);
+
+        DEBUG5_VALUE(F("BrewOption "), i+1);
+        DEBUG5_VALUELN(F(" returned "), pressed);
+
+        if (BUTTON_PRESSED_FOR_CONTINUOUS_BREWING == pressed) {
+            event = EVT_CONTINUOUS_PRESSED;
+        } else if (BUTTON_PRESSED_FOR_BREWING == pressed) {
+            event = bopt == ptrCurrentBrewingOption ? EVT_CURRENT_OPTION_PRESSED : EVT_OPTION_PRESSED;
+        } else if (BUTTON_PRESSED_FOR_PROGRAM == pressed) {
+            event = EVT_PROGRAM_PRESSED;
+        } else if (BUTTON_PRESSED_FOR_RECIPE_BANK == pressed) {
+            event = EVT_RECIPE_BANK_PRESSED;
+        } else {
+            continue;
+        }
 
-        ButtonAction pressed = bopt->loop();
+        DEBUG3_VALUE(F("BrewOption "), i+1);
+        DEBUG3_VALUE(F(" returned "), pressed);
+        DEBUG3_VALUELN(F(" on group "), m_groupNumber);
+        optionIndex = i;
+        break;  //!< Exit for loop since no other command will be detected so fast in this group
+    }
 
-        DEBUG5_VALUE("BrewOption ", i+1);
-        DEBUG5_VALUELN(" returned ", pressed);
+    if (event != EVT_TICK) {
+        dispatch(event, optionIndex);
+    }
+    dispatch(EVT_TICK);
 
-        #ifdef DEBUG_MID
-            if (pressed != BUTTON_NOT_PRESSED) {
-                DEBUG3_VALUE("BrewOption ", i+1);
-                DEBUG3_VALUELN(" returned ", pressed);
+    // dosage records refused by the EEPROM write budget, retried once it has a token again
+    if (m_unsavedBanksMask != 0 && ptrCurrentBrewingOption == NULL && millis() - m_dosageSaveAttemptMs >= EEPROM_WRITE_REFILL_MILLIS) {
+        for (uint8_t bank = 0; bank < RECIPE_BANKS_LEN; bank++) {
+            if (m_unsavedBanksMask & (1 << bank)) {
+                writeDosageRecord(bank);
             }
-        #endif
-
-        // 
-        /* If brewing in this group, only process button command for the current brewing option or continuous brew option,
-           pressing other buttons on the group will be ignored */
-        if (ptrCurrentBrewingOption != NULL && ptrCurrentBrewingOption != bopt && CONTINUOUS_BREW_OPTION_INDEX != i) {
-            continue;
         }
+    }
+}
 
-        /* Short pressing brewing option is for:
-         * - Start brewing (out of prog mode) if group is not brewing for other option
-         * - Stop brewing (out of prog mode) if pressed option is currently brewing
-         * - Start brewing (in prog mode) if group is not brewing for other option
-         * - Stop brewing (in prog mode) if pressed option is currently brewing
-         * - Stop brewing (out of prog mode) if pressed option is continuous option
-         * - Exit programming mode (continuous button) if this mode is active
-         */
-        if (BUTTON_PRESSED_FOR_CONTINUOUS_BREWING == pressed || BUTTON_PRESSED_FOR_BREWING == pressed) {
+/*----------------------------------------------------------------------*
+/ look up the transition of current state for the event, move to the    *
+/ next state and then run its action. Actions may post other events     *
+/-----------------------------------------------------------------------*/
+void BrewGroup::dispatch(GroupEvent event, int8_t optionIndex) {
 
-            if (BUTTON_PRESSED_FOR_CONTINUOUS_BREWING == pressed && m_ptrExpressoMachine->isOnProgrammingMode) {
+    GroupState prevState = m_state;
+    uint8_t transition = pgm_read_byte(&GROUP_TRANSITIONS[prevState][event]);
+    m_state = (GroupState) (transition >> 4);
 
-                if (m_ptrExpressoMachine->ptrFirstCompletedProgramming != NULL && allOptionsWaitingForProgramming()) {
-                    copyDosageConfig(m_ptrExpressoMachine->ptrFirstCompletedProgramming);
-                    setStatusLeds(ON, ONLY_PROGRAMMED);
-                } else {
-                    // programming button was pressed to exit programmin mode
-                    DEBUG3_VALUELN("Button pressed to exit programming mode on group ", m_groupNumber);
-                    exitProgrammingMode();
+    if (m_state != prevState) {
+        DEBUG3_VALUE(F("Group "), m_groupNumber);
+        DEBUG3_VALUE(F(" state "), prevState);
+        DEBUG3_VALUE(F(" -> "), m_state);
+        DEBUG3_VALUELN(F(" on event "), event);
+    }
+
+    switch ((GroupAction) (transition & 0x0F)) {
+        case ACT_START_BREWING:
+            if (!startBrewing(m_brewOptions[optionIndex], m_state == GROUP_PROGRAMMING_BREWING)) {
+                m_state = prevState;
+            }
+            break;
+        case ACT_STOP_BREWING:
+            if (EVT_SAFETY_TRIP == event) {
+                ptrCurrentBrewingOption->setStopReason(STOP_BY_SAFETY);
+            } else if (EVT_DOSE_COMPLETE != event) {
+                ptrCurrentBrewingOption->setStopReason(STOP_BY_USER);
+            }
+            // a shot cut by the safety supervisor is not a dosage to program
+            stopBrewing(prevState == GROUP_PROGRAMMING_BREWING && EVT_SAFETY_TRIP != event);
+            // continuous button and safety trips also cancel queued shots
+            if (m_state == GROUP_IDLE && EVT_CONTINUOUS_PRESSED != event && EVT_SAFETY_TRIP != event) {
+                int8_t nextOptionIndex = popQueuedShot();
+                if (nextOptionIndex >= 0) {
+                    DEBUG3_VALUE(F("Starting queued option "), nextOptionIndex+1);
+                    DEBUG3_VALUELN(F(" on group "), m_groupNumber);
+                    dispatch(EVT_OPTION_PRESSED, nextOptionIndex);
                 }
-            } else {
-				DEBUG3_VALUE("Button pressed for brewing. Option ", i+1);
-				DEBUG3_VALUELN(" on group ", m_groupNumber);
-				if (ptrCurrentBrewingOption == NULL) {
-                    startBrewing(bopt);
+            }
+            if (m_state != GROUP_BREWING) {
+                clearShotQueue();
+            }
+            break;
+        case ACT_QUEUE_SHOT:
+            toggleQueuedShot(optionIndex);
+            break;
+        case ACT_CHECK_DOSE:
+            updateQueuedShotLeds();
+            if (canFinishBrewing()) {
+                dispatch(EVT_DOSE_COMPLETE);
+            }
+            break;
+        case ACT_IDLE_LEDS:
+            updateIdleLeds();
+            break;
+        case ACT_PROGRAMMING_LEDS:
+            if (m_showCopyRefused) {
+                // dosage not copied, every led blinks fast for a while
+                unsigned long elapsed = millis() - m_copyRefusedMs;
+                if (elapsed >= RECIPE_BANK_FEEDBACK_MILLIS) {
+                    m_showCopyRefused = false;
+                    setStatusLeds(ON, ONLY_PROGRAMMED);
+                    setStatusLeds(m_blinkLedsStatus, ONLY_NOT_PROGRAMMED);
                 } else {
-                    stopBrewing();
+                    setStatusLeds((elapsed / COPY_REFUSED_BLINK_INTERVAL) & 1 ? OFF : ON, ALL);
                 }
+            } else if (m_toggleBlinkLeds) {
+                // other groups may keep brewing while this one is programmed
+                m_blinkLedsStatus = m_blinkLedsStatus == ON ? OFF : ON;
+                setStatusLeds(m_blinkLedsStatus, ONLY_NOT_PROGRAMMED);
             }
-            break;  //!< Exit for loop since no other command will be detected so fast in this group
-
-        } else if (BUTTON_PRESSED_FOR_PROGRAM == pressed && !m_ptrExpressoMachine->isOnProgrammingMode) {
-            DEBUG3_VALUELN("Button pressed to enter programming mode on group ", m_groupNumber);
+            break;
+        case ACT_ENTER_PROGRAMMING:
+            DEBUG3_VALUELN(F("Button pressed to enter programming mode on group "), m_groupNumber);
             enterProgrammingMode();
-            break;  //!< Exit for loop since no other command will be detected so fast in this group
+            break;
+        case ACT_EXIT_PROGRAMMING:
+            DEBUG3_VALUELN(F("Button pressed to exit programming mode on group "), m_groupNumber);
+            exitProgrammingMode();
+            break;
+        case ACT_COPY_DOSAGE: {
+            DEBUG3_VALUELN(F("Button pressed to copy dosage of group "), m_groupNumber);
+            bool copied = false;
+            for (int8_t g = 1; g <= BREW_GROUPS_LEN; g++) {
+                if (g != m_groupNumber) {
+                    copied = m_ptrExpressoMachine->copyDosageConfig(m_groupNumber, g) || copied;
+                }
+            }
+            // nothing programmed, every other group busy or the record only pending: tell the barista
+            if (!copied) {
+                DEBUG2_VALUELN(F("Dosage not copied or not saved from group "), m_groupNumber);
+                m_showCopyRefused = true;
+                m_copyRefusedMs = millis();
+            }
+            break;
         }
+        case ACT_SELECT_RECIPE_BANK:
+            DEBUG3_VALUE(F("Button pressed to select recipe bank "), optionIndex+1);
+            DEBUG3_VALUELN(F(" on group "), m_groupNumber);
+            m_ptrExpressoMachine->selectRecipeBank(m_groupNumber, optionIndex);
+            break;
+        default:
+            break;
+    }
+}
 
+/*----------------------------------------------------------------------*
+/ when the flowmeter is armed the solenoid was already closed by its    *
+/ ISR as the dose was reached, reaching the dose count here only        *
+/ acknowledges it                                                       *
+/-----------------------------------------------------------------------*/
+bool BrewGroup::canFinishBrewing() {
+    unsigned long elapsedBrewMillis = millis() - m_brewingStartTime;
+    if (m_weightDosing && m_loadCell->isReady()) {
+        return ptrCurrentBrewingOption->canFinishBrewingByWeight(elapsedBrewMillis, m_loadCell->getPredictedWeight(),
+                                                                 m_loadCell->getTarget(getBrewingOptionIndex()));
+    }
+    bool timeBasedDosing = !m_flowMeter->diagnostics.isHealthy() && ptrCurrentBrewingOption != m_brewOptions[CONTINUOUS_BREW_OPTION_INDEX];
+    return timeBasedDosing ? ptrCurrentBrewingOption->canFinishBrewingByTime(elapsedBrewMillis)
+                           : ptrCurrentBrewingOption->canFinishBrewing(elapsedBrewMillis, m_flowMeter->getPulseCount());
+}
+
+/*----------------------------------------------------------------------*
+/ shot queue: pressing another option while brewing queues it to start  *
+/ as soon as the current shot ends, pressing it again cancels it        *
+/-----------------------------------------------------------------------*/
+void BrewGroup::toggleQueuedShot(int8_t optionIndex) {
+#if SHOT_QUEUE_LEN > 0
+    // a weight dosed shot needs the full cup swapped and the scale settled, the barista starts it
+    if (m_loadCell != NULL && m_loadCell->getTarget(optionIndex) > 0) {
+        DEBUG3_VALUELN(F("Weight dosed, not queued, option "), optionIndex+1);
+        return;
+    }
+    for (uint8_t i = 0; i < m_shotQueueLen; i++) {
+        if (m_shotQueue[i] == optionIndex) {
+            DEBUG3_VALUELN(F("Queued shot cancelled, option "), optionIndex+1);
+            m_brewOptions[optionIndex]->ledStatus = OFF;
+            m_shotQueueLen--;
+            for (; i < m_shotQueueLen; i++) {
+                m_shotQueue[i] = m_shotQueue[i+1];
+            }
+            return;
+        }
     }
+    if (m_shotQueueLen < SHOT_QUEUE_LEN) {
+        DEBUG3_VALUELN(F("Shot queued, option "), optionIndex+1);
+        m_shotQueue[m_shotQueueLen++] = optionIndex;
+    }
+#else
+    (void) optionIndex;
+#endif
+}
 
-    unsigned long currentMillis = millis();
-    if (ptrCurrentBrewingOption != NULL) {
-        if (!m_ptrExpressoMachine->isOnProgrammingMode && ptrCurrentBrewingOption->canFinishBrewing(currentMillis - m_brewingStartTime, m_flowMeter->getPulseCount())) {
-            stopBrewing();
+int8_t BrewGroup::popQueuedShot() {
+#if SHOT_QUEUE_LEN > 0
+    if (m_shotQueueLen > 0) {
+        int8_t optionIndex = m_shotQueue[0];
+        m_shotQueueLen--;
+        for (uint8_t i = 0; i < m_shotQueueLen; i++) {
+            m_shotQueue[i] = m_shotQueue[i+1];
         }
-    } else if (m_ptrExpressoMachine->isOnProgrammingMode && !m_ptrExpressoMachine->isBrewing && m_toggleBlinkLeds) {
-        m_blinkLedsStatus = m_blinkLedsStatus == ON ? OFF : ON;
-        setStatusLeds(m_blinkLedsStatus, ONLY_NOT_PROGRAMMED);
-    } else if (m_ptrExpressoMachine->isBrewing) {
+        return optionIndex;
+    }
+#endif
+    return -1;
+}
+
+void BrewGroup::clearShotQueue() {
+#if SHOT_QUEUE_LEN > 0
+    for (uint8_t i = 0; i < m_shotQueueLen; i++) {
+        m_brewOptions[m_shotQueue[i]]->ledStatus = OFF;
+    }
+    m_shotQueueLen = 0;
+#endif
+}
+
+/*----------------------------------------------------------------------*
+/ leds of queued options blink fast, the second queued shot out of      *
+/ phase with the first one                                              *
+/-----------------------------------------------------------------------*/
+void BrewGroup::updateQueuedShotLeds() {
+#if SHOT_QUEUE_LEN > 0
+    bool phase = (millis() / QUEUED_SHOT_BLINK_INTERVAL) & 1;
+    for (uint8_t i = 0; i < m_shotQueueLen; i++) {
+        m_brewOptions[m_shotQueue[i]]->ledStatus = (phase ^ (i & 1)) ? ON : OFF;
+    }
+#endif
+}
+
+void BrewGroup::updateIdleLeds() {
+    if (m_ptrExpressoMachine->isBrewing) {
         setStatusLeds(OFF, ALL);
+    } else if (m_ptrExpressoMachine->isSafetyFault() && m_toggleDriftLeds) {
+        // blink continuous option led while outputs are locked out by the safety supervisor
+        m_driftLedsStatus = m_driftLedsStatus == ON ? OFF : ON;
+        m_brewOptions[CONTINUOUS_BREW_OPTION_INDEX]->ledStatus = m_driftLedsStatus;
+    } else if (m_showRecipeBank) {
+        // keep led of the selected recipe bank (or copied options) on for a while
+        if (millis() - m_recipeBankSelectedMs >= RECIPE_BANK_FEEDBACK_MILLIS) {
+            m_showRecipeBank = false;
+            setStatusLeds(OFF, ALL);
+        }
+    } else if (m_toggleDriftLeds) {
+        // blink leds of options whose mean shot time drifted out of the band, grinder needs adjustment
+        m_driftLedsStatus = m_driftLedsStatus == ON ? OFF : ON;
+        for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
+            if (i != CONTINUOUS_BREW_OPTION_INDEX) {
+                m_brewOptions[i]->ledStatus = m_brewOptions[i]->isDrifting() ? m_driftLedsStatus : OFF;
+            }
+        }
+        // continuous option led stays on while the flowmeter is unhealthy (time-based dosing)
+        m_brewOptions[CONTINUOUS_BREW_OPTION_INDEX]->ledStatus = m_flowMeter->diagnostics.isHealthy() ? OFF : ON;
     }
 }
 
-ButtonAction BrewOption::loop()
+/*----------------------------------------------------------------------*
+/ returns the command of the button: a release, or a long press when    *
+/ it was armed as the button went down. The release of a long press is  *
+/ not a command                                                         *
+/-----------------------------------------------------------------------*/
+ButtonAction BrewOption::loop(bool longPressArmed)
 {
 
-    DEBUG5_VALUELN("BrewOption::loop() option on pin ", m_pin);
+    DEBUG5_VALUELN(F("BrewOption::loop() option on pin "), m_pin);
+
+    if (m_pin == NO_OPTION_PIN) {
+        return BUTTON_NOT_PRESSED;
+    }
 
     /* INPUT_PULLUP need to be set before reading button value */
 	if (m_pinMode != INPUT_PULLUP) {
     	pinMode(m_pin, INPUT_PULLUP);
         m_pinMode = INPUT_PULLUP;
-        DEBUG5_VALUELN("  Set INPUT_PULLUP for pin", m_pin);
+        DEBUG5_VALUELN(F("  Set INPUT_PULLUP for pin"), m_pin);
 	}
     
-    m_btn->read();
+    m_btn.read();
 
     if (ledStatus == ON) {
         turnOnLed();
     }
 
-    if (m_btn->wasReleased() && millis() - m_lastActionMs > 500) {
+    if (m_btn.wasPressed()) {
+        m_longPressArmed = longPressArmed;
+    }
+
+    if (m_btn.wasReleased()) {
+        if (!m_btnReleasedAfterLongPress) {
+            m_btnReleasedAfterLongPress = true;                     //!< releasing a long press is not a command
+        } else if (millis() - m_lastActionMs > 500) {
+            m_lastActionMs = millis();
+            return BUTTON_PRESSED_FOR_BREWING;
+        }
+    } else if (m_longPressArmed && m_btnReleasedAfterLongPress && m_btn.pressedFor(m_longPressMillis)) {
+        m_btnReleasedAfterLongPress = false;
         m_lastActionMs = millis();
-        return BUTTON_PRESSED_FOR_BREWING;
+        return m_longPressAction;
     }
 
     return BUTTON_NOT_PRESSED;
 }
 
-ButtonAction ContinuousBrewOption::loop()
+ButtonAction ContinuousBrewOption::loop(bool longPressArmed)
 {
 
-    ButtonAction ret = BrewOption::loop();
+    ButtonAction ret = BrewOption::loop(longPressArmed);
 
     if (BUTTON_PRESSED_FOR_BREWING == ret) {
-        if (m_btnReleasedAfterPressedForProgram) {
-            ret = BUTTON_PRESSED_FOR_CONTINUOUS_BREWING;
-        } else {
-            m_btnReleasedAfterPressedForProgram = true;
-            ret = BUTTON_NOT_PRESSED;
-        }
-    } else if (m_btn->pressedFor(MILLIS_TO_ENTER_PROGRAM_MODE) && m_btnReleasedAfterPressedForProgram) {
-        m_btnReleasedAfterPressedForProgram = false;
-        m_lastActionMs = millis();
-        ret = BUTTON_PRESSED_FOR_PROGRAM;
+        ret = BUTTON_PRESSED_FOR_CONTINUOUS_BREWING;
     }
 
     return ret;
@@ -154,96 +429,185 @@ ButtonAction ContinuousBrewOption::loop()
 bool BrewOption::canFinishBrewing(unsigned long elapsedBrewMillis, long pulseCount) {
 
     if(pulseCount >= doseFlowmeterCount) {
-        DEBUG3_VALUELN("Flow count reached: ", pulseCount);
+        DEBUG3_VALUELN(F("Flow count reached: "), pulseCount);
+        m_stopReason = STOP_BY_FLOWMETER;
         return true;
     } else if (pulseCount <= 3 && elapsedBrewMillis >= doseDurationMillis) {
         /* if flowmeter pulses are not being incremented for malfunction
          * stop brewing based on duration */
-        DEBUG3_PRINTLN("No flowmeter activity detected. Brewing timed out by duration.");
+        DEBUG3_PRINTLN(F("No flowmeter activity detected. Brewing timed out by duration."));
+        m_stopReason = STOP_BY_NO_FLOW_TIMEOUT;
         return true;
-    } else if (elapsedBrewMillis >= doseDurationMillis * 2) {
+    } else if (elapsedBrewMillis >= getDoseTimeoutMillis()) {
         /* maybe water is not flowing because of too fine ground coffee
-         * stop brewing after 2 times the duration config */
-        DEBUG3_PRINTLN("Flowmeter count is not evolving. Stoping brewing after 2 X duration config.");
+         * stop brewing after 2 times the duration config (or the adaptive timeout) */
+        DEBUG3_PRINTLN(F("Flowmeter count is not evolving. Stoping brewing after dosage timeout."));
+        m_stopReason = STOP_BY_MAX_DURATION;
         return true;
     }
 
     return false;
 }
 
+/*----------------------------------------------------------------------*
+/ time-based dosing, used while the flowmeter is diagnosed unhealthy    *
+/-----------------------------------------------------------------------*/
+bool BrewOption::canFinishBrewingByTime(unsigned long elapsedBrewMillis) {
+    if (elapsedBrewMillis >= doseDurationMillis) {
+        DEBUG3_PRINTLN(F("Flowmeter unhealthy. Brewing stopped by duration config."));
+        m_stopReason = STOP_BY_DURATION;
+        return true;
+    }
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+/ weight-based dosing: stop once the weight predicted after drip        *
+/ reaches the target, with the dosage timeout as a fallback             *
+/-----------------------------------------------------------------------*/
+bool BrewOption::canFinishBrewingByWeight(unsigned long elapsedBrewMillis, int16_t predictedWeight, uint16_t targetWeight) {
+    if (predictedWeight >= (int16_t) targetWeight) {
+        DEBUG3_VALUELN(F("Predicted weight reached (0.1 g): "), predictedWeight);
+        m_stopReason = STOP_BY_WEIGHT;
+        return true;
+    } else if (elapsedBrewMillis >= getDoseTimeoutMillis()) {
+        DEBUG3_PRINTLN(F("Weight not evolving. Stoping brewing after dosage timeout."));
+        m_stopReason = STOP_BY_MAX_DURATION;
+        return true;
+    }
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+/ max brewing time when flowmeter count is not evolving. With adaptive  *
+/ timeout enabled, once there are enough shots the limit follows the    *
+/ observed shot times, bounded by duration config and 2 X its value     *
+/-----------------------------------------------------------------------*/
+unsigned long BrewOption::getDoseTimeoutMillis() {
+#if ADAPTIVE_DOSE_TIMEOUT
+    if (shotStats.count >= SHOT_STATS_MIN_SAMPLES) {
+        unsigned long timeout = shotStats.getMeanDurationMillis() + ADAPTIVE_TIMEOUT_SIGMAS * shotStats.getStdDevDurationMillis();
+        return constrain(timeout, doseDurationMillis, doseDurationMillis * 2);
+    }
+#endif
+    return doseDurationMillis * 2;
+}
+
+/*----------------------------------------------------------------------*
+/ true when mean shot time is out of the band around the programmed     *
+/ duration, meaning the grinder needs adjustment                        *
+/-----------------------------------------------------------------------*/
+bool BrewOption::isDrifting() {
+    if (shotStats.count < SHOT_STATS_MIN_SAMPLES) {
+        return false;
+    }
+    unsigned long mean = shotStats.getMeanDurationMillis();
+    unsigned long band = doseDurationMillis * SHOT_DRIFT_BAND_PERCENT / 100;
+    return mean > doseDurationMillis + band || mean + band < doseDurationMillis;
+}
+
 bool ContinuousBrewOption::canFinishBrewing(unsigned long elapsedBrewMillis, long pulseCount) {
+    if (elapsedBrewMillis >= MAX_CONTINUOUS_BREW_MILLIS) {
+        DEBUG3_PRINTLN(F("Continuous brewing reached max duration."));
+        m_stopReason = STOP_BY_MAX_DURATION;
+        return true;
+    }
     return false;
 }
 
-void BrewGroup::startBrewing(BrewOption* brewOption) {
+bool BrewGroup::startBrewing(BrewOption* brewOption, bool isProgramming) {
+    if (m_ptrExpressoMachine->getSafetySupervisor()->isPumpCoolingDown()) {
+        DEBUG2_VALUELN(F("Pump cooling down, not brewing on group "), m_groupNumber);
+        return false;
+    }
     // start brewing
-    DEBUG3_VALUELN("Start brewing on group ", m_groupNumber);
+    DEBUG3_VALUELN(F("Start brewing on group "), m_groupNumber);
     ptrCurrentBrewingOption = brewOption;                               //!< set brewing option on correponding group
     setStatusLeds(OFF, ALL);                                            //!< set all led status to OFF
-    ptrCurrentBrewingOption->onStartBrewing(m_ptrExpressoMachine->isOnProgrammingMode);
+    ptrCurrentBrewingOption->onStartBrewing(isProgramming);
     m_flowMeter->reset();                                               //!< reset flowmeter count
     m_brewingStartTime = millis();                                      //!< store brewing start time
     m_ptrExpressoMachine->turnOffBoilerSolenoid();                      //!< ensure boiler solenoid is OFF before start pumping water
     turnOnGroupSolenoid();                                              //!< turn ON solenoid on corresponding group
     m_ptrExpressoMachine->turnOnPump();                                 //!< turn ON water pump
+    m_scaleTared = m_loadCell != NULL && m_loadCell->tare();           //!< weigh only what goes into the cup, volumetric dosing if the cup is not still
+    m_weightDosing = !isProgramming && m_scaleTared && m_loadCell->getTarget(getBrewingOptionIndex()) > 0;
+    if (!isProgramming && !m_weightDosing && m_flowMeter->diagnostics.isHealthy()
+        && ptrCurrentBrewingOption != m_brewOptions[CONTINUOUS_BREW_OPTION_INDEX]) {
+        // flowmeter ISR closes the solenoid as soon as the dose is reached
+        m_flowMeter->arm(ptrCurrentBrewingOption->doseFlowmeterCount, m_ptrExpressoMachine->getSafetySupervisor(), m_groupNumber-1);
+    }
+    return true;
 }
 
-void BrewGroup::stopBrewing() {
+void BrewGroup::stopBrewing(bool isProgramming) {
     // stop brewing
-    DEBUG3_VALUE("Stop brewing on group ", m_groupNumber);
-    DEBUG3_VALUE(". Brew time: ", ((millis() - m_brewingStartTime) / 1000));
-    DEBUG3_VALUELN(". Flowmeter count: ", m_flowMeter->getPulseCount());
+    DEBUG3_VALUE(F("Stop brewing on group "), m_groupNumber);
+    DEBUG3_VALUE(F(". Brew time: "), ((millis() - m_brewingStartTime) / 1000));
+    DEBUG3_VALUELN(F(". Flowmeter count: "), m_flowMeter->getPulseCount());
+    m_flowMeter->disarm();
     // only turn off pump if other groups are not brewing
     m_ptrExpressoMachine->turnOffPump(this);
     turnOffGroupSolenoid();
-    ptrCurrentBrewingOption->onEndBrewing(m_brewingStartTime, m_flowMeter->getPulseCount(), m_ptrExpressoMachine->isOnProgrammingMode);
-    if (m_ptrExpressoMachine->isOnProgrammingMode)
+    ptrCurrentBrewingOption->onEndBrewing(m_brewingStartTime, m_flowMeter->getPulseCount(), isProgramming);
+    m_flowMeter->diagnoseShot(millis() - m_brewingStartTime);
+    m_ptrExpressoMachine->getUsageCounters()->countShot(m_groupNumber, getBrewOptionIndex(ptrCurrentBrewingOption), m_flowMeter->getPulseCount());
+    if (m_ptrExpressoMachine->getShotLog() != NULL) {
+        m_ptrExpressoMachine->getShotLog()->add(m_groupNumber, getBrewOptionIndex(ptrCurrentBrewingOption), ptrCurrentBrewingOption->getStopReason(),
+                                                millis() - m_brewingStartTime, m_flowMeter->getPulseCount());
+    }
+    if (isProgramming && m_scaleTared && m_loadCell->isReady()) {
+        m_loadCell->setTarget(m_groupNumber, m_recipeBank, getBrewingOptionIndex(), m_loadCell->getPredictedWeight());
+    }
+    if (isProgramming)
     {
         setStatusLeds(ON, ONLY_PROGRAMMED);
         saveDosageRecord();
-        m_programmedCount = 0;
-        for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
-            if (i != CONTINUOUS_BREW_OPTION_INDEX && m_brewOptions[i]->flagProgrammed) {
-                m_programmedCount++;
-            }
-        }
-        if (m_programmedCount == BREW_OPTIONS_LEN-1 && m_ptrExpressoMachine->ptrFirstCompletedProgramming == NULL)
-        {
-            m_ptrExpressoMachine->setFirstCompletedProgramming(this);
-        }
-        
     }
     ptrCurrentBrewingOption = NULL;
 }
 
 void BrewGroup::turnOnGroupSolenoid() {
-    DEBUG3_VALUELN("Turning ON solenoid of group ", m_groupNumber);
+    DEBUG3_VALUELN(F("Turning ON solenoid of group "), m_groupNumber);
     digitalWrite(m_solenoidPin, LOW);                              //!< LOW turns solenoid ON
+    m_ptrExpressoMachine->getSafetySupervisor()->outputOn(m_groupNumber-1);
 }
 
 void BrewGroup::turnOffGroupSolenoid() {
-    DEBUG3_VALUELN("Turning OFF solenoid of group ", m_groupNumber);
+    DEBUG3_VALUELN(F("Turning OFF solenoid of group "), m_groupNumber);
     digitalWrite(m_solenoidPin, HIGH);                             //!< HIGH turns solenoid OFF
+    m_ptrExpressoMachine->getSafetySupervisor()->outputOff(m_groupNumber-1);
 }
 
-void BrewGroup::setup(){
-
-    DEBUG3_VALUELN("setup() on group ", m_groupNumber);
+void BrewGroup::setup(uint8_t recipeBank){
 
-    DosageRecord dosageConfig = loadDosageRecord();
+    DEBUG3_VALUELN(F("setup() on group "), m_groupNumber);
 
-    m_brewOptions = new BrewOption*[BREW_OPTIONS_LEN];
+    for (uint8_t bank = 0; bank < RECIPE_BANKS_LEN; bank++) {
+        m_recipeBanks[bank] = loadDosageRecord(bank);
+    }
+    m_recipeBank = recipeBank < RECIPE_BANKS_LEN ? recipeBank : 0;
+    DosageRecord& dosageConfig = m_recipeBanks[m_recipeBank];
+    if (m_loadCell != NULL) {
+        m_loadCell->loadTargets(m_groupNumber, m_recipeBank);
+    }
 
+    /* brew options are members of the group (no heap allocation), dosed options
+       fill the slots before and after the continuous option index */
+    int8_t dosedIndex = 0;
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++)
     {
         long flowMeterPulseConfig = 0;
         long durationConfig = 0;
+        int8_t pin = pgm_read_byte(&m_brewOptionPins[i]);
         if (CONTINUOUS_BREW_OPTION_INDEX != i) {
             flowMeterPulseConfig = dosageConfig.flowMeterPulseArray[i];
             durationConfig = dosageConfig.durationArray[i];
-            m_brewOptions[i] = new BrewOption(m_brewOptionPins[i], flowMeterPulseConfig, durationConfig, this);
+            m_dosedBrewOptions[dosedIndex] = BrewOption(pin, flowMeterPulseConfig, durationConfig, this);
+            m_brewOptions[i] = &m_dosedBrewOptions[dosedIndex++];
         } else {
-            m_brewOptions[i] = new ContinuousBrewOption(m_brewOptionPins[i], this);
+            m_continuousBrewOption = ContinuousBrewOption(pin, this);
+            m_brewOptions[i] = &m_continuousBrewOption;
         }
     }
 
@@ -258,9 +622,8 @@ void BrewGroup::setup(){
 }
 
 void BrewGroup::enterProgrammingMode() {
-    DEBUG2_PRINT("Entering programming mode");
-    m_ptrExpressoMachine->enterProgrammingMode();
-    m_programmedCount = 0;
+    DEBUG2_VALUELN(F("Entering programming mode on group "), m_groupNumber);
+    clearShotQueue();
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++)
     {
         m_brewOptions[i]->flagProgrammed = false;
@@ -269,8 +632,8 @@ void BrewGroup::enterProgrammingMode() {
 }
 
 void BrewGroup::exitProgrammingMode() {
-    DEBUG2_PRINT("Exiting programming mode");
-    m_ptrExpressoMachine->exitProgrammingMode();
+    DEBUG2_VALUELN(F("Exiting programming mode on group "), m_groupNumber);
+    m_showCopyRefused = false;
     for (int8_t i = 0; i < BREW_OPTIONS_LEN;i++)
     {
         m_brewOptions[i]->flagProgrammed = false;
@@ -279,35 +642,36 @@ void BrewGroup::exitProgrammingMode() {
 }
 
 void BrewGroup::setStatusLeds(LedStatus s, FilterOption filter) {
-    DEBUG4_VALUE("Setting leds of group ", m_groupNumber);
-    DEBUG4_VALUELN(" to ", s == ON ? "ON" : "OFF" );
+    DEBUG4_VALUE(F("Setting leds of group "), m_groupNumber);
+    DEBUG4_VALUELN(F(" to "), s == ON ? F("ON") : F("OFF"));
     
     for(int8_t i=0; i<BREW_OPTIONS_LEN; i++){
         if ( (filter == ONLY_PROGRAMMED && m_brewOptions[i]->flagProgrammed)
             || (filter == ONLY_NOT_PROGRAMMED && !m_brewOptions[i]->flagProgrammed)
             || filter == ALL ) {
-            DEBUG5_VALUELN("  -> brew option ", i+1 );
+            DEBUG5_VALUELN(F("  -> brew option "), i+1 );
             m_brewOptions[i]->ledStatus = s;
         }
     }
 }
 
-DosageRecord BrewGroup::loadDosageRecord() {
+DosageRecord BrewGroup::loadDosageRecord(uint8_t bank) {
 
     DosageRecord rec = DosageRecord();
     int8_t ret = -1;
 
     if (EEPROM_init()) {
-        DEBUG3_VALUELN("Loading dosage config from EEPROM for group ", m_groupNumber);
+        DEBUG3_VALUE(F("Loading dosage config from EEPROM for group "), m_groupNumber);
+        DEBUG3_VALUELN(F(", bank "), bank+1);
         size_t dataLen = sizeof(DosageRecord);
-        size_t location = EEPROM_SIZE( dataLen ) * (m_groupNumber-1);
+        size_t location = dosageRecordLocation(m_groupNumber, bank);
 
         #if DEBUG_LEVEL >= DEBUG_ERROR
             ret = EEPROM_safe_read(location, (uint8_t*) &rec, dataLen);
             if (ret < 0) {
-                DEBUG1_VALUE("Error reading dosage record for group ", m_groupNumber);
-                DEBUG1_VALUE(" at location: ", location);
-                DEBUG1_VALUELN(". EEPROM_safe_write returned: ", ret);
+                DEBUG1_VALUE(F("Error reading dosage record for group "), m_groupNumber);
+                DEBUG1_VALUE(F(" at location: "), location);
+                DEBUG1_VALUELN(F(". EEPROM_safe_write returned: "), ret);
             }
         #else
             ret = EEPROM_safe_read(location, (uint8_t*) &rec, dataLen);
@@ -346,9 +710,14 @@ DosageRecord BrewGroup::loadDosageRecord() {
 }
 
 
-void BrewGroup::saveDosageRecord() {
+/*----------------------------------------------------------------------*
+/ store dosage of the brew options in the selected recipe bank. The     *
+/ record is kept in RAM when the write is refused or fails, returns      *
+/ false then and loop() writes it later                                 *
+/-----------------------------------------------------------------------*/
+bool BrewGroup::saveDosageRecord() {
 
-    DosageRecord rec = DosageRecord();
+    DosageRecord& rec = m_recipeBanks[m_recipeBank];
 
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
         if (i != CONTINUOUS_BREW_OPTION_INDEX) {
@@ -356,72 +725,169 @@ void BrewGroup::saveDosageRecord() {
             rec.flowMeterPulseArray[i] = m_brewOptions[i]->doseFlowmeterCount;
         }
     }
-    
+
+    return writeDosageRecord(m_recipeBank);
+}
+
+bool BrewGroup::writeDosageRecord(uint8_t bank) {
+
+    DosageRecord& rec = m_recipeBanks[bank];
     size_t dataLen = sizeof(rec);
-    int location = 0;
-    if (m_groupNumber > 1) {
-        location = EEPROM_SIZE( dataLen ) * (m_groupNumber-1);
-    }
+    int location = dosageRecordLocation(m_groupNumber, bank);
 
-    DEBUG2_VALUE("Saving dosage record for group ", m_groupNumber);
-    DEBUG2_VALUELN(" on EEPROM @ location ", location);
+    DEBUG2_VALUE(F("Saving dosage record for group "), m_groupNumber);
+    DEBUG2_VALUE(F(", bank "), bank+1);
+    DEBUG2_VALUELN(F(" on EEPROM @ location "), location);
 
     EEPROM_init();
-
-    #if DEBUG_LEVEL >= DEBUG_ERROR
-        int ret = EEPROM_safe_write(location, (uint8_t*) &rec, dataLen);
-        #if DEBUG_LEVEL >= DEBUG_LEVEL_LOW
-            if (ret > 0) {
-                DEBUG2_VALUE("Success saving dosage record for group ", m_groupNumber);
-                DEBUG2_VALUE(". ", dataLen);
-                DEBUG2_VALUELN(" bytes writen to EEPROM at location: ", location);
-
-                DEBUG3_PRINT("  [");
-                for (size_t i = 0; i < dataLen; i++)
-                {
-                    DEBUG3_HEXVAL(" ", ((uint8_t*) &rec)[i]);
-                }
-                DEBUG3_PRINTLN(" ]");
+    m_dosageSaveAttemptMs = millis();
+    int ret = boundedEepromWrite(location, (uint8_t*) &rec, dataLen);
+
+    #if DEBUG_LEVEL >= DEBUG_LEVEL_LOW
+        if (ret > 0) {
+            DEBUG2_VALUE(F("Success saving dosage record for group "), m_groupNumber);
+            DEBUG2_VALUE(F(". "), dataLen);
+            DEBUG2_VALUELN(F(" bytes writen to EEPROM at location: "), location);
+
+            DEBUG3_PRINT(F("  ["));
+            for (size_t i = 0; i < dataLen; i++)
+            {
+                DEBUG3_HEXVAL(F(" "), ((uint8_t*) &rec)[i]);
             }
-        #endif
-
-        if (ret < 0) {
-            DEBUG1_VALUELN("Error saving dosage record. EEPROM_safe_write returned: ", ret);
+            DEBUG3_PRINTLN(F(" ]"));
         }
-    #else
-        EEPROM_safe_write(location, (uint8_t*) &rec, dataLen);
     #endif
 
+    if (ret < 0) {
+        DEBUG1_VALUELN(F("Error saving dosage record, retrying later. EEPROM_safe_write returned: "), ret);
+        m_unsavedBanksMask |= 1 << bank;
+        return false;
+    }
+    m_unsavedBanksMask &= ~(1 << bank);
+    return true;
 }
 
-bool BrewGroup::allOptionsWaitingForProgramming() {
+int8_t BrewGroup::getBrewOptionIndex(BrewOption* brewOption) {
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
-        if (i != CONTINUOUS_BREW_OPTION_INDEX && m_brewOptions[i]->flagProgrammed) {
-            return false;
+        if (m_brewOptions[i] == brewOption) {
+            return i;
         }
     }
-    return true;
+    return -1;
 }
 
-void BrewGroup::copyDosageConfig(BrewGroup* from) {
+/*----------------------------------------------------------------------*
+/ apply dosage record of another recipe bank, already in RAM, to the    *
+/ brew options. Only allowed while group is idle and out of prog mode. *
+/ Shot statistics of the options restart: they were measured against  *
+/ the dosage of the previous bank                                       *
+/-----------------------------------------------------------------------*/
+bool BrewGroup::selectRecipeBank(uint8_t bank) {
+    if (bank >= RECIPE_BANKS_LEN || m_state != GROUP_IDLE) {
+        return false;
+    }
+
+    m_recipeBank = bank;
+    if (m_loadCell != NULL) {
+        m_loadCell->loadTargets(m_groupNumber, bank);
+    }
+    DosageRecord& rec = m_recipeBanks[bank];
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
         if (i != CONTINUOUS_BREW_OPTION_INDEX) {
+            m_brewOptions[i]->setDosageConfig(rec.durationArray[i] * 1000UL, rec.flowMeterPulseArray[i]);
+            m_brewOptions[i]->shotStats.reset();
+        }
+    }
+
+    setStatusLeds(OFF, ALL);
+    m_brewOptions[bank]->ledStatus = ON;
+    m_showRecipeBank = true;
+    m_recipeBankSelectedMs = millis();
+
+    DEBUG2_VALUE(F("Recipe bank "), bank+1);
+    DEBUG2_VALUELN(F(" selected on group "), m_groupNumber);
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+/ take dosage of another group into the selected recipe bank. Only      *
+/ allowed while group is idle and out of prog mode, so the source may   *
+/ be programmed while this group keeps brewing. A source on prog mode   *
+/ gives only the options programmed this session, any other source all  *
+/ of them. Returns false when nothing was copied or when the record     *
+/ was refused by the EEPROM and is only pending, retried later          *
+/-----------------------------------------------------------------------*/
+bool BrewGroup::copyDosageConfig(BrewGroup* from) {
+    if (from == this || m_state != GROUP_IDLE) {
+        return false;
+    }
+
+    bool onlyProgrammed = from->isOnProgrammingMode();
+    bool copied = false;
+    for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
+        if (i != CONTINUOUS_BREW_OPTION_INDEX && (!onlyProgrammed || from->m_brewOptions[i]->flagProgrammed)) {
             m_brewOptions[i]->setDosageConfig(from->m_brewOptions[i]->doseDurationMillis, from->m_brewOptions[i]->doseFlowmeterCount);
-            m_brewOptions[i]->flagProgrammed = true;
+            m_brewOptions[i]->shotStats.reset();
+            copied = true;
         }
     }
-    saveDosageRecord();
+    if (!copied) {
+        DEBUG2_VALUELN(F("Dosage not copied, no option programmed on group "), from->m_groupNumber);
+        return false;
+    }
+    if (!saveDosageRecord()) {
+        DEBUG2_VALUELN(F("Dosage copied but not saved yet on group "), m_groupNumber);
+        return false;
+    }
+
+    setStatusLeds(ON, ALL);
+    m_brewOptions[CONTINUOUS_BREW_OPTION_INDEX]->ledStatus = OFF;
+    m_showRecipeBank = true;
+    m_recipeBankSelectedMs = millis();
+
+    DEBUG2_VALUE(F("Dosage of group "), from->m_groupNumber);
+    DEBUG2_VALUELN(F(" copied to group "), m_groupNumber);
+    return true;
 }
 
-void BrewOption::onEndBrewing(long brewingStartMillis, long lastFlowmeterCount, bool isProgramming) {
-    DEBUG3_VALUELN("End brewing. Option's pin: ", m_pin);
+/*----------------------------------------------------------------------*
+/ the group solenoid is only open while the group brews, and the group  *
+/ brews exactly in the brewing states. Closes the solenoid and returns   *
+/ false on violation                                                    *
+/-----------------------------------------------------------------------*/
+bool BrewGroup::checkInvariants() {
+    bool brewingState = m_state == GROUP_BREWING || m_state == GROUP_PROGRAMMING_BREWING || m_state == GROUP_BREWING_PROGRAMMING_PENDING;
+    bool ok = brewingState == (ptrCurrentBrewingOption != NULL);
+    if (!brewingState && digitalRead(m_solenoidPin) == LOW) {
+        turnOffGroupSolenoid();
+        ok = false;
+    }
+    if (!ok) {
+        DEBUG1_VALUE(F("Invariant violated on group "), m_groupNumber);
+        DEBUG1_VALUELN(F(", state "), m_state);
+    }
+    return ok;
+}
 
-    m_btn->begin();     //!< reset button status
+void BrewOption::onEndBrewing(unsigned long brewingStartMillis, long lastFlowmeterCount, bool isProgramming) {
+    DEBUG3_VALUELN(F("End brewing. Option's pin: "), m_pin);
+
+    m_btn.begin();     //!< reset button status
     if (isProgramming) {
         setDosageConfig(millis() - brewingStartMillis, lastFlowmeterCount);
+        shotStats.reset();                  //!< new dosage config, previous shots are no longer a reference
         flagProgrammed = true;
         ledStatus = ON;
     } else {
+        // shots stopped by the user say nothing about the grind, nor do continuous shots
+        if (m_dosed && (m_stopReason == STOP_BY_FLOWMETER || m_stopReason == STOP_BY_WEIGHT || m_stopReason == STOP_BY_NO_FLOW_TIMEOUT || m_stopReason == STOP_BY_MAX_DURATION)) {
+            shotStats.addShot(millis() - brewingStartMillis, lastFlowmeterCount, m_stopReason != STOP_BY_FLOWMETER && m_stopReason != STOP_BY_WEIGHT);
+            DEBUG3_VALUE(F("Shot stats. Count: "), shotStats.count);
+            DEBUG3_VALUE(F(". Mean duration(ms): "), shotStats.getMeanDurationMillis());
+            DEBUG3_VALUE(F(". Std dev(ms): "), shotStats.getStdDevDurationMillis());
+            DEBUG3_VALUE(F(". Mean pulses: "), shotStats.getMeanPulseCount());
+            DEBUG3_VALUELN(F(". Timeouts(%): "), shotStats.getTimeoutPercent());
+        }
         ledStatus = OFF;
     }
 }
@@ -430,15 +896,16 @@ void BrewOption::onStartBrewing(bool isProgramming) {
     if (isProgramming) {
         flagProgrammed = false;
     }
+    m_stopReason = STOP_NONE;
     ledStatus = ON;
 }
 
 void BrewOption::turnOnLed()
 {
 	// turn LED on if button is released
-    if (m_btn->isReleased())
+    if (m_btn.isReleased())
     {
-        DEBUG5_VALUELN("Turning ON LED on pin ", m_pin);
+        DEBUG5_VALUELN(F("Turning ON LED on pin "), m_pin);
         digitalWrite(m_pin, LOW);
         pinMode(m_pin, OUTPUT);
         m_pinMode = OUTPUT;
@@ -450,24 +917,83 @@ void BrewOption::setDosageConfig(unsigned long durationParamMillis, long flowmet
     doseDurationMillis = durationParamMillis < MIN_DOSE_DURATION_CONFIG ? MIN_DOSE_DURATION_CONFIG : durationParamMillis;
 }
 
+/*----------------------------------------------------------------------*
+/ account a finished shot. Mean and variance are updated with Welford's *
+/ method using n = min(count, SHOT_STATS_WINDOW), so after the window   *
+/ is filled they follow recent shots as an exponential moving average   *
+/-----------------------------------------------------------------------*/
+static uint16_t updateMeanAndVariance(uint16_t& mean, uint16_t variance, uint16_t sample, uint8_t n) {
+    long x = (long) sample << SHOT_STATS_FRACTION_BITS;
+    long delta = x - mean;
+    mean += delta / n;
+    // delta and x - mean have the same sign, their product needs 32 unsigned bits
+    long m2 = ((unsigned long) labs(delta) * labs(x - mean)) >> (2 * SHOT_STATS_FRACTION_BITS);
+    long var = (long) variance + (m2 - (long) variance) / n;
+    return constrain(var, 0L, 0xFFFFL);
+}
+
+void ShotStatistics::addShot(unsigned long durationMillis, long pulseCount, bool timedOut) {
+    const uint16_t maxSample = 0xFFFF >> SHOT_STATS_FRACTION_BITS;
+    uint16_t durationTenths = durationMillis / 100 > maxSample ? maxSample : durationMillis / 100;
+    uint16_t pulses = pulseCount > maxSample ? maxSample : (pulseCount < 0 ? 0 : pulseCount);
+
+    if (count < 0xFFFF) {
+        count++;
+    }
+    if (timedOut && timeoutCount < 0xFFFF) {
+        timeoutCount++;
+    }
+    uint8_t n = count < SHOT_STATS_WINDOW ? count : SHOT_STATS_WINDOW;
+    durationVariance = updateMeanAndVariance(durationMean, durationVariance, durationTenths, n);
+    pulseVariance = updateMeanAndVariance(pulseMean, pulseVariance, pulses, n);
+}
+
+unsigned long ShotStatistics::getStdDevDurationMillis() {
+    // integer square root of the variance (1/10 s units)
+    uint16_t root = 0;
+    for (uint16_t bit = 1 << 7; bit > 0; bit >>= 1) {
+        uint16_t trial = root | bit;
+        if ((unsigned long) trial * trial <= durationVariance) {
+            root = trial;
+        }
+    }
+    return (unsigned long) root * 100;
+}
+
 void ExpressoMachine::setup() {
 
-    DEBUG4_PRINTLN("setup() on ExpressoMachine instance");
+    DEBUG4_PRINTLN(F("setup() on ExpressoMachine instance"));
 
      pinMode(m_pumpPin, OUTPUT);
      pinMode(m_solenoidBoilderPin, OUTPUT);
      pinMode(m_waterLevelPin, INPUT);
 
+    RecipeBankIndex index = loadRecipeBankIndex();
+
     for (int8_t i = 0; i < m_lenBrewGroups; i++)
     {
-        m_brewGroups[i].setup();
+        DEBUG3_VALUELN(F("ExpressoMachine::setup() - group "), m_brewGroups[i].getGroupNumber());
+        if (m_brewGroups[i].getLoadCell() != NULL) {
+            m_brewGroups[i].getLoadCell()->setup(WEIGHT_TARGETS_LOCATION);
+        }
+        m_brewGroups[i].setup(index.activeBankArray[m_brewGroups[i].getGroupNumber()-1]);
+        m_safetySupervisor->attach(m_brewGroups[i].getGroupNumber()-1, m_brewGroups[i].getSolenoidPin(), MAX_SOLENOID_OPEN_MILLIS);
     }
+    m_safetySupervisor->attach(SAFETY_BOILER_CHANNEL, m_solenoidBoilderPin, BOILER_FILL_TIMEOUT_MILLIS);
+    m_safetySupervisor->attach(SAFETY_PUMP_CHANNEL, m_pumpPin, MAX_PUMP_ON_MILLIS);
+    m_safetySupervisor->begin();
+    m_usageCounters->setup(USAGE_COUNTERS_LOCATION);
     m_flagSetup = true;
 }
 
 void ExpressoMachine::turnOnPump() {
-    DEBUG3_PRINTLN("Turning ON pump");
+    DEBUG3_PRINTLN(F("Turning ON pump"));
     digitalWrite(m_pumpPin, LOW);        //!< LOW turns pump ON
+    m_safetySupervisor->outputOn(SAFETY_PUMP_CHANNEL);
+    if (!m_pumpOn) {
+        m_pumpOn = true;
+        m_pumpOnMs = millis();
+    }
 }
 
 /*----------------------------------------------------------------------*
@@ -479,7 +1005,7 @@ void ExpressoMachine::turnOffPump(BrewGroup* brewGroupAsking) {
     {
         if (m_brewGroups[i].ptrCurrentBrewingOption != NULL && brewGroupAsking != &m_brewGroups[i])
         {
-            DEBUG3_VALUELN("Not stopping pump, other group brewing: ", m_brewGroups[i].getGroupNumber());
+            DEBUG3_VALUELN(F("Not stopping pump, other group brewing: "), m_brewGroups[i].getGroupNumber());
             return;
         }
     }
@@ -490,18 +1016,25 @@ void ExpressoMachine::turnOffPump(BrewGroup* brewGroupAsking) {
 / imediatelly turn off water pump                                       *
 /-----------------------------------------------------------------------*/
 void ExpressoMachine::turnOffPump() {
-    DEBUG3_PRINTLN("Turning OFF pump");
+    DEBUG3_PRINTLN(F("Turning OFF pump"));
     digitalWrite(m_pumpPin, HIGH);                   //!< HIGH turns pump OFF
+    m_safetySupervisor->outputOff(SAFETY_PUMP_CHANNEL);
+    if (m_pumpOn) {
+        m_pumpOn = false;
+        m_usageCounters->addPumpRuntime(millis() - m_pumpOnMs);
+    }
 }
 
 void ExpressoMachine::turnOnBoilerSolenoid() {
-    DEBUG3_PRINTLN("Turning ON boiler solenoid");
+    DEBUG3_PRINTLN(F("Turning ON boiler solenoid"));
      digitalWrite(m_solenoidBoilderPin, LOW);        //!< LOW turns solenoid ON
+    m_safetySupervisor->outputOn(SAFETY_BOILER_CHANNEL);
 }
 void ExpressoMachine::turnOffBoilerSolenoid() {
-    DEBUG3_PRINTLN("Turning OFF boiler solenoid");
+    DEBUG3_PRINTLN(F("Turning OFF boiler solenoid"));
     m_fillingBoiler = false;
     digitalWrite(m_solenoidBoilderPin, HIGH);        //!< HIGH turns solenoid OFF
+    m_safetySupervisor->outputOff(SAFETY_BOILER_CHANNEL);
 }
 
 /*----------------------------------------------------------------------*
@@ -513,15 +1046,16 @@ bool ExpressoMachine::isBoilerWaterLevelLow() {
 }
 
 void ExpressoMachine::startFillingBoiler() {
-    DEBUG3_PRINTLN("Starting to fill the boiler");
+    DEBUG3_PRINTLN(F("Starting to fill the boiler"));
     turnOnBoilerSolenoid();
     turnOnPump();
+    m_usageCounters->countBoilerFill();
     m_fillingBoiler = true;
-    m_waterLevelReachedMs = 0;
+    m_waterLevelReached = false;
 }
 
 void ExpressoMachine::stopFillingBoiler() {
-    DEBUG3_PRINTLN("Stopping to fill the boiler");
+    DEBUG3_PRINTLN(F("Stopping to fill the boiler"));
     turnOffPump();
     turnOffBoilerSolenoid();
 }
@@ -542,26 +1076,35 @@ void ExpressoMachine::loop() {
     static unsigned long currentMillis = 0;
     static unsigned long previousLedsBlinkMillis = 0;
     static bool toggleBlinkLeds = false;
+    static unsigned long previousDriftLedsBlinkMillis = 0;
+    static bool toggleDriftLeds = false;
 
-    DEBUG5_PRINTLN("ExpressoMachine::loop()");
+    DEBUG5_PRINTLN(F("ExpressoMachine::loop()"));
 
     if (!m_flagSetup) {
-        DEBUG3_PRINTLN("setup not called for ExpressoMachine instance");
+        DEBUG3_PRINTLN(F("setup not called for ExpressoMachine instance"));
         return;
     }
 
+    handleSafetyTrips();
+
     toggleBlinkLeds = false;
     currentMillis = millis();
-    if (isOnProgrammingMode && !isBrewing) {
-        if ((currentMillis - previousLedsBlinkMillis) >= LEDS_BLINK_INTERVAL) {
-            toggleBlinkLeds = true;
-            previousLedsBlinkMillis = currentMillis;
-        }
+    if ((currentMillis - previousLedsBlinkMillis) >= LEDS_BLINK_INTERVAL) {
+        toggleBlinkLeds = true;
+        previousLedsBlinkMillis = currentMillis;
+    }
+
+    toggleDriftLeds = false;
+    if (!isBrewing && (currentMillis - previousDriftLedsBlinkMillis) >= DRIFT_LEDS_BLINK_INTERVAL) {
+        toggleDriftLeds = true;
+        previousDriftLedsBlinkMillis = currentMillis;
     }
 
     isBrewing = false;
     for (int8_t i = 0; i < m_lenBrewGroups; i++) {
         m_brewGroups[i].setToggleBlinkLeds(toggleBlinkLeds);
+        m_brewGroups[i].setToggleDriftLeds(toggleDriftLeds);
         m_brewGroups[i].loop();
         isBrewing = m_brewGroups[i].ptrCurrentBrewingOption != NULL || this->isBrewing;
     }
@@ -572,13 +1115,14 @@ void ExpressoMachine::loop() {
     // bool isFilling = isFillingBoiler();
 
     // check if bolier needs more water
-    if (lowLevel && !m_fillingBoiler) {
+    if (lowLevel && !m_fillingBoiler && !isSafetyFault()) {
         // bolier water level is low, start filling
         startFillingBoiler();
     } else if (m_fillingBoiler && !lowLevel) {
         
         currentMillis = millis();
-        if (m_waterLevelReachedMs == 0) {
+        if (!m_waterLevelReached) {
+            m_waterLevelReached = true;
             m_waterLevelReachedMs = currentMillis;
         }
 
@@ -590,27 +1134,291 @@ void ExpressoMachine::loop() {
     }
   }
 
+  m_usageCounters->loop(!isBrewing && !m_fillingBoiler);
+  if (m_recipeBankIndexPending && !isBrewing && !m_fillingBoiler) {
+      saveSelectedRecipeBanks();
+  }
+
+#if INVARIANT_CHECKS
+  checkInvariants();
+#endif
+}
+
+#if INVARIANT_CHECKS
+/*----------------------------------------------------------------------*
+/ pump only runs for a brewing group or boiler filling, boiler solenoid  *
+/ only opens while filling and never while a group brews               *
+/-----------------------------------------------------------------------*/
+void ExpressoMachine::checkInvariants() {
+
+    bool ok = true;
+    bool brewing = false;
+    for (int8_t i = 0; i < m_lenBrewGroups; i++) {
+        ok = m_brewGroups[i].checkInvariants() && ok;
+        brewing = brewing || m_brewGroups[i].ptrCurrentBrewingOption != NULL;
+    }
+
+    if (digitalRead(m_pumpPin) == LOW && !brewing && !m_fillingBoiler) {
+        DEBUG1_PRINTLN(F("Invariant violated: pump on without consumer"));
+        turnOffPump();
+        ok = false;
+    }
+    if (digitalRead(m_solenoidBoilderPin) == LOW && (!m_fillingBoiler || brewing)) {
+        DEBUG1_PRINTLN(F("Invariant violated: boiler solenoid open"));
+        turnOffBoilerSolenoid();
+        ok = false;
+    }
+
+    if (!ok && m_invariantViolations < 0xFF) {
+        m_invariantViolations++;
+    }
 }
+#endif
+
+/*----------------------------------------------------------------------*
+/ bring machine state in line with outputs forced off by the safety     *
+/ supervisor interrupt: stop brewing on affected groups, stop filling   *
+/-----------------------------------------------------------------------*/
+void ExpressoMachine::handleSafetyTrips() {
+
+    uint8_t tripped = m_safetySupervisor->getTrippedMask();
+    if (tripped == 0) {
+        return;
+    }
+
+    DEBUG1_VALUELN(F("Safety supervisor forced outputs off, channel mask: "), tripped);
+
+    for (int8_t i = 0; i < m_lenBrewGroups; i++) {
+        BrewGroup* group = &m_brewGroups[i];
+        if (tripped & ((1 << (group->getGroupNumber()-1)) | (1 << SAFETY_PUMP_CHANNEL))) {
+            group->dispatch(EVT_SAFETY_TRIP);
+        }
+    }
 
-void ExpressoMachine::setFirstCompletedProgramming(BrewGroup* ptrBrewGroup) {
-    DEBUG3_VALUELN("First group complete programmed: ", ptrBrewGroup->getGroupNumber());
-    this->ptrFirstCompletedProgramming = ptrBrewGroup;
+    if (m_fillingBoiler && (tripped & ((1 << SAFETY_BOILER_CHANNEL) | (1 << SAFETY_PUMP_CHANNEL)))) {
+        stopFillingBoiler();
+    }
+    if (tripped & (1 << SAFETY_BOILER_CHANNEL)) {
+        m_boilerFillFault = true;
+    }
+
+    m_safetySupervisor->acknowledge(tripped);
 }
 
-void ExpressoMachine::exitProgrammingMode() {
-    isOnProgrammingMode = false;
+bool ExpressoMachine::isOnProgrammingMode() {
     for (int8_t i = 0; i < m_lenBrewGroups; i++) {
-        m_brewGroups[i].setStatusLeds(OFF, ALL);
+        if (m_brewGroups[i].isOnProgrammingMode()) {
+            return true;
+        }
     }
-};
+    return false;
+}
+
+bool ExpressoMachine::copyDosageConfig(int8_t fromGroupNumber, int8_t toGroupNumber) {
+    BrewGroup* from = getBrewGroup(fromGroupNumber);
+    BrewGroup* to = getBrewGroup(toGroupNumber);
+    return from != NULL && to != NULL && to->copyDosageConfig(from);
+}
+
+RecipeBankIndex ExpressoMachine::loadRecipeBankIndex() {
+
+    RecipeBankIndex index = RecipeBankIndex();
+
+    if (EEPROM_init() && EEPROM_safe_read(RECIPE_INDEX_LOCATION, (uint8_t*) &index, sizeof(index)) < 0) {
+        DEBUG1_PRINTLN(F("Error reading recipe bank index, using defaults"));
+        index = RecipeBankIndex();
+    }
+    return index;
+}
+
+bool ExpressoMachine::saveRecipeBankIndex(RecipeBankIndex& index) {
+    EEPROM_init();
+    if (boundedEepromWrite(RECIPE_INDEX_LOCATION, (uint8_t*) &index, sizeof(index)) < 0) {
+        DEBUG1_PRINTLN(F("Error saving recipe bank index"));
+        return false;
+    }
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+/ switch recipe bank of a group. Switching only touches RAM, the index  *
+/ is saved by loop() once no group brews, like the usage counters       *
+/-----------------------------------------------------------------------*/
+bool ExpressoMachine::selectRecipeBank(int8_t groupNumber, uint8_t bank) {
+    BrewGroup* group = getBrewGroup(groupNumber);
+    if (group == NULL || !group->selectRecipeBank(bank)) {
+        return false;
+    }
+    m_recipeBankIndexPending = true;
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+/ selection stays pending until a write succeeds; a refused or failed  *
+/ write is retried after EEPROM_WRITE_REFILL_MILLIS                     *
+/-----------------------------------------------------------------------*/
+void ExpressoMachine::saveSelectedRecipeBanks() {
+    if (m_recipeBankIndexSaveFailed && millis() - m_recipeBankIndexSaveAttemptMs < EEPROM_WRITE_REFILL_MILLIS) {
+        return;
+    }
+    RecipeBankIndex index = loadRecipeBankIndex();
+    bool changed = false;
+    for (int8_t i = 0; i < m_lenBrewGroups; i++) {
+        uint8_t& activeBank = index.activeBankArray[m_brewGroups[i].getGroupNumber()-1];
+        if (activeBank != m_brewGroups[i].getRecipeBank()) {
+            activeBank = m_brewGroups[i].getRecipeBank();
+            changed = true;
+        }
+    }
+    if (changed) {
+        m_recipeBankIndexSaveAttemptMs = millis();
+        m_recipeBankIndexSaveFailed = !saveRecipeBankIndex(index);
+        if (m_recipeBankIndexSaveFailed) {
+            return;
+        }
+    }
+    m_recipeBankIndexPending = false;
+}
+
+void ExpressoMachine::getRecipeBankName(uint8_t bank, char name[RECIPE_NAME_LEN]) {
+    RecipeBankIndex index = loadRecipeBankIndex();
+    strncpy(name, index.nameArray[bank < RECIPE_BANKS_LEN ? bank : 0], RECIPE_NAME_LEN);
+    name[RECIPE_NAME_LEN-1] = '\0';
+}
+
+bool ExpressoMachine::setRecipeBankName(uint8_t bank, const char* name) {
+    if (bank >= RECIPE_BANKS_LEN) {
+        return false;
+    }
+    RecipeBankIndex index = loadRecipeBankIndex();
+    strncpy(index.nameArray[bank], name, RECIPE_NAME_LEN);
+    index.nameArray[bank][RECIPE_NAME_LEN-1] = '\0';
+    return saveRecipeBankIndex(index);
+}
 
 void SimpleFlowMeter::increment() {
+    unsigned long now = millis();
+    if (m_pulseCount == 0) {
+        m_firstPulseMs = now;
+    } else if (now - m_lastPulseMs > m_maxPulseIntervalMs) {
+        m_maxPulseIntervalMs = now - m_lastPulseMs > 0xFFFF ? 0xFFFF : now - m_lastPulseMs;
+    }
+    m_lastPulseMs = now;
     m_pulseCount++;                  //!< Increments flowmeter pulse counter.
-    DEBUG4_VALUELN("Pulse Count: ", m_pulseCount)
+    if (m_armed && m_pulseCount >= m_targetPulseCount) {
+        m_armed = false;
+        m_doseReached = true;
+        m_safetySupervisor->cutOff(m_solenoidChannel);             //!< close solenoid right away, main loop acknowledges
+    }
+    DEBUG4_VALUELN(F("Pulse Count: "), m_pulseCount)
+}
+
+void SimpleFlowMeter::reject() {
+    if (m_rejectedCount < 0xFFFF) {
+        m_rejectedCount++;           //!< Counts glitches rejected by debounce, for diagnostics.
+    }
 }
 
 void SimpleFlowMeter::reset() {
     cli();                               //!< going to change interrupt variable(s)
     m_pulseCount=0;                      //!< Prepares the flow meter for a fresh measurement. Resets pulse counter.
+    m_maxPulseIntervalMs = 0;
+    m_rejectedCount = 0;
+    m_armed = false;
+    m_doseReached = false;
     sei();                               //!< done changing interrupt variable(s)
 }
+
+/*----------------------------------------------------------------------*
+/ arm dose cutoff: increment() closes the solenoid channel (and the     *
+/ pump if nothing else draws water) when the target count is reached   *
+/-----------------------------------------------------------------------*/
+void SimpleFlowMeter::arm(long targetPulseCount, SafetySupervisor* safetySupervisor, uint8_t solenoidChannel) {
+    cli();
+    m_targetPulseCount = targetPulseCount;
+    m_safetySupervisor = safetySupervisor;
+    m_solenoidChannel = solenoidChannel;
+    m_doseReached = false;
+    m_armed = true;
+    sei();
+}
+
+void SimpleFlowMeter::disarm() {
+    m_armed = false;
+}
+
+/*----------------------------------------------------------------------*
+/ feed pulse statistics of the shot just finished to the diagnostics    *
+/-----------------------------------------------------------------------*/
+void SimpleFlowMeter::diagnoseShot(unsigned long elapsedBrewMillis) {
+    cli();
+    long pulseCount = m_pulseCount;
+    unsigned long pulsesMillis = m_lastPulseMs - m_firstPulseMs;
+    uint16_t maxInterval = m_maxPulseIntervalMs;
+    uint16_t rejectedCount = m_rejectedCount;
+    sei();
+
+    unsigned long meanInterval = pulseCount > 1 ? pulsesMillis / (pulseCount - 1) : 0;
+    diagnostics.addShot(elapsedBrewMillis, pulseCount, meanInterval, maxInterval, rejectedCount);
+}
+
+void FlowMeterDiagnostics::addShot(unsigned long elapsedBrewMillis, long pulseCount, unsigned long meanIntervalMillis, uint16_t maxIntervalMillis, uint16_t rejectedCount) {
+
+    if (elapsedBrewMillis < FLOW_DIAG_MIN_SHOT_MILLIS) {
+        return;
+    }
+
+    FlowMeterHealth health = FLOWMETER_HEALTHY;
+    if (pulseCount <= 3) {
+        health = FLOWMETER_STUCK;
+    } else if ((long) rejectedCount * FLOW_DIAG_REJECTED_RATIO > pulseCount) {
+        health = FLOWMETER_NOISY;
+    } else if (maxIntervalMillis > FLOW_DIAG_MAX_PULSE_GAP_MILLIS && maxIntervalMillis > meanIntervalMillis * FLOW_DIAG_GAP_TO_MEAN_RATIO) {
+        health = FLOWMETER_INTERMITTENT;
+    }
+
+    if (health != FLOWMETER_HEALTHY) {
+        m_lastFault = health;
+        m_score = m_score + FLOW_DIAG_FAULT_SCORE > FLOW_DIAG_MAX_SCORE ? FLOW_DIAG_MAX_SCORE : m_score + FLOW_DIAG_FAULT_SCORE;
+    } else if (m_score > 0) {
+        m_score--;
+    }
+
+    if (m_score >= FLOW_DIAG_UNHEALTHY_SCORE) {
+        m_unhealthy = true;
+    } else if (m_score == 0) {
+        m_unhealthy = false;
+    }
+
+    DEBUG3_VALUE(F("Flowmeter shot diagnosis: "), health);
+    DEBUG3_VALUE(F(". Score: "), m_score);
+    DEBUG3_VALUELN(F(". Unhealthy: "), m_unhealthy);
+}
+
+/*----------------------------------------------------------------------*
+/ EEPROM write with a token bucket budget, so no loop or button storm   *
+/ can wear out the EEPROM: EEPROM_WRITE_BURST writes, then one every     *
+/ EEPROM_WRITE_REFILL_MILLIS                                            *
+/-----------------------------------------------------------------------*/
+int8_t boundedEepromWrite(int location, uint8_t* data, size_t len) {
+
+    static uint8_t tokens = EEPROM_WRITE_BURST;
+    static unsigned long refillMs = 0;
+
+    unsigned long now = millis();
+    if (tokens == EEPROM_WRITE_BURST) {
+        refillMs = now;
+    } else {
+        while (now - refillMs >= EEPROM_WRITE_REFILL_MILLIS && tokens < EEPROM_WRITE_BURST) {
+            refillMs += EEPROM_WRITE_REFILL_MILLIS;
+            tokens++;
+        }
+    }
+
+    if (tokens == 0) {
+        DEBUG1_VALUELN(F("EEPROM write budget exhausted, write refused at location "), location);
+        return EEPROM_WRITE_REFUSED;
+    }
+    tokens--;
+    return EEPROM_safe_write(location, data, len);
+}
@@ -7,6 +7,7 @@
 #define EXPRESSO_COFFEE_H_INCLUDED
 
 #include "JC_Button.h"
+#include "SafetySupervisor.h"
 
 #include <Debug.h>
 
@@ -14,19 +15,124 @@ const int8_t BREW_GROUPS_LEN = 2;
 const int8_t BREW_OPTIONS_LEN = 5;
 
 const int8_t CONTINUOUS_BREW_OPTION_INDEX = 4;                        //!< index in brew option array correspoding to continuous brew option
+const int8_t NO_OPTION_PIN = -1;                                    //!< pin of a brew option without button and led (pin taken by the serial port)
 
 const int16_t MILLIS_TO_ENTER_PROGRAM_MODE = 7000;
+const int16_t MILLIS_TO_SWITCH_RECIPE_BANK = 3000;                  //!< long press on brew option N (idle group) selects recipe bank N
+const unsigned long RECIPE_BANK_FEEDBACK_MILLIS = 1500;             //!< time the led of the selected recipe bank stays on
+const unsigned long COPY_REFUSED_BLINK_INTERVAL = 128;              //!< leds of a group blink this fast, for RECIPE_BANK_FEEDBACK_MILLIS, when no group took its dosage (milliseconds)
+
+const uint8_t RECIPE_BANKS_LEN = 3;                                 //!< dosage records stored per group, at most BREW_OPTIONS_LEN - 1
+const uint8_t RECIPE_NAME_LEN = 8;                                  //!< recipe bank name length, including terminating null
+
+#ifndef SERIAL_CONSOLE
+#define SERIAL_CONSOLE 0                                            //!< 1 to accept commands on the serial port (takes D0/D1 from group 1 options 3 and 4)
+#endif
+
+const unsigned long MAX_CONTINUOUS_BREW_MILLIS = 120000UL;          //!< continuous brewing stops by itself after this time (ms)
+
+const uint8_t EEPROM_WRITE_BURST = 16;                              //!< EEPROM record writes allowed back to back
+const unsigned long EEPROM_WRITE_REFILL_MILLIS = 120000UL;          //!< one more write allowed after this time, bounds sustained wear to 30 writes/hour
+const int8_t EEPROM_WRITE_REFUSED = -100;                           //!< returned by boundedEepromWrite() when the write budget is exhausted
+
+#ifndef INVARIANT_CHECKS
+#define INVARIANT_CHECKS 0                                          //!< 1 to check output invariants every loop and force outputs to a safe state on violation
+#endif
 
 const unsigned long LEDS_BLINK_INTERVAL = 800;                      //!< interval at which to blink leds on programming mode (milliseconds)
 
 const long MIN_FLOWMETER_PULSE_CONFIG = 40;                                   //!< min valeu allowed to set for flowmeter pulse config (count)
 const unsigned long MIN_DOSE_DURATION_CONFIG = 10 * 1000;                     //!< min valeu allowed to set for duration config (ms)
 
+const uint8_t SHOT_STATS_WINDOW = 8;                                //!< shots averaged before statistics become a moving average
+const uint8_t SHOT_STATS_MIN_SAMPLES = 5;                           //!< shots needed before drift alert and adaptive timeout are evaluated
+const uint8_t SHOT_DRIFT_BAND_PERCENT = 20;                         //!< allowed deviation of mean shot time from the programmed duration (%)
+const unsigned long DRIFT_LEDS_BLINK_INTERVAL = 250;                //!< interval at which to blink leds of drifting brew options (milliseconds)
+
+const unsigned long FLOW_DIAG_MIN_SHOT_MILLIS = 5000;                //!< shorter shots (stopped by the user) are not diagnosed
+const uint16_t FLOW_DIAG_MAX_PULSE_GAP_MILLIS = 2000;               //!< a longer gap between pulses during a shot is a dropout
+const uint8_t FLOW_DIAG_GAP_TO_MEAN_RATIO = 8;                      //!< ... if it is also this many times the mean pulse interval
+const uint8_t FLOW_DIAG_REJECTED_RATIO = 4;                         //!< noisy when more than 1 in N pulses are rejected by debounce
+const uint8_t FLOW_DIAG_FAULT_SCORE = 2;                            //!< score added by a faulty shot, a healthy shot subtracts 1
+const uint8_t FLOW_DIAG_UNHEALTHY_SCORE = 4;                        //!< score at which the group switches to time-based dosing
+const uint8_t FLOW_DIAG_MAX_SCORE = 8;
+
+#ifndef ADAPTIVE_DOSE_TIMEOUT
+#define ADAPTIVE_DOSE_TIMEOUT 0                                     //!< 1 to derive the dosage timeout from shot statistics instead of 2 X duration config
+#endif
+const uint8_t ADAPTIVE_TIMEOUT_SIGMAS = 4;                          //!< standard deviations above the mean shot time tolerated by the adaptive timeout
+
+#ifndef SHOT_QUEUE_LEN
+#define SHOT_QUEUE_LEN 0                                            //!< shots that can be queued on a brewing group (up to 2), 0 to disable
+#endif
+const unsigned long QUEUED_SHOT_BLINK_INTERVAL = 128;               //!< interval at which to blink leds of queued options, power of 2 (milliseconds)
+
 enum ButtonAction {
     BUTTON_NOT_PRESSED = 0,
     BUTTON_PRESSED_FOR_BREWING = 1,
     BUTTON_PRESSED_FOR_PROGRAM = 2,
-    BUTTON_PRESSED_FOR_CONTINUOUS_BREWING = 3
+    BUTTON_PRESSED_FOR_CONTINUOUS_BREWING = 3,
+    BUTTON_PRESSED_FOR_RECIPE_BANK = 4
+};
+
+enum StopReason {
+    STOP_NONE = 0,
+    STOP_BY_FLOWMETER = 1,                                          //!< dose pulse count reached
+    STOP_BY_NO_FLOW_TIMEOUT = 2,                                    //!< no flowmeter activity until dose duration
+    STOP_BY_MAX_DURATION = 3,                                       //!< flowmeter count not evolving, dosage timed out
+    STOP_BY_USER = 4,                                               //!< button pressed during brewing
+    STOP_BY_SAFETY = 5,                                             //!< outputs forced off by the safety supervisor
+    STOP_BY_DURATION = 6,                                           //!< time-based dosing, flowmeter diagnosed unhealthy
+    STOP_BY_WEIGHT = 7                                              //!< predicted beverage weight reached
+};
+
+enum FlowMeterHealth {
+    FLOWMETER_HEALTHY = 0,
+    FLOWMETER_STUCK = 1,                                            //!< no pulses while water should be flowing
+    FLOWMETER_INTERMITTENT = 2,                                     //!< pulses stop and resume during a shot
+    FLOWMETER_NOISY = 3                                             //!< many glitches rejected by debounce
+};
+
+/**
+ * Brew group state machine
+ *
+ * Each loop a group turns the first button command into an event, then posts EVT_TICK. The next
+ * state and the action of every state X event pair is looked up in a table stored in flash, see
+ * GROUP_TRANSITIONS in ExpressoCoffee.cpp.
+ */
+enum GroupState {
+    GROUP_IDLE = 0,
+    GROUP_BREWING = 1,
+    GROUP_PROGRAMMING = 2,                                          //!< group in programming mode, not brewing
+    GROUP_PROGRAMMING_BREWING = 3,                                  //!< brewing to program the dosage of an option
+    GROUP_BREWING_PROGRAMMING_PENDING = 4,                          //!< shot started before the group entered programming mode
+    GROUP_STATES_LEN = 5
+};
+
+enum GroupEvent {
+    EVT_TICK = 0,                                                   //!< posted once every loop
+    EVT_OPTION_PRESSED = 1,                                         //!< dosed option pressed, other than the one brewing
+    EVT_CURRENT_OPTION_PRESSED = 2,                                 //!< option currently brewing pressed
+    EVT_CONTINUOUS_PRESSED = 3,
+    EVT_PROGRAM_PRESSED = 4,
+    EVT_RECIPE_BANK_PRESSED = 5,
+    EVT_DOSE_COMPLETE = 6,                                          //!< posted by ACT_CHECK_DOSE
+    EVT_SAFETY_TRIP = 7,                                            //!< outputs of the group forced off by the safety supervisor
+    GROUP_EVENTS_LEN = 8
+};
+
+enum GroupAction {
+    ACT_NONE = 0,
+    ACT_START_BREWING = 1,
+    ACT_STOP_BREWING = 2,
+    ACT_CHECK_DOSE = 3,
+    ACT_IDLE_LEDS = 4,                                              //!< safety, recipe bank and drift feedback
+    ACT_PROGRAMMING_LEDS = 5,                                       //!< blink options not programmed yet
+    ACT_ENTER_PROGRAMMING = 6,
+    ACT_EXIT_PROGRAMMING = 7,
+    ACT_COPY_DOSAGE = 8,                                            //!< copy dosage of the group to the other groups
+    ACT_SELECT_RECIPE_BANK = 9,
+    ACT_QUEUE_SHOT = 10                                             //!< queue the option to start when the current shot ends, or cancel it
 };
 
 enum LedStatus {
@@ -52,26 +158,70 @@ struct DosageRecord {
     uint8_t durationArray[4] = { 30, 30, 30, 30 };                  //!< Each element holds dosage duration (seconds) for a brew option.
 };
 
+/**
+ * RecipeBankIndex
+ *
+ * Holds the selected recipe bank of each group and the name of the banks, stored in EEPROM after
+ * the dosage records. Each group keeps a DosageRecord per bank (bank 0 at the original location of
+ * the group's dosage record), all of them loaded in RAM on startup so switching never reads EEPROM.
+ * Only the selected bank is kept in RAM from this record, names are read when listing the banks.
+ */
+struct RecipeBankIndex {
+    uint8_t activeBankArray[BREW_GROUPS_LEN] = { 0 };             //!< Each element holds the selected bank of a group.
+    char nameArray[RECIPE_BANKS_LEN][RECIPE_NAME_LEN] = { "BANK1", "BANK2", "BANK3" };
+};
+
+/**
+ * ShotStatistics
+ *
+ * Rolling statistics of the shots brewed by a brew option, updated incrementally once per shot.
+ * Means are kept in fixed-point (SHOT_STATS_FRACTION_BITS fractional bits) and variances as
+ * integer squares, durations in tenths of a second. For the first SHOT_STATS_WINDOW shots these
+ * are the exact mean/variance (Welford), then they turn into a moving average of the last shots.
+ */
+const uint8_t SHOT_STATS_FRACTION_BITS = 4;
+
+struct ShotStatistics {
+    uint16_t count = 0;                                             //!< shots accounted (saturated)
+    uint16_t timeoutCount = 0;                                      //!< shots stopped by duration instead of flowmeter count (saturated)
+    uint16_t durationMean = 0;                                      //!< mean shot duration (1/10 s, fixed-point)
+    uint16_t durationVariance = 0;                                  //!< shot duration variance ((1/10 s)^2, saturated)
+    uint16_t pulseMean = 0;                                         //!< mean flowmeter pulse count (fixed-point)
+    uint16_t pulseVariance = 0;                                     //!< flowmeter pulse count variance (saturated)
+
+    void addShot(unsigned long durationMillis, long pulseCount, bool timedOut);
+    void reset() { *this = ShotStatistics(); };
+    unsigned long getMeanDurationMillis() { return ((unsigned long) durationMean * 100) >> SHOT_STATS_FRACTION_BITS; };
+    unsigned long getStdDevDurationMillis();
+    long getMeanPulseCount() { return pulseMean >> SHOT_STATS_FRACTION_BITS; };
+    uint8_t getTimeoutPercent() { return count == 0 ? 0 : (uint8_t) (((unsigned long) timeoutCount * 100) / count); };
+};
+
 class ExpressoMachine;
 class BrewGroup;
+class UsageCounters;
+class ShotLog;
+class LoadCell;
 
 class BrewOption {
 public:
-    BrewOption(){};
+    BrewOption() : m_btn(0) {};
     BrewOption(int8_t pin, long doseFlowmeterCount, int8_t doseDurationSec, BrewGroup* parentBrewGroup)
-        : m_pin(pin), m_parentBrewGroup(parentBrewGroup)
+        : m_btn(pin), m_longPressMillis(MILLIS_TO_SWITCH_RECIPE_BANK), m_longPressAction(BUTTON_PRESSED_FOR_RECIPE_BANK), m_pin(pin), m_parentBrewGroup(parentBrewGroup)
     {
-        m_btn = new Button(pin);
         setDosageConfig(doseDurationSec * 1000, doseFlowmeterCount);
-        DEBUG3_VALUE("BrewOption constructor, pin=", m_pin);
-        DEBUG3_VALUE(". Dose duration(s): ", doseDurationSec);
-        DEBUG3_VALUELN(". Flowmeter count: ", doseFlowmeterCount);
+        DEBUG3_VALUE(F("BrewOption constructor, pin="), m_pin);
+        DEBUG3_VALUE(F(". Dose duration(s): "), doseDurationSec);
+        DEBUG3_VALUELN(F(". Flowmeter count: "), doseFlowmeterCount);
     };
-    virtual ButtonAction loop();
+    virtual ButtonAction loop(bool longPressArmed);
     void setup()
     {
-        DEBUG3_VALUELN("begin() on brew option of pin ", m_pin);
-        m_btn->begin();
+        if (m_pin == NO_OPTION_PIN) {
+            return;
+        }
+        DEBUG3_VALUELN(F("begin() on brew option of pin "), m_pin);
+        m_btn.begin();
         m_pinMode = INPUT_PULLUP;
     };
     bool flagProgrammed = false;
@@ -79,31 +229,79 @@ public:
     long doseFlowmeterCount = MIN_FLOWMETER_PULSE_CONFIG;
     unsigned long doseDurationMillis = MIN_DOSE_DURATION_CONFIG;
     void onStartBrewing(bool isProgramming);
-    void onEndBrewing(long brewingStartTime, long lastFlowmeterCount, bool isProgramming);
+    void onEndBrewing(unsigned long brewingStartTime, long lastFlowmeterCount, bool isProgramming);
     void setDosageConfig(unsigned long durationParamMillis, long flowmeterParamCount);
     virtual bool canFinishBrewing(unsigned long elapsedBrewMillis, long pulseCount);
+    bool canFinishBrewingByTime(unsigned long elapsedBrewMillis);
+    bool canFinishBrewingByWeight(unsigned long elapsedBrewMillis, int16_t predictedWeight, uint16_t targetWeight);
+    void setStopReason(StopReason reason) { m_stopReason = reason; };
+    StopReason getStopReason() { return m_stopReason; };
+    ShotStatistics shotStats;
+    bool isDrifting();
 
 protected:
-    Button* m_btn = NULL;
+    Button m_btn;
     unsigned long m_lastActionMs = 0;
+    StopReason m_stopReason = STOP_NONE;
+    int16_t m_longPressMillis = 0;                                  //!< press duration reported as m_longPressAction
+    ButtonAction m_longPressAction = BUTTON_NOT_PRESSED;
+    bool m_btnReleasedAfterLongPress = true;
+    bool m_longPressArmed = false;                                  //!< long press reported for the current press of the button
+    bool m_dosed = true;                                            //!< shots have a programmed dose, their statistics are kept
 
 private:
     void turnOnLed();
+    unsigned long getDoseTimeoutMillis();
     int8_t m_pin = -1;
     BrewGroup* m_parentBrewGroup = NULL;
     int8_t m_pinMode;
 };
 
+/**
+ * FlowMeterDiagnostics
+ *
+ * Classifies a flowmeter from the pulse statistics of each shot and keeps a score across shots,
+ * so a single odd shot does not change the verdict: a faulty shot adds FLOW_DIAG_FAULT_SCORE,
+ * a healthy one subtracts 1. The flowmeter is unhealthy from FLOW_DIAG_UNHEALTHY_SCORE until
+ * the score is back to 0.
+ */
+class FlowMeterDiagnostics {
+public:
+    FlowMeterDiagnostics(){};
+    void addShot(unsigned long elapsedBrewMillis, long pulseCount, unsigned long meanIntervalMillis, uint16_t maxIntervalMillis, uint16_t rejectedCount);
+    bool isHealthy() { return !m_unhealthy; };
+    FlowMeterHealth getHealth() { return m_unhealthy ? m_lastFault : FLOWMETER_HEALTHY; };
+
+private:
+    uint8_t m_score = 0;
+    bool m_unhealthy = false;
+    FlowMeterHealth m_lastFault = FLOWMETER_HEALTHY;
+};
+
 class SimpleFlowMeter {
 public:
     SimpleFlowMeter(){};
     void increment();
+    void reject();
     void reset();
     long getPulseCount() { return m_pulseCount; };
+    void diagnoseShot(unsigned long elapsedBrewMillis);
+    FlowMeterDiagnostics diagnostics;
+    void arm(long targetPulseCount, SafetySupervisor* safetySupervisor, uint8_t solenoidChannel);
+    void disarm();
+    bool isDoseReached() { return m_doseReached; };
 
 protected:
     volatile long m_pulseCount = 0;
     volatile unsigned long m_lastPulseMs;
+    volatile unsigned long m_firstPulseMs = 0;
+    volatile uint16_t m_maxPulseIntervalMs = 0;                     //!< longest gap between pulses since reset
+    volatile uint16_t m_rejectedCount = 0;                          //!< pulses rejected by debounce since reset
+    volatile bool m_armed = false;                                  //!< close solenoid from the ISR when target is reached
+    volatile bool m_doseReached = false;
+    long m_targetPulseCount = 0;
+    SafetySupervisor* m_safetySupervisor = NULL;
+    uint8_t m_solenoidChannel = 0;
 };
 
 class ContinuousBrewOption: public BrewOption {
@@ -112,82 +310,129 @@ public:
     ContinuousBrewOption(int8_t pin, BrewGroup* parentBrewGroup)
         : BrewOption(pin, 0, 0, parentBrewGroup)
     {
-        DEBUG3_PRINTLN("  ContinuousBrewOption()");
+        m_longPressMillis = MILLIS_TO_ENTER_PROGRAM_MODE;
+        m_longPressAction = BUTTON_PRESSED_FOR_PROGRAM;
+        m_dosed = false;
+        DEBUG3_PRINTLN(F("  ContinuousBrewOption()"));
     };
-    ButtonAction loop();
+    ButtonAction loop(bool longPressArmed);
     bool canFinishBrewing(unsigned long elapsedBrewMillis, long pulseCount);
-
-private:
-    bool m_btnReleasedAfterPressedForProgram = true;
 };
 
 class BrewGroup {
 public:
     BrewGroup(){};
-    BrewGroup(int8_t groupNumber, int8_t pinArray[BREW_OPTIONS_LEN], SimpleFlowMeter* flowMeter, int8_t solenoidPin);
+    BrewGroup(int8_t groupNumber, const int8_t pinArray[BREW_OPTIONS_LEN], SimpleFlowMeter* flowMeter, int8_t solenoidPin);
     BrewOption* ptrCurrentBrewingOption = NULL;
-    void startBrewing(BrewOption* brewOption);
-    void stopBrewing();
+    void dispatch(GroupEvent event, int8_t optionIndex = -1);
+    GroupState getState() { return m_state; };
+    bool isOnProgrammingMode() { return m_state == GROUP_PROGRAMMING || m_state == GROUP_PROGRAMMING_BREWING || m_state == GROUP_BREWING_PROGRAMMING_PENDING; };
+    int8_t getBrewingOptionIndex() { return getBrewOptionIndex(ptrCurrentBrewingOption); };
+    unsigned long getBrewingMillis() { return millis() - m_brewingStartTime; };
     void loop();
-    void setup();
+    void setup(uint8_t recipeBank);
     int8_t getGroupNumber() { return m_groupNumber; };
+    bool selectRecipeBank(uint8_t bank);
+    uint8_t getRecipeBank() { return m_recipeBank; };
     void setParent(ExpressoMachine* expressoMachine) { m_ptrExpressoMachine = expressoMachine; };
+    int8_t getSolenoidPin() { return m_solenoidPin; };
     void setDosageConfig(DosageRecord dosageConfig);
-    void saveDosageRecord();
+    bool copyDosageConfig(BrewGroup* from);
+    SimpleFlowMeter* getFlowMeter() { return m_flowMeter; };
+    LoadCell* getLoadCell() { return m_loadCell; };
+    void setLoadCell(LoadCell* loadCell) { m_loadCell = loadCell; };
+    bool saveDosageRecord();
     void setToggleBlinkLeds(bool toggleBlinkLeds) { m_toggleBlinkLeds = toggleBlinkLeds; };
+    void setToggleDriftLeds(bool toggleDriftLeds) { m_toggleDriftLeds = toggleDriftLeds; };
     void setStatusLeds(LedStatus s, FilterOption filter);
+    bool checkInvariants();
 
 private:
     int8_t m_groupNumber = 0;
+    GroupState m_state = GROUP_IDLE;
     int8_t m_solenoidPin = -1;
-    int8_t* m_brewOptionPins;
-    unsigned long m_brewingStartTime = -1;
+    const int8_t* m_brewOptionPins;                                 //!< brew option pins, stored in PROGMEM
+    unsigned long m_brewingStartTime = 0;
     ExpressoMachine* m_ptrExpressoMachine = NULL;
     bool m_flagSetup = false;
     bool m_toggleBlinkLeds = false;
     LedStatus m_blinkLedsStatus = OFF;
-    int8_t m_programmedCount = 0;
+    bool m_toggleDriftLeds = false;
+    LedStatus m_driftLedsStatus = OFF;
+    DosageRecord m_recipeBanks[RECIPE_BANKS_LEN];
+    uint8_t m_recipeBank = 0;
+    uint8_t m_unsavedBanksMask = 0;                                 //!< banks whose dosage record write was refused or failed
+    unsigned long m_dosageSaveAttemptMs = 0;
+    unsigned long m_recipeBankSelectedMs = 0;
+    bool m_showRecipeBank = false;
+    unsigned long m_copyRefusedMs = 0;
+    bool m_showCopyRefused = false;
 
     SimpleFlowMeter* m_flowMeter = NULL;
+    LoadCell* m_loadCell = NULL;                                    //!< cup scale, optional
+    bool m_scaleTared = false;                                      //!< scale was settled and tared as the current shot started
+    bool m_weightDosing = false;                                    //!< current shot stops on weight
     BrewOption* m_ptrProgrammingBrewOption = NULL;
-    BrewOption** m_brewOptions;
+    BrewOption m_dosedBrewOptions[BREW_OPTIONS_LEN - 1];
+    ContinuousBrewOption m_continuousBrewOption;
+    BrewOption* m_brewOptions[BREW_OPTIONS_LEN];
+#if SHOT_QUEUE_LEN > 0
+    int8_t m_shotQueue[SHOT_QUEUE_LEN];                             //!< indexes of options to brew next, oldest first
+    uint8_t m_shotQueueLen = 0;
+#endif
 
-    DosageRecord loadDosageRecord();
+    DosageRecord loadDosageRecord(uint8_t bank);
+    bool writeDosageRecord(uint8_t bank);
+    bool startBrewing(BrewOption* brewOption, bool isProgramming);
+    void stopBrewing(bool isProgramming);
+    bool canFinishBrewing();
+    void updateIdleLeds();
+    void toggleQueuedShot(int8_t optionIndex);
+    int8_t popQueuedShot();
+    void clearShotQueue();
+    void updateQueuedShotLeds();
     void turnOnGroupSolenoid();
     void turnOffGroupSolenoid();
     void enterProgrammingMode();
     void exitProgrammingMode();
-    bool allOptionsWaitingForProgramming();
-    void copyDosageConfig(BrewGroup* from);
+    int8_t getBrewOptionIndex(BrewOption* brewOption);
 };
 
 class ExpressoMachine {
 
 public:
-    ExpressoMachine(BrewGroup* brewGroups, int8_t lenBrewGroups, int8_t pumpPin, int8_t solenoidBolderPin, int8_t waterLevelPin)
-        : m_brewGroups(brewGroups), m_lenBrewGroups(lenBrewGroups), m_pumpPin(pumpPin), m_solenoidBoilderPin(solenoidBolderPin), m_waterLevelPin(waterLevelPin)
+    ExpressoMachine(BrewGroup* brewGroups, int8_t lenBrewGroups, int8_t pumpPin, int8_t solenoidBolderPin, int8_t waterLevelPin, SafetySupervisor* safetySupervisor, UsageCounters* usageCounters)
+        : m_brewGroups(brewGroups), m_lenBrewGroups(lenBrewGroups), m_pumpPin(pumpPin), m_solenoidBoilderPin(solenoidBolderPin), m_waterLevelPin(waterLevelPin), m_safetySupervisor(safetySupervisor), m_usageCounters(usageCounters)
     {
         for (int8_t i = 0; i < lenBrewGroups; i++) {
             brewGroups[i].setParent(this);
-            DEBUG3_VALUELN("ExpressoMachine() - group ", m_brewGroups[i].getGroupNumber());
         }
     };
 
     BrewGroup* getBrewGroup(int8_t groupNumber);
     BrewGroup* getBrewGroups() { return m_brewGroups; };
+    SafetySupervisor* getSafetySupervisor() { return m_safetySupervisor; };
+    UsageCounters* getUsageCounters() { return m_usageCounters; };
+    ShotLog* getShotLog() { return m_shotLog; };
+    void setShotLog(ShotLog* shotLog) { m_shotLog = shotLog; };
+    bool isSafetyFault() { return m_boilerFillFault || m_safetySupervisor->isPumpCoolingDown(); };
+    bool isFillingBoiler() { return m_fillingBoiler; };
+    bool isOnProgrammingMode();
+#if INVARIANT_CHECKS
+    uint8_t getInvariantViolations() { return m_invariantViolations; };
+#endif
 
-    bool isOnProgrammingMode = false;
     bool isBrewing = false;
-    BrewGroup* ptrFirstCompletedProgramming = NULL;
     void setup();
     void loop();
     void turnOffPump(BrewGroup* brewGroupAsking);
     void turnOnBoilerSolenoid();
     void turnOffBoilerSolenoid();
     void turnOnPump();
-    void exitProgrammingMode();
-    void enterProgrammingMode() { isOnProgrammingMode = true; this->ptrFirstCompletedProgramming = NULL; };
-    void setFirstCompletedProgramming(BrewGroup* ptrBrewGroup);
+    bool copyDosageConfig(int8_t fromGroupNumber, int8_t toGroupNumber);
+    bool selectRecipeBank(int8_t groupNumber, uint8_t bank);
+    void getRecipeBankName(uint8_t bank, char name[RECIPE_NAME_LEN]);
+    bool setRecipeBankName(uint8_t bank, const char* name);
 
 private:
     BrewGroup* m_brewGroups;
@@ -195,14 +440,33 @@ private:
     int8_t m_pumpPin;
     int8_t m_solenoidBoilderPin;
     int8_t m_waterLevelPin;
+    SafetySupervisor* m_safetySupervisor;
+    UsageCounters* m_usageCounters;
+    ShotLog* m_shotLog = NULL;                                      //!< shots kept for the bus host, optional
+    bool m_pumpOn = false;
+    unsigned long m_pumpOnMs = 0;
+    bool m_boilerFillFault = false;                                 //!< boiler took too long to fill, no more filling until reset
     void turnOffPump();
+    void handleSafetyTrips();
     bool m_flagSetup = false;
     unsigned long m_waterLevelReachedMs = 0;
+    bool m_waterLevelReached = false;                               //!< m_waterLevelReachedMs is set, 0 is a valid millis() value
+#if INVARIANT_CHECKS
+    uint8_t m_invariantViolations = 0;
+    void checkInvariants();
+#endif
     bool m_fillingBoiler = false;
-    BrewGroup* m_ptrFirstCompletedProgramming = NULL;
+    bool m_recipeBankIndexPending = false;                          //!< bank selection not saved yet, saved once the machine is idle
+    bool m_recipeBankIndexSaveFailed = false;                       //!< last save refused or failed, selection still pending
+    unsigned long m_recipeBankIndexSaveAttemptMs = 0;
+    RecipeBankIndex loadRecipeBankIndex();
+    bool saveRecipeBankIndex(RecipeBankIndex& index);
+    void saveSelectedRecipeBanks();
     bool isBoilerWaterLevelLow();
     void startFillingBoiler();
     void stopFillingBoiler();
 };
 
+int8_t boundedEepromWrite(int location, uint8_t* data, size_t len);
+
 #endif
@@ -0,0 +1,162 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include "LoadCell.h"
+#include <EEPromUtils.h>
+#include <util/atomic.h>
+
+void LoadCell::setup(int location) {
+    m_location = location;
+    pinMode(m_sckPin, OUTPUT);
+    digitalWrite(m_sckPin, LOW);                                    //!< SCK high for more than 60 us powers the HX711 down
+    pinMode(m_doutPin, INPUT);
+}
+
+/*----------------------------------------------------------------------*
+/ clock up to LOAD_CELL_BITS_PER_LOOP bits of the sample. Interrupts    *
+/ are held off during each SCK high pulse so an ISR cannot stretch it   *
+/ past the HX711 power down time                                        *
+/-----------------------------------------------------------------------*/
+void LoadCell::loop() {
+
+    // target weights refused by the EEPROM write budget, retried once it has a token again
+    if (m_targetsLocation >= 0 && m_bit == 0 && millis() - m_targetsSaveAttemptMs >= EEPROM_WRITE_REFILL_MILLIS) {
+        writeTargets();
+    }
+
+    if (m_bit == 0 && digitalRead(m_doutPin) == HIGH) {
+        return;                                                     //!< conversion not ready
+    }
+
+    for (uint8_t n = 0; n < LOAD_CELL_BITS_PER_LOOP; n++) {
+        uint8_t bit;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            digitalWrite(m_sckPin, HIGH);
+            bit = digitalRead(m_doutPin);
+            digitalWrite(m_sckPin, LOW);
+        }
+        if (m_bit < 24) {
+            m_raw = (m_raw << 1) | bit;
+        }
+        if (++m_bit == 25) {                                        //!< 25th clock selects channel A, gain 128 for the next sample
+            addSample(m_raw & 0x800000 ? m_raw | 0xFF000000 : m_raw);
+            m_raw = 0;
+            m_bit = 0;
+            return;
+        }
+    }
+}
+
+void LoadCell::addSample(int32_t raw) {
+
+    unsigned long now = millis();
+    // run of samples close to their mean, a weight change starts a new one
+    if (m_settledSamples > 0) {
+        int32_t mean = m_settledSum / m_settledSamples;
+        if (raw - mean > LOAD_CELL_SETTLED_COUNTS || mean - raw > LOAD_CELL_SETTLED_COUNTS) {
+            m_settledSum = 0;
+            m_settledSamples = 0;
+        } else if (m_settledSamples == LOAD_CELL_SETTLED_RUN_MAX) {
+            m_settledSum -= mean;
+            m_settledSamples--;
+        }
+    }
+    m_settledSum += raw;
+    m_settledSamples++;
+
+    if (!m_hasSample) {
+        m_filtered = raw;
+        m_tare = raw;
+        m_hasSample = true;
+    } else {
+        m_filtered += (raw - m_filtered) >> LOAD_CELL_FILTER_SHIFT;
+    }
+
+    int16_t weight = (m_filtered - m_tare) * 10 / LOAD_CELL_COUNTS_PER_GRAM;
+    unsigned long elapsed = now - m_lastSampleMs;
+    if (elapsed > 0 && elapsed < LOAD_CELL_TIMEOUT_MILLIS) {
+        int16_t rate = (int32_t) (weight - m_weight) * 1000 / (long) elapsed;
+        m_rate += (rate - m_rate) >> LOAD_CELL_FILTER_SHIFT;
+    }
+    m_weight = weight;
+    m_lastSampleMs = now;
+}
+
+bool LoadCell::isReady() {
+    return m_hasSample && millis() - m_lastSampleMs < LOAD_CELL_TIMEOUT_MILLIS;
+}
+
+/*----------------------------------------------------------------------*
+/ zero on the mean of the settled run, the average restarts from it.    *
+/ Not tared and false while the scale is not settled                    *
+/-----------------------------------------------------------------------*/
+bool LoadCell::tare() {
+    if (!isReady() || !isSettled()) {
+        DEBUG2_PRINTLN(F("Scale not settled, not tared"));
+        return false;
+    }
+    m_tare = m_settledSum / m_settledSamples;
+    m_filtered = m_tare;
+    m_weight = 0;
+    m_rate = 0;
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+/ weight in the cup once the coffee still flowing has dripped           *
+/-----------------------------------------------------------------------*/
+int16_t LoadCell::getPredictedWeight() {
+    int16_t rate = m_rate > 0 ? m_rate : 0;
+    return m_weight + (int32_t) rate * LOAD_CELL_DRIP_MILLIS / 1000;
+}
+
+int LoadCell::targetsLocation(int8_t groupNumber, uint8_t bank) {
+    return m_location + EEPROM_SIZE( sizeof(WeightRecord) ) * (bank * BREW_GROUPS_LEN + groupNumber - 1);
+}
+
+void LoadCell::loadTargets(int8_t groupNumber, uint8_t bank) {
+    if (m_targetsLocation >= 0 && !writeTargets()) {
+        DEBUG1_PRINTLN(F("Target weights of the previous recipe bank lost"));
+    }
+    m_targetsLocation = -1;
+    m_targets = WeightRecord();
+    if (EEPROM_init() && EEPROM_safe_read(targetsLocation(groupNumber, bank), (uint8_t*) &m_targets, sizeof(m_targets)) < 0) {
+        m_targets = WeightRecord();                                 //!< never programmed, dose by volume
+    }
+}
+
+uint16_t LoadCell::getTarget(int8_t brewOptionIndex) {
+    if (brewOptionIndex < 0 || brewOptionIndex == CONTINUOUS_BREW_OPTION_INDEX) {
+        return 0;
+    }
+    uint16_t weight = m_targets.weightArray[brewOptionIndex];
+    return weight == 0xFFFF ? 0 : weight;                          //!< erased EEPROM
+}
+
+/*----------------------------------------------------------------------*
+/ target kept in RAM when the write is refused or fails, returns false  *
+/ then and loop() writes it later                                       *
+/-----------------------------------------------------------------------*/
+bool LoadCell::setTarget(int8_t groupNumber, uint8_t bank, int8_t brewOptionIndex, uint16_t weight) {
+    if (brewOptionIndex < 0 || brewOptionIndex == CONTINUOUS_BREW_OPTION_INDEX) {
+        return true;
+    }
+    m_targets.weightArray[brewOptionIndex] = weight;
+    DEBUG2_VALUE(F("Target weight (0.1 g) of option "), brewOptionIndex+1);
+    DEBUG2_VALUELN(F(": "), weight);
+    m_targetsLocation = targetsLocation(groupNumber, bank);
+    return writeTargets();
+}
+
+bool LoadCell::writeTargets() {
+    EEPROM_init();
+    m_targetsSaveAttemptMs = millis();
+    if (boundedEepromWrite(m_targetsLocation, (uint8_t*) &m_targets, sizeof(m_targets)) < 0) {
+        DEBUG1_PRINTLN(F("Error saving target weights, retrying later"));
+        return false;
+    }
+    m_targetsLocation = -1;
+    return true;
+}
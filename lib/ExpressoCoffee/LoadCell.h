@@ -0,0 +1,96 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef LOAD_CELL_H_INCLUDED
+#define LOAD_CELL_H_INCLUDED
+
+#include "ExpressoCoffee.h"
+#include "PerfProbe.h"
+
+#ifndef LOAD_CELL
+#define LOAD_CELL 0                                                 //!< 1 to dose by weight on the group with a load cell
+#endif
+#ifndef LOAD_CELL_GROUP
+#define LOAD_CELL_GROUP 1                                           //!< group with the cup scale, the other group keeps volumetric dosing
+#endif
+#ifndef LOAD_CELL_SCK_PIN
+#define LOAD_CELL_SCK_PIN 6                                         //!< HX711 PD_SCK
+#endif
+#ifndef LOAD_CELL_DOUT_PIN
+#define LOAD_CELL_DOUT_PIN 7                                        //!< HX711 DOUT
+#endif
+#ifndef LOAD_CELL_COUNTS_PER_GRAM
+#define LOAD_CELL_COUNTS_PER_GRAM 420                               //!< calibration of load cell and HX711 gain 128
+#endif
+
+#if LOAD_CELL && (PERF_PROBES || STATUS_DISPLAY)
+#error "LOAD_CELL uses pins D6 and D7, like PERF_PROBES and STATUS_DISPLAY"
+#endif
+
+const uint8_t LOAD_CELL_BITS_PER_LOOP = 8;                          //!< HX711 bits clocked per loop call
+const uint8_t LOAD_CELL_FILTER_SHIFT = 2;                           //!< streaming filter weight of a new sample is 1/2^shift
+const unsigned long LOAD_CELL_TIMEOUT_MILLIS = 500;                 //!< no sample for this long and the scale is not trusted (HX711 gives 10 per second)
+const unsigned long LOAD_CELL_DRIP_MILLIS = 1500;                   //!< coffee still reaching the cup after the solenoid closes
+const int32_t LOAD_CELL_SETTLED_COUNTS = LOAD_CELL_COUNTS_PER_GRAM / 2; //!< samples within 0.5 g of the mean of a run continue it
+const uint8_t LOAD_CELL_SETTLED_SAMPLES = 4;                        //!< samples in a run before the scale is settled and can be tared
+const uint8_t LOAD_CELL_SETTLED_RUN_MAX = 16;                       //!< the run mean is a moving average of this many samples
+
+/**
+ * WeightRecord
+ *
+ * Target beverage weight of each dosed option, 0.1 g units, 0 when not programmed. Stored
+ * apart from DosageRecord so the existing EEPROM layout is kept.
+ */
+struct WeightRecord {
+    uint16_t weightArray[BREW_OPTIONS_LEN - 1] = {};
+};
+
+/**
+ * LoadCell
+ *
+ * Cup scale on an HX711, read without blocking: a sample is 24 bits clocked a few at a time
+ * from loop() once DOUT signals it is ready, plus one clock to keep channel A, gain 128. Samples
+ * go through an exponential moving average in fixed point, and the weight slope through
+ * another one, to predict the final weight from what is still flowing when the shot stops.
+ * The scale is only tared on a settled run of raw samples (a cup just put down, or the previous
+ * one just lifted, is not), on their mean rather than on the lagging average.
+ */
+class LoadCell {
+public:
+    LoadCell(int8_t sckPin, int8_t doutPin) : m_sckPin(sckPin), m_doutPin(doutPin) {};
+    void setup(int location);
+    void loop();
+    bool isReady();
+    bool isSettled() { return m_settledSamples >= LOAD_CELL_SETTLED_SAMPLES; };
+    bool tare();
+    int16_t getWeight() { return m_weight; };                       //!< 0.1 g since the last tare
+    int16_t getPredictedWeight();
+    void loadTargets(int8_t groupNumber, uint8_t bank);
+    uint16_t getTarget(int8_t brewOptionIndex);
+    bool setTarget(int8_t groupNumber, uint8_t bank, int8_t brewOptionIndex, uint16_t weight);
+
+private:
+    int8_t m_sckPin;
+    int8_t m_doutPin;
+    int m_location = 0;
+    uint8_t m_bit = 0;                                              //!< bits clocked of the sample being read
+    int32_t m_raw = 0;
+    int32_t m_filtered = 0;
+    int32_t m_tare = 0;
+    bool m_hasSample = false;
+    int32_t m_settledSum = 0;                                       //!< raw samples of the current run
+    uint8_t m_settledSamples = 0;
+    unsigned long m_lastSampleMs = 0;
+    int16_t m_weight = 0;
+    int16_t m_rate = 0;                                             //!< filtered slope, 0.1 g per second
+    WeightRecord m_targets;
+    int m_targetsLocation = -1;                                     //!< where m_targets goes, -1 once it is in EEPROM
+    unsigned long m_targetsSaveAttemptMs = 0;
+    int targetsLocation(int8_t groupNumber, uint8_t bank);
+    bool writeTargets();
+    void addSample(int32_t raw);
+};
+
+#endif
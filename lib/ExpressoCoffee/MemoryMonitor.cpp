@@ -0,0 +1,66 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include "MemoryMonitor.h"
+
+#if defined(__AVR__)
+
+extern uint8_t __heap_start;
+extern uint8_t __stack;
+extern void* __brkval;
+
+/*----------------------------------------------------------------------*
+/ paint SRAM from end of .bss up to RAMEND with the canary. Runs from   *
+/ .init1, before stack pointer and r1 are set up, so it is written in   *
+/ assembly and uses no stack. The value 0xC5 is STACK_CANARY            *
+/-----------------------------------------------------------------------*/
+void paintStack() __attribute__ ((naked, used, section (".init1")));
+void paintStack()
+{
+    __asm volatile ("    ldi r30,lo8(__heap_start)\n"
+                    "    ldi r31,hi8(__heap_start)\n"
+                    "    ldi r24,0xc5\n"
+                    "    ldi r25,hi8(__stack)\n"
+                    "    rjmp 2f\n"
+                    "1:\n"
+                    "    st Z+,r24\n"
+                    "2:\n"
+                    "    cpi r30,lo8(__stack)\n"
+                    "    cpc r31,r25\n"
+                    "    brlo 1b\n"
+                    "    breq 1b"::);
+}
+
+static uint8_t* heapEnd() {
+    return __brkval == 0 ? &__heap_start : (uint8_t*) __brkval;
+}
+
+uint16_t getFreeMemory() {
+    uint8_t top;
+    return &top - heapEnd();
+}
+
+uint16_t getMemoryLowWaterMark() {
+    const uint8_t* p = heapEnd();
+    uint16_t count = 0;
+    while (*p == STACK_CANARY && p <= &__stack) {
+        p++;
+        count++;
+    }
+    return count;
+}
+
+#else
+
+// host builds of the tests (test/stubs) have no SRAM to measure
+uint16_t getFreeMemory() {
+    return 0;
+}
+
+uint16_t getMemoryLowWaterMark() {
+    return 0;
+}
+
+#endif
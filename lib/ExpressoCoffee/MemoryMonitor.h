@@ -0,0 +1,23 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef MEMORY_MONITOR_H_INCLUDED
+#define MEMORY_MONITOR_H_INCLUDED
+
+#include <Arduino.h>
+
+const uint8_t STACK_CANARY = 0xC5;                                  //!< value painted on free SRAM at startup
+
+/**
+ * SRAM usage monitor.
+ *
+ * Free SRAM between the end of heap and the stack is painted with STACK_CANARY before
+ * main() runs. Bytes still holding the canary were never touched by the stack or the heap,
+ * so counting them gives the smallest gap ever left between heap and stack (high-water mark).
+ */
+uint16_t getFreeMemory();                                           //!< current gap between heap and stack (bytes)
+uint16_t getMemoryLowWaterMark();                                   //!< smallest gap between heap and stack since reset (bytes)
+
+#endif
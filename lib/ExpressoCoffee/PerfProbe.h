@@ -0,0 +1,38 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef PERF_PROBE_H_INCLUDED
+#define PERF_PROBE_H_INCLUDED
+
+#include <Arduino.h>
+
+/**
+ * Timing probes on the free pins D6 (PD6) and D7 (PD7), enabled with -D PERF_PROBES=1
+ * (see [env:uno_perf]). They use single sbi/cbi instructions so they add 2 cycles each and
+ * do not change the timing being measured:
+ *
+ *   D6 high while a flowmeter ISR runs        -> ISR duration in cycles
+ *   D7 toggles on every machine loop iteration -> loop period
+ *
+ * Together with the flowmeter inputs (D2/D3) and group solenoid outputs (D11/D12) these
+ * give flowmeter-pulse-to-solenoid-off latency, in an AVR simulator trace or on a logic analyzer.
+ */
+#ifndef PERF_PROBES
+#define PERF_PROBES 0
+#endif
+
+#if PERF_PROBES
+    #define PERF_PROBES_SETUP()     (DDRD |= _BV(DDD6) | _BV(DDD7))
+    #define PERF_ISR_BEGIN()        (PORTD |= _BV(PORTD6))
+    #define PERF_ISR_END()          (PORTD &= ~_BV(PORTD6))
+    #define PERF_LOOP_TOGGLE()      (PIND = _BV(PIND7))         //!< writing 1 to PINx toggles the output
+#else
+    #define PERF_PROBES_SETUP()
+    #define PERF_ISR_BEGIN()
+    #define PERF_ISR_END()
+    #define PERF_LOOP_TOGGLE()
+#endif
+
+#endif
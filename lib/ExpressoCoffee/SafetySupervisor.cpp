@@ -0,0 +1,132 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include "SafetySupervisor.h"
+#include <util/atomic.h>
+
+static const uint16_t PUMP_DUTY_BUCKET_LIMIT = PUMP_DUTY_BUCKET_SECONDS * (100 - PUMP_DUTY_LIMIT_PERCENT);
+static const uint8_t WATER_CONSUMERS_MASK = (1 << SAFETY_PUMP_CHANNEL) - 1;      //!< group solenoids and boiler solenoid
+
+/*----------------------------------------------------------------------*
+/ register the output pin of a channel. Port and bit mask are resolved  *
+/ here so the interrupt only does a single port write                   *
+/-----------------------------------------------------------------------*/
+void SafetySupervisor::attach(uint8_t channel, int8_t pin, unsigned long limitMillis) {
+    m_portArray[channel] = portOutputRegister(digitalPinToPort(pin));
+    m_bitMaskArray[channel] = digitalPinToBitMask(pin);
+    m_limitTicksArray[channel] = limitMillis / SAFETY_TICK_MILLIS;
+}
+
+/*----------------------------------------------------------------------*
+/ Timer0 already runs millis(), its compare A interrupt is free and     *
+/ fires once per overflow period (1.024 ms)                             *
+/-----------------------------------------------------------------------*/
+void SafetySupervisor::begin() {
+    OCR0A = 0x80;
+    TIMSK0 |= _BV(OCIE0A);
+}
+
+void SafetySupervisor::outputOn(uint8_t channel) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!(m_activeMask & (1 << channel))) {
+            m_onTicksArray[channel] = 0;
+            m_activeMask |= 1 << channel;
+        }
+    }
+}
+
+void SafetySupervisor::outputOff(uint8_t channel) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        m_activeMask &= ~(1 << channel);
+    }
+}
+
+void SafetySupervisor::acknowledge(uint8_t trippedMask) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        m_trippedMask &= ~trippedMask;
+    }
+}
+
+void SafetySupervisor::tick() {
+
+    m_tickMicros += SAFETY_INTERRUPT_MICROS;
+    if (m_tickMicros < SAFETY_TICK_MILLIS * 1000U) {
+        return;
+    }
+    m_tickMicros -= SAFETY_TICK_MILLIS * 1000U;                     //!< keep the remainder, 9.77 interrupts per tick on average
+
+    for (uint8_t channel = 0; channel < SAFETY_CHANNELS_LEN; channel++) {
+        if ((m_activeMask & (1 << channel)) && ++m_onTicksArray[channel] >= m_limitTicksArray[channel]) {
+            forceOff(channel);
+        }
+    }
+
+    if (++m_secondTicks >= SAFETY_TICKS_PER_SECOND) {
+        m_secondTicks = 0;
+        updatePumpDuty();
+    }
+}
+
+void SafetySupervisor::updatePumpDuty() {
+
+    if (m_activeMask & (1 << SAFETY_PUMP_CHANNEL)) {
+        m_pumpDutyBucket += 100 - PUMP_DUTY_LIMIT_PERCENT;
+        if (m_pumpCoolingDown || m_pumpDutyBucket >= PUMP_DUTY_BUCKET_LIMIT) {
+            m_pumpCoolingDown = true;
+            forceOff(SAFETY_PUMP_CHANNEL);
+        }
+    } else if (m_pumpDutyBucket > PUMP_DUTY_LIMIT_PERCENT) {
+        m_pumpDutyBucket -= PUMP_DUTY_LIMIT_PERCENT;
+    } else {
+        m_pumpDutyBucket = 0;
+    }
+
+    if (m_pumpCoolingDown && m_pumpDutyBucket <= PUMP_DUTY_BUCKET_LIMIT / 2) {
+        m_pumpCoolingDown = false;
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ force output off (HIGH) and mark channel tripped. Pump trip closes    *
+/ every solenoid                                                        *
+/-----------------------------------------------------------------------*/
+void SafetySupervisor::forceOff(uint8_t channel) {
+
+    m_trippedMask |= 1 << channel;
+
+    if (channel == SAFETY_PUMP_CHANNEL) {
+        for (uint8_t i = 0; i < SAFETY_PUMP_CHANNEL; i++) {
+            if (m_activeMask & (1 << i)) {
+                *m_portArray[i] |= m_bitMaskArray[i];
+                m_activeMask &= ~(1 << i);
+                m_trippedMask |= 1 << i;
+            }
+        }
+    }
+    switchOff(channel);
+}
+
+/*----------------------------------------------------------------------*
+/ turn a solenoid off from interrupt context at the end of a dose, the  *
+/ main loop acknowledges it later. Not a fault, channel is not tripped  *
+/-----------------------------------------------------------------------*/
+void SafetySupervisor::cutOff(uint8_t channel) {
+    switchOff(channel);
+}
+
+/*----------------------------------------------------------------------*
+/ output off with a direct port write. Turning a solenoid off also      *
+/ stops the pump if nothing else is drawing water                       *
+/-----------------------------------------------------------------------*/
+void SafetySupervisor::switchOff(uint8_t channel) {
+
+    *m_portArray[channel] |= m_bitMaskArray[channel];
+    m_activeMask &= ~(1 << channel);
+
+    if (channel != SAFETY_PUMP_CHANNEL && !(m_activeMask & WATER_CONSUMERS_MASK) && (m_activeMask & (1 << SAFETY_PUMP_CHANNEL))) {
+        *m_portArray[SAFETY_PUMP_CHANNEL] |= m_bitMaskArray[SAFETY_PUMP_CHANNEL];
+        m_activeMask &= ~(1 << SAFETY_PUMP_CHANNEL);
+    }
+}
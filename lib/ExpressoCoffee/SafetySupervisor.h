@@ -0,0 +1,70 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef SAFETY_SUPERVISOR_H_INCLUDED
+#define SAFETY_SUPERVISOR_H_INCLUDED
+
+#include <Arduino.h>
+
+const uint8_t SAFETY_CHANNELS_LEN = 4;                              //!< one solenoid per group, boiler solenoid and pump
+const uint8_t SAFETY_BOILER_CHANNEL = 2;                            //!< channels 0..1 are the group solenoids (group number - 1)
+const uint8_t SAFETY_PUMP_CHANNEL = 3;
+
+const uint16_t SAFETY_INTERRUPT_MICROS = 1024;                      //!< Timer0 period: 256 counts X prescaler 64 at 16 MHz (us)
+const uint8_t SAFETY_TICK_MILLIS = 10;                              //!< resolution of the output timers (ms)
+const uint8_t SAFETY_TICKS_PER_SECOND = 1000 / SAFETY_TICK_MILLIS;
+
+const unsigned long MAX_SOLENOID_OPEN_MILLIS = 180000UL;            //!< longest a group solenoid may stay open, also covers programming (ms)
+const unsigned long BOILER_FILL_TIMEOUT_MILLIS = 90000UL;           //!< longest the boiler may take to fill (ms)
+const unsigned long MAX_PUMP_ON_MILLIS = 600000UL;                  //!< longest the pump may run without stopping (ms)
+const uint8_t PUMP_DUTY_LIMIT_PERCENT = 75;                         //!< long term pump duty cycle allowed
+const uint16_t PUMP_DUTY_BUCKET_SECONDS = 600;                      //!< pump seconds at full duty tolerated above the limit
+
+/**
+ * SafetySupervisor
+ *
+ * Independent watchdog for the outputs that move water. tick() runs from the Timer0 compare
+ * interrupt (every 1.024 ms) and forces an output off (HIGH, outputs are active low) with a
+ * direct port write once it has been on for longer than its limit, whatever the main loop is
+ * doing. Interrupts are counted as 1024 us, so a 10 ms tick comes every 9 or 10 of them and the
+ * limits are kept in real time. Worst-case reaction is limit + one tick + one interrupt period.
+ *
+ * The main loop reports every output change with outputOn()/outputOff(), and reads the tripped
+ * channels with getTrippedMask() to bring its own state in line (stop brewing, stop filling).
+ *
+ * Pump duty is enforced with a leaky bucket: each second the pump runs fills it with the share
+ * above PUMP_DUTY_LIMIT_PERCENT, each second it rests drains the share below it. A full bucket
+ * forces the pump off and keeps it off until the bucket is half empty.
+ */
+class SafetySupervisor {
+public:
+    SafetySupervisor(){};
+    void attach(uint8_t channel, int8_t pin, unsigned long limitMillis);
+    void begin();
+    void tick();                                                    //!< call from TIMER0_COMPA_vect only
+    void outputOn(uint8_t channel);
+    void outputOff(uint8_t channel);
+    void cutOff(uint8_t channel);                                   //!< call from interrupt context only
+    uint8_t getTrippedMask() { return m_trippedMask; };
+    void acknowledge(uint8_t trippedMask);
+    bool isPumpCoolingDown() { return m_pumpCoolingDown; };
+
+private:
+    volatile uint8_t* m_portArray[SAFETY_CHANNELS_LEN] = { NULL };
+    uint8_t m_bitMaskArray[SAFETY_CHANNELS_LEN] = { 0 };
+    uint16_t m_limitTicksArray[SAFETY_CHANNELS_LEN] = { 0 };
+    volatile uint16_t m_onTicksArray[SAFETY_CHANNELS_LEN] = { 0 };
+    volatile uint8_t m_activeMask = 0;
+    volatile uint8_t m_trippedMask = 0;
+    volatile uint16_t m_pumpDutyBucket = 0;
+    volatile bool m_pumpCoolingDown = false;
+    uint16_t m_tickMicros = 0;                                      //!< time counted since the last tick (us)
+    uint8_t m_secondTicks = 0;
+    void forceOff(uint8_t channel);
+    void switchOff(uint8_t channel);
+    void updatePumpDuty();
+};
+
+#endif
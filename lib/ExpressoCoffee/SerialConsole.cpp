@@ -0,0 +1,134 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include "SerialConsole.h"
+#include "UsageCounters.h"
+#include "MemoryMonitor.h"
+
+void SerialConsole::loop() {
+
+    while (Serial.available() > 0) {
+        char c = Serial.read();
+        if (c == '\n' || c == '\r') {
+            if (m_lineLen > 0) {
+                m_line[m_lineLen] = '\0';
+                execute();
+                m_lineLen = 0;
+            }
+        } else if (m_lineLen < SERIAL_CONSOLE_LINE_LEN - 1) {
+            m_line[m_lineLen++] = c;
+        }
+    }
+}
+
+void SerialConsole::execute() {
+
+    char* command = strtok(m_line, " ");
+    char* arg1 = strtok(NULL, " ");
+    char* arg2 = strtok(NULL, " ");
+
+    if (command == NULL) {
+        return;
+    }
+
+    if (strcmp_P(command, PSTR("bank")) == 0) {
+        if (arg1 == NULL) {
+            printRecipeBanks();
+        } else if (arg2 != NULL) {
+            printResult(m_ptrExpressoMachine->selectRecipeBank(atoi(arg1), atoi(arg2) - 1));
+        } else {
+            printResult(false);
+        }
+    } else if (strcmp_P(command, PSTR("name")) == 0 && arg1 != NULL && arg2 != NULL) {
+        printResult(m_ptrExpressoMachine->setRecipeBankName(atoi(arg1) - 1, arg2));
+    } else if (strcmp_P(command, PSTR("copy")) == 0 && arg1 != NULL && arg2 != NULL) {
+        printResult(m_ptrExpressoMachine->copyDosageConfig(atoi(arg1), atoi(arg2)));
+    } else if (strcmp_P(command, PSTR("usage")) == 0) {
+        printUsageCounters();
+    } else if (strcmp_P(command, PSTR("status")) == 0) {
+        printStatus();
+    } else {
+        Serial.println(F("ERR unknown command"));
+    }
+}
+
+void SerialConsole::printRecipeBanks() {
+
+    char name[RECIPE_NAME_LEN];
+
+    for (uint8_t bank = 0; bank < RECIPE_BANKS_LEN; bank++) {
+        m_ptrExpressoMachine->getRecipeBankName(bank, name);
+        Serial.print(F("bank "));
+        Serial.print(bank + 1);
+        Serial.print(F(": "));
+        Serial.println(name);
+    }
+    for (int8_t i = 0; i < BREW_GROUPS_LEN; i++) {
+        BrewGroup* group = m_ptrExpressoMachine->getBrewGroup(i + 1);
+        if (group != NULL) {
+            Serial.print(F("group "));
+            Serial.print(i + 1);
+            Serial.print(F(": bank "));
+            Serial.println(group->getRecipeBank() + 1);
+        }
+    }
+}
+
+void SerialConsole::printUsageCounters() {
+
+    const UsageRecord& rec = m_ptrExpressoMachine->getUsageCounters()->getRecord();
+
+    for (int8_t g = 0; g < BREW_GROUPS_LEN; g++) {
+        Serial.print(F("group "));
+        Serial.print(g + 1);
+        Serial.print(F(" shots:"));
+        for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
+            Serial.print(' ');
+            Serial.print(rec.shotCountArray[g][i]);
+        }
+        Serial.print(F(" pulses: "));
+        Serial.println(rec.pulseCountArray[g]);
+    }
+    Serial.print(F("pump runtime (s): "));
+    Serial.println(rec.pumpRuntimeSeconds);
+    Serial.print(F("boiler fills: "));
+    Serial.println(rec.boilerFillCount);
+}
+
+void SerialConsole::printStatus() {
+
+    for (int8_t i = 0; i < BREW_GROUPS_LEN; i++) {
+        BrewGroup* group = m_ptrExpressoMachine->getBrewGroup(i + 1);
+        if (group == NULL) {
+            continue;
+        }
+        FlowMeterDiagnostics& diagnostics = group->getFlowMeter()->diagnostics;
+        Serial.print(F("group "));
+        Serial.print(i + 1);
+        Serial.print(group->ptrCurrentBrewingOption != NULL ? F(" brewing") : F(" idle"));
+        Serial.print(F(", flowmeter "));
+        switch (diagnostics.getHealth()) {
+            case FLOWMETER_HEALTHY: Serial.print(F("healthy")); break;
+            case FLOWMETER_STUCK: Serial.print(F("stuck")); break;
+            case FLOWMETER_INTERMITTENT: Serial.print(F("intermittent")); break;
+            case FLOWMETER_NOISY: Serial.print(F("noisy")); break;
+        }
+        Serial.println(diagnostics.isHealthy() ? F(", flowmeter dosing") : F(", time-based dosing"));
+    }
+    Serial.print(F("safety fault: "));
+    Serial.println(m_ptrExpressoMachine->isSafetyFault() ? F("yes") : F("no"));
+    Serial.print(F("free SRAM (bytes): "));
+    Serial.print(getFreeMemory());
+    Serial.print(F(", low-water mark: "));
+    Serial.println(getMemoryLowWaterMark());
+#if INVARIANT_CHECKS
+    Serial.print(F("invariant violations: "));
+    Serial.println(m_ptrExpressoMachine->getInvariantViolations());
+#endif
+}
+
+void SerialConsole::printResult(bool ok) {
+    Serial.println(ok ? F("OK") : F("ERR"));
+}
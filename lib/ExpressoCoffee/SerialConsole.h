@@ -0,0 +1,41 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef SERIAL_CONSOLE_H_INCLUDED
+#define SERIAL_CONSOLE_H_INCLUDED
+
+#include "ExpressoCoffee.h"
+
+const uint8_t SERIAL_CONSOLE_LINE_LEN = 24;                         //!< longest command line accepted (including terminating null)
+
+/**
+ * SerialConsole
+ *
+ * Line oriented commands received on the serial port. Bytes are consumed as they arrive,
+ * without waiting for the rest of the line, so the console never stalls the machine loop.
+ *
+ *   bank                   list recipe banks and the bank selected on each group
+ *   bank <group> <bank>    select recipe bank of a group (group must be idle)
+ *   name <bank> <name>     rename recipe bank
+ *   usage                  print lifetime usage counters
+ *   status                 print group, flowmeter health and safety status
+ */
+class SerialConsole {
+public:
+    SerialConsole(ExpressoMachine* expressoMachine) : m_ptrExpressoMachine(expressoMachine) {};
+    void loop();
+
+private:
+    ExpressoMachine* m_ptrExpressoMachine;
+    char m_line[SERIAL_CONSOLE_LINE_LEN];
+    uint8_t m_lineLen = 0;
+    void execute();
+    void printRecipeBanks();
+    void printUsageCounters();
+    void printStatus();
+    void printResult(bool ok);
+};
+
+#endif
@@ -0,0 +1,41 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include "ShotLog.h"
+
+void ShotLog::add(int8_t groupNumber, int8_t brewOptionIndex, StopReason stopReason, unsigned long durationMillis, long pulseCount) {
+
+    ShotRecord& rec = m_records[m_nextSequence % SHOT_LOG_LEN];
+    rec.sequence = m_nextSequence++;
+    rec.groupNumber = groupNumber;
+    rec.brewOptionIndex = brewOptionIndex;
+    rec.stopReason = stopReason;
+    rec.durationDeciseconds = durationMillis / 100 > 0xFFFF ? 0xFFFF : durationMillis / 100;
+    rec.pulseCount = pulseCount > 0xFFFF ? 0xFFFF : pulseCount;
+    if (m_count < SHOT_LOG_LEN) {
+        m_count++;
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ copy up to maxRecords records, oldest first, starting at fromSequence *
+/ or at the oldest record held when that one was already overwritten    *
+/ (or is ahead of the log, after a restart of the controller)           *
+/-----------------------------------------------------------------------*/
+uint8_t ShotLog::getRecords(uint16_t fromSequence, ShotRecord* records, uint8_t maxRecords) {
+
+    uint16_t oldestSequence = m_nextSequence - m_count;
+    uint16_t available = m_nextSequence - fromSequence;
+    if (available > m_count) {
+        fromSequence = oldestSequence;
+        available = m_count;
+    }
+
+    uint8_t len = available < maxRecords ? available : maxRecords;
+    for (uint8_t i = 0; i < len; i++) {
+        records[i] = m_records[(uint16_t) (fromSequence + i) % SHOT_LOG_LEN];
+    }
+    return len;
+}
@@ -0,0 +1,42 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef SHOT_LOG_H_INCLUDED
+#define SHOT_LOG_H_INCLUDED
+
+#include "ExpressoCoffee.h"
+
+const uint8_t SHOT_LOG_LEN = 16;                                    //!< shots kept in RAM until collected by the bus host
+
+struct ShotRecord {
+    uint16_t sequence;                                              //!< wraps around, compare by difference
+    int8_t groupNumber;
+    int8_t brewOptionIndex;
+    uint8_t stopReason;
+    uint16_t durationDeciseconds;
+    uint16_t pulseCount;
+};
+
+/**
+ * ShotLog
+ *
+ * Ring buffer of the last SHOT_LOG_LEN shots, filled by the brew groups as shots end. The
+ * oldest record is overwritten when the host does not collect them in time; the host sees the
+ * gap in the sequence numbers.
+ */
+class ShotLog {
+public:
+    ShotLog(){};
+    void add(int8_t groupNumber, int8_t brewOptionIndex, StopReason stopReason, unsigned long durationMillis, long pulseCount);
+    uint8_t getRecords(uint16_t fromSequence, ShotRecord* records, uint8_t maxRecords);
+    uint16_t getNextSequence() { return m_nextSequence; };
+
+private:
+    ShotRecord m_records[SHOT_LOG_LEN];
+    uint16_t m_nextSequence = 0;
+    uint8_t m_count = 0;
+};
+
+#endif
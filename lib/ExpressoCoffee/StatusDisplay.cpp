@@ -0,0 +1,293 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include "StatusDisplay.h"
+
+// open drain lines: PORTD bits stay 0, the DDR bit selects pulled low or released
+#define SDA_LOW()       (DDRD |= _BV(DDD6))
+#define SDA_RELEASE()   (DDRD &= ~_BV(DDD6))
+#define SDA_READ()      (PIND & _BV(PIND6))
+#define SCL_LOW()       (DDRD |= _BV(DDD7))
+#define SCL_RELEASE()   (DDRD &= ~_BV(DDD7))
+
+// PCF8574 backpack outputs
+const uint8_t BACKPACK_RS = 0x01;
+const uint8_t BACKPACK_E = 0x04;
+const uint8_t BACKPACK_BACKLIGHT = 0x08;
+
+const uint8_t LCD_SET_DDRAM_ADDRESS = 0x80;
+const uint8_t LCD_ROW_OFFSET = 0x40;
+
+/*----------------------------------------------------------------------*
+/ HD44780 4-bit initialization: value, then wait in milliseconds after  *
+/ the transfer, INIT_NIBBLE set when only the high nibble is sent       *
+/-----------------------------------------------------------------------*/
+const uint8_t INIT_NIBBLE = 0x80;
+const uint8_t INIT_SEQUENCE_LEN = 8;
+static const uint8_t INIT_SEQUENCE[INIT_SEQUENCE_LEN][2] PROGMEM = {
+    { 0x03, INIT_NIBBLE | 5 },                                      // 8-bit mode, 3 times
+    { 0x03, INIT_NIBBLE | 1 },
+    { 0x03, INIT_NIBBLE | 1 },
+    { 0x02, INIT_NIBBLE | 1 },                                      // 4-bit mode
+    { 0x28, 0 },                                                    // 2 lines, 5x8 font
+    { 0x0C, 0 },                                                    // display on, no cursor
+    { 0x01, 2 },                                                    // clear
+    { 0x06, 0 }                                                     // increment address, no shift
+};
+
+const uint8_t GROUP_FIELDS_LEN = 4;                                 //!< state, shot time, pulses, recipe bank
+const uint8_t STATUS_DISPLAY_FIELDS_LEN = BREW_GROUPS_LEN * GROUP_FIELDS_LEN + 1;    //!< plus boiler status
+
+static const char STATE_CHARS[GROUP_STATES_LEN] PROGMEM = { '-', 'B', 'P', 'P', 'B' };
+static const uint16_t POWERS_OF_TEN[] PROGMEM = { 1000, 100, 10, 1 };
+
+void StatusDisplay::setup() {
+
+    PORTD &= ~(_BV(PORTD6) | _BV(PORTD7));
+    SDA_RELEASE();
+    SCL_RELEASE();
+
+    memset(m_wanted, ' ', sizeof(m_wanted));
+    memset(m_shown, ' ', sizeof(m_shown));                          //!< what the display holds once cleared by the init sequence
+    for (uint8_t row = 0; row < STATUS_DISPLAY_ROWS; row++) {
+        m_wanted[row][0] = '1' + row;
+    }
+
+    m_present = true;
+    m_waitStartMs = millis();
+    m_waitMillis = 50;                                              //!< display power on time
+}
+
+void StatusDisplay::loop() {
+
+    if (m_busState != BUS_IDLE) {
+        // a fast loop must not clock the bus faster than standard mode
+        unsigned long now = micros();
+        if (now - m_busStepUs >= STATUS_DISPLAY_HALF_CYCLE_MICROS) {
+            m_busStepUs = now;
+            busStep();
+        }
+        return;
+    }
+
+    // a transfer not acknowledged still ends with a stop condition
+    if (!m_present) {
+        return;
+    }
+
+    if (m_waitMillis > 0) {
+        if (millis() - m_waitStartMs < m_waitMillis) {
+            return;
+        }
+        m_waitMillis = 0;
+    }
+
+    if (m_initStep < INIT_SEQUENCE_LEN) {
+        uint8_t value = pgm_read_byte(&INIT_SEQUENCE[m_initStep][0]);
+        uint8_t flags = pgm_read_byte(&INIT_SEQUENCE[m_initStep][1]);
+        if (flags & INIT_NIBBLE) {
+            sendNibble(value);
+        } else {
+            sendByte(value, false);
+        }
+        m_waitMillis = flags & ~INIT_NIBBLE;
+        m_initStep++;
+        return;
+    }
+
+    if (sendNextChangedCell()) {
+        return;
+    }
+
+    if (millis() - m_renderedMs >= STATUS_DISPLAY_REFRESH_MILLIS) {
+        renderField(m_fieldIndex);
+        m_cleanCells = 0;
+        if (++m_fieldIndex == STATUS_DISPLAY_FIELDS_LEN) {
+            m_fieldIndex = 0;
+            m_renderedMs = millis();
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ one I2C half clock cycle. Data changes while SCL is low, the ack bit  *
+/ is read one step after SCL was released so the line had time to rise *
+/-----------------------------------------------------------------------*/
+void StatusDisplay::busStep() {
+
+    switch (m_busState) {
+        case BUS_START:
+            if (m_busPhase == 0) {
+                SDA_LOW();
+                m_busPhase = 1;
+            } else {
+                SCL_LOW();
+                m_busState = BUS_BITS;
+                m_busPhase = 0;
+                m_bit = 0;
+                m_txIndex = 0;
+            }
+            break;
+        case BUS_BITS:
+            if (m_busPhase == 0) {
+                if (m_bit == 9) {
+                    if (m_txIndex == 0 && SDA_READ()) {
+                        DEBUG1_PRINTLN(F("Status display not acknowledging, display disabled"));
+                        m_present = false;
+                    }
+                    m_bit = 0;
+                    if (++m_txIndex == m_txLen || !m_present) {
+                        m_busState = BUS_STOP;
+                        break;
+                    }
+                }
+                SCL_LOW();
+                if (m_bit < 8 && !(m_txBytes[m_txIndex] & (0x80 >> m_bit))) {
+                    SDA_LOW();
+                } else {
+                    SDA_RELEASE();                                  //!< 1 bits and ack bit
+                }
+                m_busPhase = 1;
+            } else {
+                SCL_RELEASE();
+                m_bit++;
+                m_busPhase = 0;
+            }
+            break;
+        case BUS_STOP:
+            if (m_busPhase == 0) {
+                SCL_LOW();
+                SDA_LOW();
+                m_busPhase = 1;
+            } else if (m_busPhase == 1) {
+                SCL_RELEASE();
+                m_busPhase = 2;
+            } else {
+                SDA_RELEASE();
+                m_busState = BUS_IDLE;
+                m_busPhase = 0;
+                m_waitStartMs = millis();                           //!< waits count from the end of the transfer
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void StatusDisplay::startTransfer(uint8_t len) {
+    m_txBytes[0] = STATUS_DISPLAY_ADDRESS << 1;
+    m_txLen = len;
+    m_busState = BUS_START;
+    m_busPhase = 0;
+}
+
+/*----------------------------------------------------------------------*
+/ a display byte is two nibbles, each latched by a high then low E      *
+/-----------------------------------------------------------------------*/
+void StatusDisplay::sendByte(uint8_t value, bool isData) {
+    uint8_t control = BACKPACK_BACKLIGHT | (isData ? BACKPACK_RS : 0);
+    m_txBytes[1] = (value & 0xF0) | control | BACKPACK_E;
+    m_txBytes[2] = (value & 0xF0) | control;
+    m_txBytes[3] = (value << 4) | control | BACKPACK_E;
+    m_txBytes[4] = (value << 4) | control;
+    startTransfer(5);
+}
+
+void StatusDisplay::sendNibble(uint8_t nibble) {
+    m_txBytes[1] = (nibble << 4) | BACKPACK_BACKLIGHT | BACKPACK_E;
+    m_txBytes[2] = (nibble << 4) | BACKPACK_BACKLIGHT;
+    startTransfer(3);
+}
+
+/*----------------------------------------------------------------------*
+/ compare a few cells and send the first changed one. The address       *
+/ command is skipped when the cell follows the last one written. Returns *
+/ false once every cell was found unchanged                             *
+/-----------------------------------------------------------------------*/
+bool StatusDisplay::sendNextChangedCell() {
+
+    for (uint8_t n = 0; n < STATUS_DISPLAY_SCAN_CELLS; n++) {
+        if (m_cleanCells >= STATUS_DISPLAY_ROWS * STATUS_DISPLAY_COLS) {
+            return false;
+        }
+        uint8_t row = m_scanIndex / STATUS_DISPLAY_COLS;
+        uint8_t col = m_scanIndex % STATUS_DISPLAY_COLS;
+        if (m_wanted[row][col] != m_shown[row][col]) {
+            uint8_t address = row * LCD_ROW_OFFSET + col;
+            if (address != m_lcdAddress) {
+                sendByte(LCD_SET_DDRAM_ADDRESS | address, false);
+                m_lcdAddress = address;
+            } else {
+                sendByte(m_wanted[row][col], true);
+                m_shown[row][col] = m_wanted[row][col];
+                m_lcdAddress++;
+            }
+            m_cleanCells = 0;
+            return true;
+        }
+        m_cleanCells++;
+        if (++m_scanIndex == STATUS_DISPLAY_ROWS * STATUS_DISPLAY_COLS) {
+            m_scanIndex = 0;
+        }
+    }
+    return true;
+}
+
+void StatusDisplay::renderField(uint8_t field) {
+
+    if (field == STATUS_DISPLAY_FIELDS_LEN - 1) {
+        m_wanted[STATUS_DISPLAY_ROWS-1][STATUS_DISPLAY_COLS-1] = m_ptrExpressoMachine->isSafetyFault() ? '!'
+            : m_ptrExpressoMachine->isFillingBoiler() ? 'F' : ' ';
+        return;
+    }
+
+    uint8_t row = field / GROUP_FIELDS_LEN;
+    BrewGroup* group = m_ptrExpressoMachine->getBrewGroup(row + 1);
+    char* line = m_wanted[row];
+    if (group == NULL) {
+        return;
+    }
+
+    switch (field % GROUP_FIELDS_LEN) {
+        case 0: {
+            int8_t optionIndex = group->getBrewingOptionIndex();
+            line[1] = pgm_read_byte(&STATE_CHARS[group->getState()]);
+            line[2] = optionIndex < 0 ? ' ' : optionIndex == CONTINUOUS_BREW_OPTION_INDEX ? 'C' : '1' + optionIndex;
+            break;
+        }
+        case 1:
+            // shot time stays on display after the shot ends
+            if (group->ptrCurrentBrewingOption != NULL) {
+                unsigned long eighths = group->getBrewingMillis() >> 3;    //!< 16 bit division is much cheaper on AVR
+                formatNumber(&line[4], (eighths > 65535UL ? 65535U : (uint16_t) eighths) / 125, 3);
+                line[7] = 's';
+            }
+            break;
+        case 2: {
+            long pulseCount = group->getFlowMeter()->getPulseCount();
+            formatNumber(&line[9], pulseCount > 9999 ? 9999 : (uint16_t) pulseCount, 4);
+            break;
+        }
+        default:
+            line[14] = '1' + group->getRecipeBank();
+            break;
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ right aligned, zero padded decimal of up to 4 digits, by subtraction  *
+/ since AVR has no divide instruction                                   *
+/-----------------------------------------------------------------------*/
+void StatusDisplay::formatNumber(char* dst, uint16_t value, uint8_t width) {
+    for (uint8_t i = 4 - width; i < 4; i++) {
+        uint16_t power = pgm_read_word(&POWERS_OF_TEN[i]);
+        char digit = '0';
+        while (value >= power) {
+            value -= power;
+            digit++;
+        }
+        *dst++ = digit;
+    }
+}
@@ -0,0 +1,90 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef STATUS_DISPLAY_H_INCLUDED
+#define STATUS_DISPLAY_H_INCLUDED
+
+#include "ExpressoCoffee.h"
+#include "PerfProbe.h"
+
+#ifndef STATUS_DISPLAY
+#define STATUS_DISPLAY 0                                            //!< 1 to drive a 16x2 status display on D6 (SDA) and D7 (SCL)
+#endif
+
+#if STATUS_DISPLAY && PERF_PROBES
+#error "STATUS_DISPLAY and PERF_PROBES both use pins D6 and D7"
+#endif
+
+const uint8_t STATUS_DISPLAY_ADDRESS = 0x27;                        //!< I2C address of the PCF8574 backpack
+const uint8_t STATUS_DISPLAY_ROWS = 2;
+const uint8_t STATUS_DISPLAY_COLS = 16;
+const uint8_t STATUS_DISPLAY_HALF_CYCLE_MICROS = 9;                 //!< I2C standard mode needs 4.7 us SCL low, 4.0 us high; micros() steps by 4 us
+const uint8_t STATUS_DISPLAY_SCAN_CELLS = 8;                        //!< cells compared per loop call looking for changes
+const unsigned long STATUS_DISPLAY_REFRESH_MILLIS = 250;            //!< interval at which fields are rendered again
+
+/**
+ * StatusDisplay
+ *
+ * HD44780 16x2 character display behind a PCF8574 I2C backpack. The TWI pins (A4/A5) are
+ * group 2 buttons, so I2C is bit-banged on D6/D7 as open drain (DDR bit set pulls the line
+ * low, cleared releases it to the backpack pull-ups). Nothing ever waits: each loop() call
+ * does one bounded slice of work, either one bus half cycle, comparing a few cells or
+ * rendering one field, so a loop iteration gets only a few microseconds longer. The bus is
+ * as slow as the loop, which I2C allows since the clock has no minimum frequency; half
+ * cycles closer than STATUS_DISPLAY_HALF_CYCLE_MICROS wait for the next call.
+ *
+ * Fields are rendered into m_wanted, and only the cells that differ from m_shown (what the
+ * display holds) are sent, one address command per run of changed cells.
+ *
+ *   row per group:  "1B2 023s 0245 1!"
+ *                    | ||  |    |   | `- boiler: F filling, ! safety fault (2nd row)
+ *                    | ||  |    |   `--- recipe bank
+ *                    | ||  |    `------- flowmeter pulses
+ *                    | ||  `------------ shot time, held after the shot ends
+ *                    | |`--------------- option brewing, C for continuous
+ *                    | `---------------- state: - idle, B brewing, P programming
+ *                    `------------------ group number
+ */
+class StatusDisplay {
+public:
+    StatusDisplay(ExpressoMachine* expressoMachine) : m_ptrExpressoMachine(expressoMachine) {};
+    void setup();
+    void loop();
+
+private:
+    enum BusState { BUS_IDLE, BUS_START, BUS_BITS, BUS_STOP };
+
+    ExpressoMachine* m_ptrExpressoMachine;
+    char m_wanted[STATUS_DISPLAY_ROWS][STATUS_DISPLAY_COLS];
+    char m_shown[STATUS_DISPLAY_ROWS][STATUS_DISPLAY_COLS];
+    bool m_present = false;                                         //!< cleared when the backpack does not acknowledge its address
+    uint8_t m_initStep = 0;
+    uint8_t m_lcdAddress = 0xFF;                                    //!< DDRAM address the display will write next
+    uint8_t m_scanIndex = 0;
+    uint8_t m_cleanCells = 0;                                       //!< cells found unchanged since the last change
+    uint8_t m_fieldIndex = 0;
+    unsigned long m_renderedMs = 0;
+    unsigned long m_waitStartMs = 0;
+    uint8_t m_waitMillis = 0;
+
+    // transfer in progress: address byte and the 4 backpack writes of one display byte
+    uint8_t m_txBytes[5];
+    uint8_t m_txLen = 0;
+    uint8_t m_txIndex = 0;
+    BusState m_busState = BUS_IDLE;
+    unsigned long m_busStepUs = 0;                                  //!< micros() of the last bus line change
+    uint8_t m_busPhase = 0;
+    uint8_t m_bit = 0;
+
+    void busStep();
+    void sendByte(uint8_t value, bool isData);
+    void sendNibble(uint8_t nibble);
+    void startTransfer(uint8_t len);
+    bool sendNextChangedCell();
+    void renderField(uint8_t field);
+    void formatNumber(char* dst, uint16_t value, uint8_t width);
+};
+
+#endif
@@ -0,0 +1,104 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include "UsageCounters.h"
+#include <EEPromUtils.h>
+
+int UsageCounters::slotLocation(uint32_t sequence) {
+    return m_location + EEPROM_SIZE( sizeof(UsageRecord) ) * (sequence % USAGE_COUNTERS_SLOTS);
+}
+
+/*----------------------------------------------------------------------*
+/ load the newest valid record of the ring. Slots never written (or     *
+/ with a bad checksum) are skipped                                      *
+/-----------------------------------------------------------------------*/
+void UsageCounters::setup(int location) {
+
+    m_location = location;
+    m_record = UsageRecord();
+
+    if (!EEPROM_init()) {
+        return;
+    }
+
+    UsageRecord slot;
+    bool found = false;
+    for (uint8_t i = 0; i < USAGE_COUNTERS_SLOTS; i++) {
+        if (EEPROM_safe_read(slotLocation(i), (uint8_t*) &slot, sizeof(slot)) >= 0
+            && slot.sequence % USAGE_COUNTERS_SLOTS == i
+            && (!found || slot.sequence > m_record.sequence)) {
+            m_record = slot;
+            found = true;
+        }
+    }
+
+    DEBUG3_VALUELN(F("Usage counters loaded, sequence: "), m_record.sequence);
+}
+
+void UsageCounters::countShot(int8_t groupNumber, int8_t brewOptionIndex, long pulseCount) {
+    m_record.shotCountArray[groupNumber-1][brewOptionIndex]++;
+    m_record.pulseCountArray[groupNumber-1] += pulseCount;
+    m_pendingShots++;
+    markPending();
+}
+
+void UsageCounters::addPumpRuntime(unsigned long millis) {
+    m_pumpRuntimeMillis += millis;
+    m_record.pumpRuntimeSeconds += m_pumpRuntimeMillis / 1000;
+    m_pumpRuntimeMillis %= 1000;
+    markPending();
+}
+
+void UsageCounters::countBoilerFill() {
+    m_record.boilerFillCount++;
+    markPending();
+}
+
+void UsageCounters::markPending() {
+    m_pending = true;
+    m_lastChangeMs = millis();
+}
+
+/*----------------------------------------------------------------------*
+/ save pending counters, only while machine is idle so EEPROM writes   *
+/ never delay brewing                                                   *
+/-----------------------------------------------------------------------*/
+void UsageCounters::loop(bool idle) {
+    if (m_saveFailed && millis() - m_lastSaveAttemptMs < EEPROM_WRITE_REFILL_MILLIS) {
+        return;
+    }
+    if (idle && m_pending
+        && (m_pendingShots >= USAGE_FLUSH_SHOTS || millis() - m_lastChangeMs >= USAGE_FLUSH_IDLE_MILLIS)) {
+        save();
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ counters stay pending until a write succeeds; a refused or failed     *
+/ write is retried after EEPROM_WRITE_REFILL_MILLIS, when the write     *
+/ budget has a token again                                              *
+/-----------------------------------------------------------------------*/
+void UsageCounters::save() {
+
+    uint32_t sequence = m_record.sequence;
+    m_record.sequence++;
+    int location = slotLocation(m_record.sequence);
+
+    DEBUG2_VALUE(F("Saving usage counters, sequence "), m_record.sequence);
+    DEBUG2_VALUELN(F(" on EEPROM @ location "), location);
+
+    m_lastSaveAttemptMs = millis();
+    EEPROM_init();
+    if (boundedEepromWrite(location, (uint8_t*) &m_record, sizeof(m_record)) < 0) {
+        DEBUG1_PRINTLN(F("Error saving usage counters, retrying later"));
+        m_record.sequence = sequence;                               //!< the newest valid slot is still the previous one
+        m_saveFailed = true;
+        return;
+    }
+
+    m_saveFailed = false;
+    m_pendingShots = 0;
+    m_pending = false;
+}
@@ -0,0 +1,61 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef USAGE_COUNTERS_H_INCLUDED
+#define USAGE_COUNTERS_H_INCLUDED
+
+#include "ExpressoCoffee.h"
+
+const uint8_t USAGE_COUNTERS_SLOTS = 8;                             //!< EEPROM slots the counters record rotates through
+const uint8_t USAGE_FLUSH_SHOTS = 10;                               //!< shots accumulated in RAM before the counters are saved
+const unsigned long USAGE_FLUSH_IDLE_MILLIS = 10UL * 60 * 1000;     //!< pending counters are saved after this idle time (ms)
+
+/**
+ * UsageRecord
+ *
+ * Lifetime counters of the machine. Saved to EEPROM as a whole, in the next slot of a ring of
+ * USAGE_COUNTERS_SLOTS records; the valid record with the highest sequence is the current one.
+ */
+struct UsageRecord {
+    uint32_t sequence = 0;                                          //!< incremented on every save, selects the newest slot
+    uint32_t shotCountArray[BREW_GROUPS_LEN][BREW_OPTIONS_LEN] = {};    //!< shots brewed per group and brew option
+    uint32_t pulseCountArray[BREW_GROUPS_LEN] = {};                 //!< flowmeter pulses (water volume) per group
+    uint32_t pumpRuntimeSeconds = 0;
+    uint32_t boilerFillCount = 0;
+};
+
+/**
+ * UsageCounters
+ *
+ * Counters are accumulated in RAM and saved only while the machine is idle, at most every
+ * USAGE_FLUSH_SHOTS shots, so a power loss loses at most that many shots (plus their pulses and
+ * pump time). Rotating the record through the ring divides the wear of each EEPROM cell by
+ * USAGE_COUNTERS_SLOTS: with 100k write cycles per cell that is about 8 million shots.
+ */
+class UsageCounters {
+public:
+    UsageCounters(){};
+    void setup(int location);
+    void countShot(int8_t groupNumber, int8_t brewOptionIndex, long pulseCount);
+    void addPumpRuntime(unsigned long millis);
+    void countBoilerFill();
+    void loop(bool idle);
+    const UsageRecord& getRecord() { return m_record; };
+
+private:
+    UsageRecord m_record;
+    int m_location = 0;
+    uint8_t m_pendingShots = 0;
+    bool m_pending = false;
+    unsigned long m_pumpRuntimeMillis = 0;                          //!< remainder below one second
+    unsigned long m_lastChangeMs = 0;
+    bool m_saveFailed = false;                                      //!< last save refused or failed, counters still pending
+    unsigned long m_lastSaveAttemptMs = 0;
+    int slotLocation(uint32_t sequence);
+    void markPending();
+    void save();
+};
+
+#endif
@@ -0,0 +1,58 @@
+# Per-symbol SRAM/flash breakdown of the firmware.
+#
+# Usage: pio run -e uno -t memreport
+#
+# Symbols are classified by address: AVR data space is mapped at 0x800000
+# in the ELF, so anything above it lives in SRAM (.data is also copied from
+# flash at startup), the rest is flash only.
+
+import subprocess
+
+Import("env")
+
+SRAM_OFFSET = 0x800000
+TOP_SYMBOLS = 25
+
+
+def print_table(title, symbols):
+    total = sum(size for size, _, _ in symbols)
+    print("\n%s: %d bytes in %d symbols" % (title, total, len(symbols)))
+    print("%8s  %-4s %s" % ("size", "type", "symbol"))
+    for size, kind, name in symbols[:TOP_SYMBOLS]:
+        print("%8d  %-4s %s" % (size, kind, name))
+    if len(symbols) > TOP_SYMBOLS:
+        rest = sum(size for size, _, _ in symbols[TOP_SYMBOLS:])
+        print("%8d  ...  %d more symbols" % (rest, len(symbols) - TOP_SYMBOLS))
+
+
+def memory_report(source, target, env):
+    elf = str(source[0])
+    run_env = env["ENV"]
+
+    print(subprocess.check_output(
+        ["avr-size", "-C", "--mcu=%s" % env.subst("$BOARD_MCU"), elf],
+        env=run_env).decode())
+
+    output = subprocess.check_output(
+        ["avr-nm", "--print-size", "--size-sort", "--reverse-sort", "--demangle", elf],
+        env=run_env).decode()
+
+    sram, flash = [], []
+    for line in output.splitlines():
+        fields = line.split(None, 3)
+        if len(fields) < 4:
+            continue
+        address, size, kind, name = int(fields[0], 16), int(fields[1], 16), fields[2], fields[3]
+        (sram if address >= SRAM_OFFSET else flash).append((size, kind, name))
+
+    print_table("SRAM (.data/.bss)", sram)
+    print_table("Flash (.text/.progmem)", flash)
+
+
+env.AddCustomTarget(
+    name="memreport",
+    dependencies="$BUILD_DIR/${PROGNAME}.elf",
+    actions=memory_report,
+    title="Memory Report",
+    description="Print per-symbol SRAM/flash usage of the firmware"
+)
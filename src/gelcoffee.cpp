@@ -6,8 +6,14 @@
 
 #define GROUP1_OPTION1_PIN      A0
 #define GROUP1_OPTION2_PIN      5
+// D0/D1 are the USART with the serial console or the bus node, any traffic would read as presses
+#if SERIAL_CONSOLE || BUS_NODE
+#define GROUP1_OPTION3_PIN      NO_OPTION_PIN
+#define GROUP1_OPTION4_PIN      NO_OPTION_PIN
+#else
 #define GROUP1_OPTION3_PIN      1
 #define GROUP1_OPTION4_PIN      0
+#endif
 #define GROUP1_OPTION5_PIN      4
 
 #define WATER_LEVEL_PIN         8
@@ -24,39 +30,89 @@
 #define PUMP_PIN                9
 
 #include <ExpressoCoffee.h>
+#include <MemoryMonitor.h>
+#include <SerialConsole.h>
+#include <StatusDisplay.h>
+#include <BusNode.h>
+#include <LoadCell.h>
+#include <UsageCounters.h>
+#include <PerfProbe.h>
 
 #include <Debug.h>
 
 const uint8_t FLOWMETER_DEBOUNCE_INVERVAL_MS = 30;
+const unsigned long MEMORY_REPORT_INTERVAL = 10000;                 //!< interval at which to report free SRAM on debug output (ms)
 
-int8_t GROUP1_PINS[BREW_OPTIONS_LEN] { GROUP1_OPTION1_PIN, GROUP1_OPTION2_PIN, GROUP1_OPTION3_PIN, GROUP1_OPTION4_PIN, GROUP1_OPTION5_PIN };    //!< short single coffee, long single coffee, short double coffee, long double coffee, continuous
-int8_t GROUP2_PINS[BREW_OPTIONS_LEN] { GROUP2_OPTION1_PIN, GROUP2_OPTION2_PIN, GROUP2_OPTION3_PIN, GROUP2_OPTION4_PIN, GROUP2_OPTION5_PIN };    //!< short single coffee, long single coffee, short double coffee, long double coffee, continuous
-
-ExpressoMachine* expressoMachine;
+const int8_t GROUP1_PINS[BREW_OPTIONS_LEN] PROGMEM { GROUP1_OPTION1_PIN, GROUP1_OPTION2_PIN, GROUP1_OPTION3_PIN, GROUP1_OPTION4_PIN, GROUP1_OPTION5_PIN };    //!< short single coffee, long single coffee, short double coffee, long double coffee, continuous
+const int8_t GROUP2_PINS[BREW_OPTIONS_LEN] PROGMEM { GROUP2_OPTION1_PIN, GROUP2_OPTION2_PIN, GROUP2_OPTION3_PIN, GROUP2_OPTION4_PIN, GROUP2_OPTION5_PIN };    //!< short single coffee, long single coffee, short double coffee, long double coffee, continuous
 
 SimpleFlowMeter flowMeterGroup1;
 SimpleFlowMeter flowMeterGroup2;
 
+// statically allocated so the SRAM budget is known at link time
+BrewGroup brewGroups[BREW_GROUPS_LEN] {
+    BrewGroup(1, GROUP1_PINS, &flowMeterGroup1, SOLENOID_GROUP1_PIN),
+    BrewGroup(2, GROUP2_PINS, &flowMeterGroup2, SOLENOID_GROUP2_PIN)
+};
+
+SafetySupervisor safetySupervisor;
+UsageCounters usageCounters;
+
+ExpressoMachine expressoMachine(brewGroups, BREW_GROUPS_LEN, PUMP_PIN, SOLENOID_BOILER_PIN, WATER_LEVEL_PIN, &safetySupervisor, &usageCounters);
+
+#if SERIAL_CONSOLE
+    SerialConsole serialConsole(&expressoMachine);
+#endif
+
+#if STATUS_DISPLAY
+    StatusDisplay statusDisplay(&expressoMachine);
+#endif
+
+#if LOAD_CELL
+    LoadCell loadCell(LOAD_CELL_SCK_PIN, LOAD_CELL_DOUT_PIN);
+#endif
+
+#if BUS_NODE
+    ShotLog shotLog;
+    BusNode busNode(&expressoMachine, &shotLog, BUS_NODE_ADDRESS, BUS_NODE_DE_PIN);
+#endif
+
 void meterISRGroup1() {
+    PERF_ISR_BEGIN();
     static unsigned long lastInterruptMillis = 0;
     volatile unsigned long interruptMillis = millis();
-    DEBUG5_PRINTLN("meterISRGroup1()");
+    DEBUG5_PRINTLN(F("meterISRGroup1()"));
     if (interruptMillis - lastInterruptMillis > FLOWMETER_DEBOUNCE_INVERVAL_MS)
     {
         flowMeterGroup1.increment();
+    } else {
+        flowMeterGroup1.reject();
     }
     lastInterruptMillis = interruptMillis;
+    PERF_ISR_END();
 }
 
 void meterISRGroup2() {
+    PERF_ISR_BEGIN();
     static unsigned long lastInterruptMillis = 0;
     volatile unsigned long interruptMillis = millis();
-    DEBUG5_PRINTLN("meterISRGroup2()");
+    DEBUG5_PRINTLN(F("meterISRGroup2()"));
     if (interruptMillis - lastInterruptMillis > FLOWMETER_DEBOUNCE_INVERVAL_MS)
     {
         flowMeterGroup2.increment();
+    } else {
+        flowMeterGroup2.reject();
     }
     lastInterruptMillis = interruptMillis;
+    PERF_ISR_END();
+}
+
+/*----------------------------------------------------------------------*
+/ Timer0 compare interrupt, every 1.024 ms. Enforces max on-time of     *
+/ solenoids and pump even if the main loop is stuck                     *
+/-----------------------------------------------------------------------*/
+ISR(TIMER0_COMPA_vect) {
+    safetySupervisor.tick();
 }
 
 /*----------------------------------------------------------------------*
@@ -68,73 +124,80 @@ void meterISRGroup2() {
 /-----------------------------------------------------------------------*/
 void visualInit() {
 
-    DEBUG2_PRINTLN("Init routine to blink leds");
+    DEBUG2_PRINTLN(F("Init routine to blink leds"));
+
+    int8_t group1Pins[BREW_OPTIONS_LEN];
+    int8_t group2Pins[BREW_OPTIONS_LEN];
+    memcpy_P(group1Pins, GROUP1_PINS, BREW_OPTIONS_LEN);
+    memcpy_P(group2Pins, GROUP2_PINS, BREW_OPTIONS_LEN);
 
     // start with all leds off
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
-        pinMode(GROUP1_PINS[i], INPUT_PULLUP);
-        DEBUG3_VALUELN("Pin mode INPUT_PULLUP on pin: ", GROUP1_PINS[i]);
-        pinMode(GROUP2_PINS[i], INPUT_PULLUP);
-        DEBUG3_VALUELN("Pin mode INPUT_PULLUP on pin: ", GROUP2_PINS[i]);
+        if (group1Pins[i] != NO_OPTION_PIN) {
+            pinMode(group1Pins[i], INPUT_PULLUP);
+            DEBUG3_VALUELN(F("Pin mode INPUT_PULLUP on pin: "), group1Pins[i]);
+        }
+        pinMode(group2Pins[i], INPUT_PULLUP);
+        DEBUG3_VALUELN(F("Pin mode INPUT_PULLUP on pin: "), group2Pins[i]);
     }
 
     // turn on 5th led on group 1
-    digitalWrite(GROUP1_PINS[CONTINUOUS_BREW_OPTION_INDEX], LOW);
-    pinMode(GROUP1_PINS[CONTINUOUS_BREW_OPTION_INDEX], OUTPUT);
-    DEBUG3_VALUELN("Pin mode OUTPUT on pin: ", GROUP1_PINS[CONTINUOUS_BREW_OPTION_INDEX]);
+    digitalWrite(group1Pins[CONTINUOUS_BREW_OPTION_INDEX], LOW);
+    pinMode(group1Pins[CONTINUOUS_BREW_OPTION_INDEX], OUTPUT);
+    DEBUG3_VALUELN(F("Pin mode OUTPUT on pin: "), group1Pins[CONTINUOUS_BREW_OPTION_INDEX]);
 
     // turn on 5th led on group 2
-    digitalWrite(GROUP2_PINS[CONTINUOUS_BREW_OPTION_INDEX], LOW);
-    pinMode(GROUP2_PINS[CONTINUOUS_BREW_OPTION_INDEX], OUTPUT);
-    DEBUG3_VALUELN("Pin mode OUTPUT on pin: ", GROUP2_PINS[CONTINUOUS_BREW_OPTION_INDEX]);
+    digitalWrite(group2Pins[CONTINUOUS_BREW_OPTION_INDEX], LOW);
+    pinMode(group2Pins[CONTINUOUS_BREW_OPTION_INDEX], OUTPUT);
+    DEBUG3_VALUELN(F("Pin mode OUTPUT on pin: "), group2Pins[CONTINUOUS_BREW_OPTION_INDEX]);
 
     // turn on first 4 leds on group 1 for 1 second
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
-        if (i != CONTINUOUS_BREW_OPTION_INDEX) {
-            digitalWrite(GROUP1_PINS[i], LOW);
-            pinMode(GROUP1_PINS[i], OUTPUT);
-            DEBUG3_VALUELN("Pin mode OUTPUT on pin: ", GROUP1_PINS[i]);
+        if (i != CONTINUOUS_BREW_OPTION_INDEX && group1Pins[i] != NO_OPTION_PIN) {
+            digitalWrite(group1Pins[i], LOW);
+            pinMode(group1Pins[i], OUTPUT);
+            DEBUG3_VALUELN(F("Pin mode OUTPUT on pin: "), group1Pins[i]);
         }
     }
-    DEBUG3_PRINTLN("Delay...");
+    DEBUG3_PRINTLN(F("Delay..."));
     delay(1000);
 
     // turn off first 4 leds on group 1
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
-        if (i != CONTINUOUS_BREW_OPTION_INDEX) {
-            pinMode(GROUP1_PINS[i], INPUT_PULLUP);
-            DEBUG3_VALUELN("Pin mode INPUT_PULLUP on pin: ", GROUP1_PINS[i]);
+        if (i != CONTINUOUS_BREW_OPTION_INDEX && group1Pins[i] != NO_OPTION_PIN) {
+            pinMode(group1Pins[i], INPUT_PULLUP);
+            DEBUG3_VALUELN(F("Pin mode INPUT_PULLUP on pin: "), group1Pins[i]);
         }
     }
 
     // turn on first 4 leds on group 2 for 1 second
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
         if (i != CONTINUOUS_BREW_OPTION_INDEX) {
-            digitalWrite(GROUP2_PINS[i], LOW);
-            pinMode(GROUP2_PINS[i], OUTPUT);
-            DEBUG3_VALUELN("Pin mode OUTPUT on pin: ", GROUP2_PINS[i]);
+            digitalWrite(group2Pins[i], LOW);
+            pinMode(group2Pins[i], OUTPUT);
+            DEBUG3_VALUELN(F("Pin mode OUTPUT on pin: "), group2Pins[i]);
         }
     }
-    DEBUG3_PRINTLN("Delay...");
+    DEBUG3_PRINTLN(F("Delay..."));
     delay(1000);
 
     // turn off first 4 leds on group 2
     for (int8_t i = 0; i < BREW_OPTIONS_LEN; i++) {
         if (i != CONTINUOUS_BREW_OPTION_INDEX) {
-            pinMode(GROUP2_PINS[i], INPUT_PULLUP);
-            DEBUG3_VALUELN("Pin mode INPUT_PULLUP on pin: ", GROUP2_PINS[i]);
+            pinMode(group2Pins[i], INPUT_PULLUP);
+            DEBUG3_VALUELN(F("Pin mode INPUT_PULLUP on pin: "), group2Pins[i]);
         }
     }
-    DEBUG3_PRINTLN("Delay...");
+    DEBUG3_PRINTLN(F("Delay..."));
     delay(800);
 
     // turn off 5th led both groups
-    pinMode(GROUP1_PINS[CONTINUOUS_BREW_OPTION_INDEX], INPUT_PULLUP);
-    DEBUG3_VALUELN("Pin mode INPUT_PULLUP on pin: ", GROUP1_PINS[CONTINUOUS_BREW_OPTION_INDEX]);
-    pinMode(GROUP2_PINS[CONTINUOUS_BREW_OPTION_INDEX], INPUT_PULLUP);
-    DEBUG3_VALUELN("Pin mode INPUT_PULLUP on pin: ", GROUP2_PINS[CONTINUOUS_BREW_OPTION_INDEX]);
+    pinMode(group1Pins[CONTINUOUS_BREW_OPTION_INDEX], INPUT_PULLUP);
+    DEBUG3_VALUELN(F("Pin mode INPUT_PULLUP on pin: "), group1Pins[CONTINUOUS_BREW_OPTION_INDEX]);
+    pinMode(group2Pins[CONTINUOUS_BREW_OPTION_INDEX], INPUT_PULLUP);
+    DEBUG3_VALUELN(F("Pin mode INPUT_PULLUP on pin: "), group2Pins[CONTINUOUS_BREW_OPTION_INDEX]);
 
-    DEBUG2_PRINTLN("End blinking leds");
+    DEBUG2_PRINTLN(F("End blinking leds"));
 
 }
 
@@ -155,57 +218,97 @@ void setup()
     // Pin 13 connected to ground
     pinMode(13, INPUT);
 
+    PERF_PROBES_SETUP();
+
 	// Initialize a serial connection for reporting values to the host
-    #if DEBUG_LEVEL > DEBUG_NONE
+    #if DEBUG_LEVEL > DEBUG_NONE || SERIAL_CONSOLE
         Serial.begin(9600);
         while (!Serial);
+    #elif BUS_NODE
+        Serial.begin(BUS_BAUD);
+        while (!Serial);
     #endif
 
 
-    DEBUG1_VALUELN("FLOWMETER_GROUP1_PIN: ", FLOWMETER_GROUP1_PIN);
-    DEBUG1_VALUELN("FLOWMETER_GROUP2_PIN: ", FLOWMETER_GROUP2_PIN);
-    DEBUG1_VALUELN("GROUP1_OPTION1_PIN: ", GROUP1_OPTION1_PIN);
-    DEBUG1_VALUELN("GROUP1_OPTION2_PIN: ", GROUP1_OPTION2_PIN);
-    DEBUG1_VALUELN("GROUP1_OPTION3_PIN: ", GROUP1_OPTION3_PIN);
-    DEBUG1_VALUELN("GROUP1_OPTION4_PIN: ", GROUP1_OPTION4_PIN);
-    DEBUG1_VALUELN("GROUP1_OPTION5_PIN: ", GROUP1_OPTION5_PIN);
-    DEBUG1_VALUELN("WATER_LEVEL_PIN: ", WATER_LEVEL_PIN);
-    DEBUG1_VALUELN("GROUP2_OPTION1_PIN: ", GROUP2_OPTION1_PIN);
-    DEBUG1_VALUELN("GROUP2_OPTION2_PIN: ", GROUP2_OPTION2_PIN);
-    DEBUG1_VALUELN("GROUP2_OPTION3_PIN: ", GROUP2_OPTION3_PIN);
-    DEBUG1_VALUELN("GROUP2_OPTION4_PIN: ", GROUP2_OPTION4_PIN);
-    DEBUG1_VALUELN("GROUP2_OPTION5_PIN: ", GROUP2_OPTION5_PIN);
-    DEBUG1_VALUELN("SOLENOID_GROUP1_PIN: ", SOLENOID_GROUP1_PIN);
-    DEBUG1_VALUELN("SOLENOID_GROUP2_PIN: ", SOLENOID_GROUP2_PIN);
-    DEBUG1_VALUELN("SOLENOID_BOILER_PIN: ", SOLENOID_BOILER_PIN);
-    DEBUG1_VALUELN("PUMP_PIN: ", PUMP_PIN);
+    DEBUG1_VALUELN(F("FLOWMETER_GROUP1_PIN: "), FLOWMETER_GROUP1_PIN);
+    DEBUG1_VALUELN(F("FLOWMETER_GROUP2_PIN: "), FLOWMETER_GROUP2_PIN);
+    DEBUG1_VALUELN(F("GROUP1_OPTION1_PIN: "), GROUP1_OPTION1_PIN);
+    DEBUG1_VALUELN(F("GROUP1_OPTION2_PIN: "), GROUP1_OPTION2_PIN);
+    DEBUG1_VALUELN(F("GROUP1_OPTION3_PIN: "), GROUP1_OPTION3_PIN);
+    DEBUG1_VALUELN(F("GROUP1_OPTION4_PIN: "), GROUP1_OPTION4_PIN);
+    DEBUG1_VALUELN(F("GROUP1_OPTION5_PIN: "), GROUP1_OPTION5_PIN);
+    DEBUG1_VALUELN(F("WATER_LEVEL_PIN: "), WATER_LEVEL_PIN);
+    DEBUG1_VALUELN(F("GROUP2_OPTION1_PIN: "), GROUP2_OPTION1_PIN);
+    DEBUG1_VALUELN(F("GROUP2_OPTION2_PIN: "), GROUP2_OPTION2_PIN);
+    DEBUG1_VALUELN(F("GROUP2_OPTION3_PIN: "), GROUP2_OPTION3_PIN);
+    DEBUG1_VALUELN(F("GROUP2_OPTION4_PIN: "), GROUP2_OPTION4_PIN);
+    DEBUG1_VALUELN(F("GROUP2_OPTION5_PIN: "), GROUP2_OPTION5_PIN);
+    DEBUG1_VALUELN(F("SOLENOID_GROUP1_PIN: "), SOLENOID_GROUP1_PIN);
+    DEBUG1_VALUELN(F("SOLENOID_GROUP2_PIN: "), SOLENOID_GROUP2_PIN);
+    DEBUG1_VALUELN(F("SOLENOID_BOILER_PIN: "), SOLENOID_BOILER_PIN);
+    DEBUG1_VALUELN(F("PUMP_PIN: "), PUMP_PIN);
 
     visualInit();
 
-    DEBUG2_PRINTLN("");
-    DEBUG2_PRINTLN("");
-    DEBUG2_PRINTLN("");
-    DEBUG2_PRINTLN(".");
-    DEBUG2_PRINTLN("Initializing coffee machine module v1.0");
+    DEBUG2_PRINTLN(F(""));
+    DEBUG2_PRINTLN(F(""));
+    DEBUG2_PRINTLN(F(""));
+    DEBUG2_PRINTLN(F("."));
+    DEBUG2_PRINTLN(F("Initializing coffee machine module v1.0"));
 
     cli();
 
     attachInterrupt(digitalPinToInterrupt(FLOWMETER_GROUP1_PIN), meterISRGroup1, RISING);
     attachInterrupt(digitalPinToInterrupt(FLOWMETER_GROUP2_PIN), meterISRGroup2, RISING);
 
-    BrewGroup* groups = new BrewGroup[BREW_GROUPS_LEN] {
-        BrewGroup(1, GROUP1_PINS, &flowMeterGroup1, SOLENOID_GROUP1_PIN),
-    	BrewGroup(2, GROUP2_PINS, &flowMeterGroup2, SOLENOID_GROUP2_PIN)
-    };
+    #if LOAD_CELL
+        brewGroups[LOAD_CELL_GROUP-1].setLoadCell(&loadCell);
+    #endif
+
+    expressoMachine.setup();
 
-    expressoMachine = new ExpressoMachine(groups, BREW_GROUPS_LEN, PUMP_PIN, SOLENOID_BOILER_PIN, WATER_LEVEL_PIN);
-    expressoMachine->setup();
+    #if STATUS_DISPLAY
+        statusDisplay.setup();
+    #endif
+
+    #if BUS_NODE
+        expressoMachine.setShotLog(&shotLog);
+        busNode.setup();
+    #endif
 
     sei();
-    DEBUG2_PRINTLN("Initialization complete.");
+    DEBUG2_PRINTLN(F("Initialization complete."));
+    DEBUG2_VALUELN(F("Free SRAM (bytes): "), getFreeMemory());
 }
 
 void loop()
 {
-    expressoMachine->loop();
+    PERF_LOOP_TOGGLE();
+
+    #if LOAD_CELL
+        loadCell.loop();
+    #endif
+
+    expressoMachine.loop();
+
+    #if SERIAL_CONSOLE
+        serialConsole.loop();
+    #endif
+
+    #if STATUS_DISPLAY
+        statusDisplay.loop();
+    #endif
+
+    #if BUS_NODE
+        busNode.loop();
+    #endif
+
+    #if DEBUG_LEVEL >= DEBUG_LEVEL_LOW
+        static unsigned long lastMemoryReportMillis = 0;
+        if (millis() - lastMemoryReportMillis >= MEMORY_REPORT_INTERVAL) {
+            lastMemoryReportMillis = millis();
+            DEBUG2_VALUE(F("Free SRAM (bytes): "), getFreeMemory());
+            DEBUG2_VALUELN(F(". Low-water mark: "), getMemoryLowWaterMark());
+        }
+    #endif
 }
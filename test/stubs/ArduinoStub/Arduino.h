@@ -0,0 +1,102 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef ARDUINO_STUB_H_INCLUDED
+#define ARDUINO_STUB_H_INCLUDED
+
+/**
+ * Host stand-in for the Arduino core, only what lib/ExpressoCoffee uses. Pins, clock, EEPROM
+ * and serial port are simulated in memory and driven by the tests through ArduinoStub.h.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+#define NUM_DIGITAL_PINS 20
+#define NOT_A_PIN 0
+
+#define DEC 10
+#define HEX 16
+
+#define _BV(bit) (1 << (bit))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : -1))
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode);
+
+// every pin gets a port of its own, bit 0, so direct port writes show up in digitalRead()
+uint8_t digitalPinToPort(uint8_t pin);
+uint8_t digitalPinToBitMask(uint8_t pin);
+volatile uint8_t* portOutputRegister(uint8_t port);
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper*>(PSTR(string_literal)))
+
+class HardwareSerial {
+public:
+    void begin(unsigned long baud);
+    void end() {};
+    operator bool() { return true; };
+    int available();
+    int peek();
+    int read();
+    int availableForWrite();
+    void flush() {};
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buffer, size_t size);
+
+    size_t print(const __FlashStringHelper* s);
+    size_t print(const char* s);
+    size_t print(char c);
+    size_t print(unsigned char n, int base = DEC);
+    size_t print(int n, int base = DEC);
+    size_t print(unsigned int n, int base = DEC);
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+
+    template <class T> size_t println(T value) { size_t n = print(value); return n + println(); };
+    template <class T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); };
+    size_t println() { return print("\r\n"); };
+};
+
+extern HardwareSerial Serial;
+
+#endif
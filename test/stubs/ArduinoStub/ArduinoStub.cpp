@@ -0,0 +1,329 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include "ArduinoStub.h"
+#include <JC_Button.h>
+#include <stdio.h>
+
+volatile uint8_t SREG;
+volatile uint8_t OCR0A;
+volatile uint8_t TIMSK0;
+volatile uint8_t UCSR0A;
+volatile uint8_t DDRD;
+volatile uint8_t PORTD;
+volatile uint8_t PIND;
+
+HardwareSerial Serial;
+
+static unsigned long s_millis = 0;
+static unsigned long s_micros = 0;
+static uint16_t s_microsRemainder = 0;
+
+static volatile uint8_t s_outputArray[NUM_DIGITAL_PINS];            //!< one port per pin, bit 0
+static uint8_t s_inputArray[NUM_DIGITAL_PINS];
+static uint8_t s_modeArray[NUM_DIGITAL_PINS];
+static void (*s_interruptArray[2])(void);
+static void (*s_outputHook)(uint8_t pin, uint8_t level) = NULL;
+
+static uint8_t s_eeprom[EEPROM_STUB_LEN];
+static uint16_t s_eepromWrites = 0;
+static bool s_eepromFailing = false;
+
+static std::string s_serialInput;
+static std::string s_serialOutput;
+
+void stubReset() {
+    for (uint8_t pin = 0; pin < NUM_DIGITAL_PINS; pin++) {
+        s_outputArray[pin] = LOW;
+        s_inputArray[pin] = HIGH;
+        s_modeArray[pin] = INPUT;
+    }
+    s_interruptArray[0] = NULL;
+    s_interruptArray[1] = NULL;
+    s_outputHook = NULL;
+    memset(s_eeprom, 0xFF, sizeof(s_eeprom));
+    s_eepromWrites = 0;
+    s_eepromFailing = false;
+    s_serialInput.clear();
+    s_serialOutput.clear();
+    SREG = OCR0A = TIMSK0 = UCSR0A = DDRD = PORTD = PIND = 0;
+}
+
+void stubSetMillis(unsigned long ms) {
+    s_millis = ms;
+}
+
+void stubAdvanceMicros(unsigned long us) {
+    s_micros += us;
+    s_millis += (s_microsRemainder + us) / 1000;
+    s_microsRemainder = (s_microsRemainder + us) % 1000;
+}
+
+void stubSetInput(uint8_t pin, uint8_t level) {
+    if (pin < NUM_DIGITAL_PINS) {
+        s_inputArray[pin] = level;
+    }
+}
+
+uint8_t stubGetOutput(uint8_t pin) {
+    return pin < NUM_DIGITAL_PINS ? s_outputArray[pin] & 1 : LOW;
+}
+
+uint8_t stubGetPinMode(uint8_t pin) {
+    return pin < NUM_DIGITAL_PINS ? s_modeArray[pin] : INPUT;
+}
+
+bool stubFireInterrupt(uint8_t interruptNum) {
+    if (interruptNum > 1 || s_interruptArray[interruptNum] == NULL) {
+        return false;
+    }
+    s_interruptArray[interruptNum]();
+    return true;
+}
+
+void stubSetOutputHook(void (*hook)(uint8_t pin, uint8_t level)) {
+    s_outputHook = hook;
+}
+
+uint16_t stubEepromWriteCount() {
+    return s_eepromWrites;
+}
+
+void stubSetEepromFailing(bool failing) {
+    s_eepromFailing = failing;
+}
+
+const uint8_t* stubEepromData() {
+    return s_eeprom;
+}
+
+void stubSerialInput(const char* text) {
+    s_serialInput += text;
+}
+
+std::string& stubSerialOutput() {
+    return s_serialOutput;
+}
+
+/*----------------------------------------------------------------------*
+/ Arduino core                                                          *
+/-----------------------------------------------------------------------*/
+unsigned long millis() {
+    return s_millis;
+}
+
+unsigned long micros() {
+    return s_micros;
+}
+
+void delay(unsigned long ms) {
+    stubAdvanceMicros(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    stubAdvanceMicros(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if (pin >= NUM_DIGITAL_PINS) {
+        return;
+    }
+    s_modeArray[pin] = mode;
+    if (mode != OUTPUT) {
+        s_outputArray[pin] = mode == INPUT_PULLUP ? HIGH : LOW;     //!< PORTx bit is the pull-up enable
+    }
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+    if (pin < NUM_DIGITAL_PINS) {
+        s_outputArray[pin] = val ? HIGH : LOW;
+        if (s_outputHook != NULL) {
+            s_outputHook(pin, s_outputArray[pin]);
+        }
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    if (pin >= NUM_DIGITAL_PINS) {
+        return LOW;
+    }
+    return s_modeArray[pin] == OUTPUT ? s_outputArray[pin] & 1 : s_inputArray[pin];
+}
+
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode) {
+    if (interruptNum <= 1) {
+        s_interruptArray[interruptNum] = userFunc;
+    }
+}
+
+uint8_t digitalPinToPort(uint8_t pin) {
+    return pin < NUM_DIGITAL_PINS ? pin + 1 : NOT_A_PIN;
+}
+
+uint8_t digitalPinToBitMask(uint8_t pin) {
+    return 1;
+}
+
+volatile uint8_t* portOutputRegister(uint8_t port) {
+    return &s_outputArray[port - 1];
+}
+
+/*----------------------------------------------------------------------*
+/ JC_Button 2.1.0                                                       *
+/-----------------------------------------------------------------------*/
+void Button::begin() {
+    pinMode(m_pin, m_puEnable ? INPUT_PULLUP : INPUT);
+    m_state = digitalRead(m_pin);
+    if (m_invert) {
+        m_state = !m_state;
+    }
+    m_time = millis();
+    m_lastState = m_state;
+    m_changed = false;
+    m_lastChange = m_time;
+}
+
+bool Button::read() {
+    uint32_t ms = millis();
+    bool pinVal = digitalRead(m_pin);
+    if (m_invert) {
+        pinVal = !pinVal;
+    }
+    if (ms - m_lastChange < m_dbTime) {
+        m_changed = false;
+    } else {
+        m_lastState = m_state;
+        m_state = pinVal;
+        m_changed = (m_state != m_lastState);
+        if (m_changed) {
+            m_lastChange = ms;
+        }
+    }
+    m_time = ms;
+    return m_state;
+}
+
+/*----------------------------------------------------------------------*
+/ EEPromUtils: record followed by its checksum                          *
+/-----------------------------------------------------------------------*/
+static uint16_t checksum(const uint8_t* data, size_t len) {
+    uint16_t sum = 0x5A5A;
+    for (size_t i = 0; i < len; i++) {
+        sum = (sum << 1 | sum >> 15) ^ data[i];
+    }
+    return sum;
+}
+
+bool EEPROM_init() {
+    return true;
+}
+
+int8_t EEPROM_safe_read(int location, uint8_t* data, size_t len) {
+    if (location < 0 || location + EEPROM_SIZE(len) > (size_t) EEPROM_STUB_LEN) {
+        return -2;
+    }
+    uint16_t stored = s_eeprom[location + len] | (s_eeprom[location + len + 1] << 8);
+    if (stored != checksum(&s_eeprom[location], len)) {
+        return -1;
+    }
+    memcpy(data, &s_eeprom[location], len);
+    return len;
+}
+
+int8_t EEPROM_safe_write(int location, uint8_t* data, size_t len) {
+    if (location < 0 || location + EEPROM_SIZE(len) > (size_t) EEPROM_STUB_LEN) {
+        return -2;
+    }
+    if (s_eepromFailing) {
+        return -1;
+    }
+    s_eepromWrites++;
+    uint16_t sum = checksum(data, len);
+    memcpy(&s_eeprom[location], data, len);
+    s_eeprom[location + len] = sum & 0xFF;
+    s_eeprom[location + len + 1] = sum >> 8;
+    return len;
+}
+
+/*----------------------------------------------------------------------*
+/ serial port                                                           *
+/-----------------------------------------------------------------------*/
+void HardwareSerial::begin(unsigned long baud) {
+}
+
+int HardwareSerial::available() {
+    return s_serialInput.size();
+}
+
+int HardwareSerial::peek() {
+    return s_serialInput.empty() ? -1 : (uint8_t) s_serialInput[0];
+}
+
+int HardwareSerial::read() {
+    if (s_serialInput.empty()) {
+        return -1;
+    }
+    uint8_t c = s_serialInput[0];
+    s_serialInput.erase(0, 1);
+    return c;
+}
+
+int HardwareSerial::availableForWrite() {
+    return 63;                                                      //!< TX buffer never fills, written bytes are kept in the output
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+    s_serialOutput += (char) c;
+    return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+    s_serialOutput.append((const char*) buffer, size);
+    return size;
+}
+
+size_t HardwareSerial::print(const __FlashStringHelper* s) {
+    return print(reinterpret_cast<const char*>(s));
+}
+
+size_t HardwareSerial::print(const char* s) {
+    s_serialOutput += s;
+    return strlen(s);
+}
+
+size_t HardwareSerial::print(char c) {
+    return write((uint8_t) c);
+}
+
+size_t HardwareSerial::print(unsigned char n, int base) {
+    return print((unsigned long) n, base);
+}
+
+size_t HardwareSerial::print(int n, int base) {
+    return print((long) n, base);
+}
+
+size_t HardwareSerial::print(unsigned int n, int base) {
+    return print((unsigned long) n, base);
+}
+
+size_t HardwareSerial::print(long n, int base) {
+    if (base == DEC && n < 0) {
+        return print('-') + print((unsigned long) -n, base);
+    }
+    return print((unsigned long) n, base);
+}
+
+size_t HardwareSerial::print(unsigned long n, int base) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), base == HEX ? "%lX" : "%lu", n);
+    return print(buffer);
+}
+
+size_t HardwareSerial::print(double n, int digits) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.*f", digits, n);
+    return print(buffer);
+}
@@ -0,0 +1,36 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef ARDUINO_STUB_CONTROL_H_INCLUDED
+#define ARDUINO_STUB_CONTROL_H_INCLUDED
+
+/**
+ * Test side of the Arduino stubs: move the clock, drive input pins, read outputs, run the
+ * flowmeter interrupts and look into EEPROM and serial port. Nothing here runs by itself, the
+ * clock only moves when a test (or delay()) moves it.
+ */
+#include <Arduino.h>
+#include <EEPromUtils.h>
+#include <string>
+
+void stubReset();                                                   //!< pins, EEPROM, serial port and registers back to power-on, clock keeps running
+
+void stubSetMillis(unsigned long ms);                               //!< e.g. close to the wrap of millis()
+void stubAdvanceMicros(unsigned long us);
+
+void stubSetInput(uint8_t pin, uint8_t level);                      //!< level seen by digitalRead() while the pin is an input, HIGH by default (pull-up)
+uint8_t stubGetOutput(uint8_t pin);                                 //!< level written to the pin, digitalWrite() or direct port write
+uint8_t stubGetPinMode(uint8_t pin);
+bool stubFireInterrupt(uint8_t interruptNum);                       //!< run the handler attached to INT0/INT1, false if none
+void stubSetOutputHook(void (*hook)(uint8_t pin, uint8_t level));   //!< called on every digitalWrite(), for devices clocked by a pin
+
+uint16_t stubEepromWriteCount();                                    //!< EEPROM_safe_write() calls that reached the EEPROM
+void stubSetEepromFailing(bool failing);                            //!< EEPROM_safe_write() fails until reset
+const uint8_t* stubEepromData();
+
+void stubSerialInput(const char* text);
+std::string& stubSerialOutput();
+
+#endif
@@ -0,0 +1,93 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef DEBUG_STUB_H_INCLUDED
+#define DEBUG_STUB_H_INCLUDED
+
+// same levels and macros as the Debug.h of the firmware, output goes to the simulated serial port
+#include <Arduino.h>
+
+#define DEBUG_NONE 0
+#define DEBUG_ERROR 1
+#define DEBUG_LEVEL_LOW 2
+#define DEBUG_MID 3
+#define DEBUG_HIGH 4
+#define DEBUG_FULL 5
+
+#ifndef DEBUG_LEVEL
+#define DEBUG_LEVEL DEBUG_NONE
+#endif
+
+#if DEBUG_LEVEL >= 1
+#define DEBUG1_PRINT(s) Serial.print(s);
+#define DEBUG1_PRINTLN(s) Serial.println(s);
+#define DEBUG1_VALUE(s, v) Serial.print(s); Serial.print(v);
+#define DEBUG1_VALUELN(s, v) Serial.print(s); Serial.println(v);
+#define DEBUG1_HEXVAL(s, v) Serial.print(s); Serial.print(v, HEX);
+#else
+#define DEBUG1_PRINT(s)
+#define DEBUG1_PRINTLN(s)
+#define DEBUG1_VALUE(s, v)
+#define DEBUG1_VALUELN(s, v)
+#define DEBUG1_HEXVAL(s, v)
+#endif
+
+#if DEBUG_LEVEL >= 2
+#define DEBUG2_PRINT(s) Serial.print(s);
+#define DEBUG2_PRINTLN(s) Serial.println(s);
+#define DEBUG2_VALUE(s, v) Serial.print(s); Serial.print(v);
+#define DEBUG2_VALUELN(s, v) Serial.print(s); Serial.println(v);
+#define DEBUG2_HEXVAL(s, v) Serial.print(s); Serial.print(v, HEX);
+#else
+#define DEBUG2_PRINT(s)
+#define DEBUG2_PRINTLN(s)
+#define DEBUG2_VALUE(s, v)
+#define DEBUG2_VALUELN(s, v)
+#define DEBUG2_HEXVAL(s, v)
+#endif
+
+#if DEBUG_LEVEL >= 3
+#define DEBUG3_PRINT(s) Serial.print(s);
+#define DEBUG3_PRINTLN(s) Serial.println(s);
+#define DEBUG3_VALUE(s, v) Serial.print(s); Serial.print(v);
+#define DEBUG3_VALUELN(s, v) Serial.print(s); Serial.println(v);
+#define DEBUG3_HEXVAL(s, v) Serial.print(s); Serial.print(v, HEX);
+#else
+#define DEBUG3_PRINT(s)
+#define DEBUG3_PRINTLN(s)
+#define DEBUG3_VALUE(s, v)
+#define DEBUG3_VALUELN(s, v)
+#define DEBUG3_HEXVAL(s, v)
+#endif
+
+#if DEBUG_LEVEL >= 4
+#define DEBUG4_PRINT(s) Serial.print(s);
+#define DEBUG4_PRINTLN(s) Serial.println(s);
+#define DEBUG4_VALUE(s, v) Serial.print(s); Serial.print(v);
+#define DEBUG4_VALUELN(s, v) Serial.print(s); Serial.println(v);
+#define DEBUG4_HEXVAL(s, v) Serial.print(s); Serial.print(v, HEX);
+#else
+#define DEBUG4_PRINT(s)
+#define DEBUG4_PRINTLN(s)
+#define DEBUG4_VALUE(s, v)
+#define DEBUG4_VALUELN(s, v)
+#define DEBUG4_HEXVAL(s, v)
+#endif
+
+#if DEBUG_LEVEL >= 5
+#define DEBUG5_PRINT(s) Serial.print(s);
+#define DEBUG5_PRINTLN(s) Serial.println(s);
+#define DEBUG5_VALUE(s, v) Serial.print(s); Serial.print(v);
+#define DEBUG5_VALUELN(s, v) Serial.print(s); Serial.println(v);
+#define DEBUG5_HEXVAL(s, v) Serial.print(s); Serial.print(v, HEX);
+#else
+#define DEBUG5_PRINT(s)
+#define DEBUG5_PRINTLN(s)
+#define DEBUG5_VALUE(s, v)
+#define DEBUG5_VALUELN(s, v)
+#define DEBUG5_HEXVAL(s, v)
+#endif
+
+#endif
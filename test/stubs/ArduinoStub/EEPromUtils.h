@@ -0,0 +1,23 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef EEPROM_UTILS_STUB_H_INCLUDED
+#define EEPROM_UTILS_STUB_H_INCLUDED
+
+/**
+ * In-memory EEPROM with the EEPromUtils interface: each record is followed by a 16-bit
+ * checksum, so reading an erased (0xFF) or torn record fails like on the device.
+ */
+#include <Arduino.h>
+
+const int EEPROM_STUB_LEN = 1024;                                   //!< ATmega328P EEPROM size
+
+#define EEPROM_SIZE(len) ((len) + 2)
+
+bool EEPROM_init();
+int8_t EEPROM_safe_read(int location, uint8_t* data, size_t len);
+int8_t EEPROM_safe_write(int location, uint8_t* data, size_t len);
+
+#endif
@@ -0,0 +1,38 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef JC_BUTTON_STUB_H_INCLUDED
+#define JC_BUTTON_STUB_H_INCLUDED
+
+// debounce of JC_Button 2.1.0, reading the simulated pins
+#include <Arduino.h>
+
+class Button {
+public:
+    Button(uint8_t pin, uint32_t dbTime = 25, uint8_t puEnable = true, uint8_t invert = true)
+        : m_pin(pin), m_dbTime(dbTime), m_puEnable(puEnable), m_invert(invert) {};
+    void begin();
+    bool read();
+    bool isPressed() { return m_state; };
+    bool isReleased() { return !m_state; };
+    bool wasPressed() { return m_state && m_changed; };
+    bool wasReleased() { return !m_state && m_changed; };
+    bool pressedFor(uint32_t ms) { return m_state && m_time - m_lastChange >= ms; };
+    bool releasedFor(uint32_t ms) { return !m_state && m_time - m_lastChange >= ms; };
+    uint32_t lastChange() { return m_lastChange; };
+
+private:
+    uint8_t m_pin;
+    uint32_t m_dbTime;
+    bool m_puEnable;
+    bool m_invert;
+    bool m_state = false;
+    bool m_lastState = false;
+    bool m_changed = false;
+    uint32_t m_time = 0;
+    uint32_t m_lastChange = 0;
+};
+
+#endif
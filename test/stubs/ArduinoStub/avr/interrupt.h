@@ -0,0 +1,14 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef AVR_INTERRUPT_STUB_H_INCLUDED
+#define AVR_INTERRUPT_STUB_H_INCLUDED
+
+// interrupts are run by the tests between loop calls, never concurrently
+#define ISR(vector) extern "C" void vector(void)
+#define cli()
+#define sei()
+
+#endif
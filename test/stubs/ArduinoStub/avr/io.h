@@ -0,0 +1,31 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef AVR_IO_STUB_H_INCLUDED
+#define AVR_IO_STUB_H_INCLUDED
+
+// ATmega328P registers used by the library, plain memory the tests can read and write
+#include <stdint.h>
+
+extern volatile uint8_t SREG;
+extern volatile uint8_t OCR0A;
+extern volatile uint8_t TIMSK0;
+extern volatile uint8_t UCSR0A;
+extern volatile uint8_t DDRD;
+extern volatile uint8_t PORTD;
+extern volatile uint8_t PIND;
+
+#define OCIE0A 1
+#define UDRE0 5
+#define TXC0 6
+
+#define DDD6 6
+#define DDD7 7
+#define PORTD6 6
+#define PORTD7 7
+#define PIND6 6
+#define PIND7 7
+
+#endif
@@ -0,0 +1,13 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef UTIL_ATOMIC_STUB_H_INCLUDED
+#define UTIL_ATOMIC_STUB_H_INCLUDED
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 0
+#define ATOMIC_BLOCK(type) for (int _atomicDone = 0; !_atomicDone; _atomicDone = 1)
+
+#endif
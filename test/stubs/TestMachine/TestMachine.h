@@ -0,0 +1,100 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef TEST_MACHINE_H_INCLUDED
+#define TEST_MACHINE_H_INCLUDED
+
+#include <ArduinoStub.h>
+#include <ExpressoCoffee.h>
+#include <UsageCounters.h>
+
+// same wiring as src/gelcoffee.cpp
+const int8_t TEST_GROUP1_PINS[BREW_OPTIONS_LEN] PROGMEM { A0, 5, 1, 0, 4 };
+const int8_t TEST_GROUP2_PINS[BREW_OPTIONS_LEN] PROGMEM { A5, A4, A3, A2, A1 };
+const uint8_t TEST_SOLENOID_PINS[BREW_GROUPS_LEN] = { 11, 12 };
+const uint8_t TEST_SOLENOID_BOILER_PIN = 10;
+const uint8_t TEST_PUMP_PIN = 9;
+const uint8_t TEST_WATER_LEVEL_PIN = 8;
+
+const unsigned long TEST_LOOP_MICROS = 1000;                        //!< simulated time of one machine loop
+
+/**
+ * TestMachine
+ *
+ * The machine of src/gelcoffee.cpp on the Arduino stubs. Time only moves in loop(), which also
+ * runs the safety supervisor tick the Timer0 interrupt would run, every 1.024 ms.
+ * Buttons are pressed and flowmeter pulses counted the way the hardware would, through pins
+ * and increment().
+ */
+class TestMachine {
+public:
+    TestMachine()
+        : groupArray { BrewGroup(1, TEST_GROUP1_PINS, &flowMeterArray[0], TEST_SOLENOID_PINS[0]),
+                       BrewGroup(2, TEST_GROUP2_PINS, &flowMeterArray[1], TEST_SOLENOID_PINS[1]) },
+          machine(groupArray, BREW_GROUPS_LEN, TEST_PUMP_PIN, TEST_SOLENOID_BOILER_PIN, TEST_WATER_LEVEL_PIN, &safetySupervisor, &usageCounters)
+    {};
+
+    SimpleFlowMeter flowMeterArray[BREW_GROUPS_LEN];
+    BrewGroup groupArray[BREW_GROUPS_LEN];
+    SafetySupervisor safetySupervisor;
+    UsageCounters usageCounters;
+    ExpressoMachine machine;
+
+    void setup() {
+        stubReset();
+        stubSetInput(TEST_WATER_LEVEL_PIN, LOW);                    //!< boiler full
+        uint8_t outputs[] = { TEST_PUMP_PIN, TEST_SOLENOID_BOILER_PIN, TEST_SOLENOID_PINS[0], TEST_SOLENOID_PINS[1] };
+        for (uint8_t i = 0; i < sizeof(outputs); i++) {
+            pinMode(outputs[i], OUTPUT);
+            digitalWrite(outputs[i], HIGH);
+        }
+        machine.setup();
+    };
+
+    void loop(unsigned long loopMicros = TEST_LOOP_MICROS) {
+        stubAdvanceMicros(loopMicros);
+        for (m_interruptMicros += loopMicros; m_interruptMicros >= SAFETY_INTERRUPT_MICROS; m_interruptMicros -= SAFETY_INTERRUPT_MICROS) {
+            safetySupervisor.tick();
+        }
+        machine.loop();
+    };
+
+    void run(unsigned long ms) {
+        for (unsigned long i = 0; i < ms * 1000 / TEST_LOOP_MICROS; i++) {
+            loop();
+        }
+    };
+
+    BrewGroup& group(int8_t groupNumber) { return groupArray[groupNumber-1]; };
+
+    uint8_t optionPin(int8_t groupNumber, int8_t optionIndex) {
+        return pgm_read_byte(&(groupNumber == 1 ? TEST_GROUP1_PINS : TEST_GROUP2_PINS)[optionIndex]);
+    };
+
+    //! press and release, the brew option reports the press on release
+    void press(int8_t groupNumber, int8_t optionIndex, unsigned long holdMillis = 100) {
+        stubSetInput(optionPin(groupNumber, optionIndex), LOW);
+        run(holdMillis);
+        stubSetInput(optionPin(groupNumber, optionIndex), HIGH);
+        run(50);
+    };
+
+    //! water flowing through the group: a flowmeter pulse every intervalMillis
+    void flow(int8_t groupNumber, long pulses, unsigned long intervalMillis) {
+        for (long i = 0; i < pulses; i++) {
+            run(intervalMillis);
+            flowMeterArray[groupNumber-1].increment();
+        }
+    };
+
+    bool isSolenoidOpen(int8_t groupNumber) { return stubGetOutput(TEST_SOLENOID_PINS[groupNumber-1]) == LOW; };
+    bool isPumpOn() { return stubGetOutput(TEST_PUMP_PIN) == LOW; };
+    bool isBoilerSolenoidOpen() { return stubGetOutput(TEST_SOLENOID_BOILER_PIN) == LOW; };
+
+private:
+    unsigned long m_interruptMicros = 0;                            //!< time since the last Timer0 interrupt
+};
+
+#endif
@@ -0,0 +1,72 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include <TestMachine.h>
+#include <EEPromUtils.h>
+#include <unity.h>
+
+//! dosage record of group 1, bank 0 is the first record in EEPROM
+static DosageRecord readGroup1Record() {
+    DosageRecord rec;
+    TEST_ASSERT_EQUAL(sizeof(rec), EEPROM_safe_read(0, (uint8_t*) &rec, sizeof(rec)));
+    return rec;
+}
+
+/*----------------------------------------------------------------------*
+/ a programmed dose the EEPROM refused stays pending and is written     *
+/ once the group is idle and the write budget has a token again         *
+/-----------------------------------------------------------------------*/
+void test_refused_dosage_save_is_retried() {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(1).getState());
+
+    stubSetEepromFailing(true);
+    m.press(1, 1);
+    m.flow(1, 45, 100);
+    uint16_t writes = stubEepromWriteCount();
+    m.press(1, 1);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(1).getState());
+    TEST_ASSERT_EQUAL(writes, stubEepromWriteCount());
+
+    // EEPROM back, nothing written before the retry time
+    stubSetEepromFailing(false);
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX);
+    m.run(EEPROM_WRITE_REFILL_MILLIS / 2);
+    TEST_ASSERT_EQUAL(writes, stubEepromWriteCount());
+
+    m.run(EEPROM_WRITE_REFILL_MILLIS / 2 + 10);
+    TEST_ASSERT_EQUAL(writes + 1, stubEepromWriteCount());
+    TEST_ASSERT_EQUAL(45, readGroup1Record().flowMeterPulseArray[1]);
+
+    // saved, not written again
+    m.run(EEPROM_WRITE_REFILL_MILLIS * 2);
+    TEST_ASSERT_EQUAL(writes + 1, stubEepromWriteCount());
+}
+
+void test_refused_name_is_reported() {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    stubSetEepromFailing(true);
+    TEST_ASSERT_FALSE(m.machine.setRecipeBankName(1, "RISTR"));
+    stubSetEepromFailing(false);
+    TEST_ASSERT_TRUE(m.machine.setRecipeBankName(1, "RISTR"));
+
+    char name[RECIPE_NAME_LEN];
+    m.machine.getRecipeBankName(1, name);
+    TEST_ASSERT_EQUAL_STRING("RISTR", name);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_refused_dosage_save_is_retried);
+    RUN_TEST(test_refused_name_is_reported);
+    return UNITY_END();
+}
@@ -0,0 +1,335 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include <TestMachine.h>
+#include <EEPromUtils.h>
+#include <unity.h>
+#include <stdio.h>
+
+static bool isBrewingState(GroupState state) {
+    return state == GROUP_BREWING || state == GROUP_PROGRAMMING_BREWING || state == GROUP_BREWING_PROGRAMMING_PENDING;
+}
+
+/*----------------------------------------------------------------------*
+/ reach a state from idle with the shortest sequence of events          *
+/-----------------------------------------------------------------------*/
+static void driveTo(BrewGroup& group, GroupState state) {
+    switch (state) {
+        case GROUP_BREWING:
+            group.dispatch(EVT_OPTION_PRESSED, 0);
+            break;
+        case GROUP_PROGRAMMING:
+            group.dispatch(EVT_PROGRAM_PRESSED, CONTINUOUS_BREW_OPTION_INDEX);
+            break;
+        case GROUP_PROGRAMMING_BREWING:
+            group.dispatch(EVT_PROGRAM_PRESSED, CONTINUOUS_BREW_OPTION_INDEX);
+            group.dispatch(EVT_OPTION_PRESSED, 0);
+            break;
+        case GROUP_BREWING_PROGRAMMING_PENDING:
+            group.dispatch(EVT_OPTION_PRESSED, 0);
+            group.dispatch(EVT_PROGRAM_PRESSED, CONTINUOUS_BREW_OPTION_INDEX);
+            break;
+        default:
+            break;
+    }
+}
+
+//! option index a button press would carry along with the event
+static int8_t eventOptionIndex(BrewGroup& group, GroupEvent event) {
+    switch (event) {
+        case EVT_OPTION_PRESSED:
+        case EVT_RECIPE_BANK_PRESSED:
+            return 1;
+        case EVT_CURRENT_OPTION_PRESSED:
+            return group.getBrewingOptionIndex() >= 0 ? group.getBrewingOptionIndex() : 0;
+        case EVT_CONTINUOUS_PRESSED:
+        case EVT_PROGRAM_PRESSED:
+            return CONTINUOUS_BREW_OPTION_INDEX;
+        default:
+            return -1;
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ whatever the transition table says, after any event a group brews     *
+/ exactly in the brewing states, with its solenoid open and the pump on *
+/-----------------------------------------------------------------------*/
+void test_invariants_on_every_state_event_pair() {
+    uint8_t covered = 0;
+
+    for (uint8_t state = 0; state < GROUP_STATES_LEN; state++) {
+        for (uint8_t event = 0; event < GROUP_EVENTS_LEN; event++) {
+            TestMachine m;
+            m.setup();
+            m.run(10);
+            BrewGroup& group = m.group(1);
+
+            driveTo(group, (GroupState) state);
+            TEST_ASSERT_EQUAL_MESSAGE(state, group.getState(), "state not reached");
+            m.run(10);
+
+            group.dispatch((GroupEvent) event, eventOptionIndex(group, (GroupEvent) event));
+            GroupState next = group.getState();
+
+            char message[48];
+            snprintf(message, sizeof(message), "state %u, event %u", state, event);
+            TEST_ASSERT_EQUAL_MESSAGE(isBrewingState(next), group.ptrCurrentBrewingOption != NULL, message);
+            TEST_ASSERT_EQUAL_MESSAGE(isBrewingState(next), m.isSolenoidOpen(1), message);
+            TEST_ASSERT_EQUAL_MESSAGE(isBrewingState(next), m.isPumpOn(), message);
+            TEST_ASSERT_FALSE_MESSAGE(m.isSolenoidOpen(2), message);
+
+            // ... and the machine loop agrees
+            m.run(10);
+            TEST_ASSERT_TRUE_MESSAGE(group.checkInvariants(), message);
+            TEST_ASSERT_TRUE_MESSAGE(m.group(2).checkInvariants(), message);
+            covered++;
+        }
+    }
+
+    TEST_ASSERT_EQUAL(GROUP_STATES_LEN * GROUP_EVENTS_LEN, covered);
+}
+
+//! dosage record of a group for bank 0, records of bank 0 are the first ones in EEPROM
+static DosageRecord readBank0Record(int8_t groupNumber) {
+    DosageRecord rec;
+    int location = EEPROM_SIZE( sizeof(DosageRecord) ) * (groupNumber - 1);
+    TEST_ASSERT_EQUAL(sizeof(rec), EEPROM_safe_read(location, (uint8_t*) &rec, sizeof(rec)));
+    return rec;
+}
+
+/*----------------------------------------------------------------------*
+/ from the barista's side: a press or a long press of the option that   *
+/ brews stops the shot, other dosed options do not, and a programming   *
+/ shot stops and saves its dose                                         *
+/-----------------------------------------------------------------------*/
+void test_current_option_stops_shot() {
+    const unsigned long HOLD_MILLIS[] = { 100, MILLIS_TO_SWITCH_RECIPE_BANK + 500 };
+    for (uint8_t i = 0; i < sizeof(HOLD_MILLIS) / sizeof(HOLD_MILLIS[0]); i++) {
+        char message[32];
+        snprintf(message, sizeof(message), "held for %lu ms", HOLD_MILLIS[i]);
+        TestMachine m;
+        m.setup();
+        m.run(1000);
+
+        m.press(1, 2);
+        TEST_ASSERT_EQUAL_MESSAGE(GROUP_BREWING, m.group(1).getState(), message);
+        m.flow(1, 10, 100);
+        m.press(1, 2, HOLD_MILLIS[i]);
+        TEST_ASSERT_EQUAL_MESSAGE(GROUP_IDLE, m.group(1).getState(), message);
+        TEST_ASSERT_FALSE_MESSAGE(m.isSolenoidOpen(1), message);
+        TEST_ASSERT_FALSE_MESSAGE(m.isPumpOn(), message);
+
+        m.run(600);
+        m.press(1, 2);
+        m.run(600);
+        m.press(1, 0, HOLD_MILLIS[i]);
+        TEST_ASSERT_EQUAL_MESSAGE(2, m.group(1).getBrewingOptionIndex(), message);
+        TEST_ASSERT_TRUE_MESSAGE(m.isSolenoidOpen(1), message);
+        m.press(1, CONTINUOUS_BREW_OPTION_INDEX, HOLD_MILLIS[i]);
+        TEST_ASSERT_EQUAL_MESSAGE(GROUP_IDLE, m.group(1).getState(), message);
+
+        // programming shot
+        m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+        m.press(1, 2);
+        TEST_ASSERT_EQUAL_MESSAGE(GROUP_PROGRAMMING_BREWING, m.group(1).getState(), message);
+        m.flow(1, 55, 200);
+        uint16_t writes = stubEepromWriteCount();
+        m.press(1, 2, HOLD_MILLIS[i]);
+        TEST_ASSERT_EQUAL_MESSAGE(GROUP_PROGRAMMING, m.group(1).getState(), message);
+        TEST_ASSERT_FALSE_MESSAGE(m.isSolenoidOpen(1), message);
+        TEST_ASSERT_EQUAL_MESSAGE(writes + 1, stubEepromWriteCount(), message);
+        TEST_ASSERT_EQUAL_MESSAGE(55, readBank0Record(1).flowMeterPulseArray[2], message);
+        TEST_ASSERT_GREATER_OR_EQUAL(11, readBank0Record(1).durationArray[2]);   //!< 55 pulses 200 ms apart
+        m.press(1, CONTINUOUS_BREW_OPTION_INDEX);
+        TEST_ASSERT_EQUAL_MESSAGE(GROUP_IDLE, m.group(1).getState(), message);
+
+        // shot started before entering programming mode
+        m.press(1, 1);
+        m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+        TEST_ASSERT_EQUAL_MESSAGE(GROUP_BREWING_PROGRAMMING_PENDING, m.group(1).getState(), message);
+        m.press(1, 1, HOLD_MILLIS[i]);
+        TEST_ASSERT_EQUAL_MESSAGE(GROUP_PROGRAMMING, m.group(1).getState(), message);
+        TEST_ASSERT_FALSE_MESSAGE(m.isSolenoidOpen(1), message);
+    }
+}
+
+void test_buttons_post_events() {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    m.press(2, 0);
+    TEST_ASSERT_EQUAL(GROUP_BREWING, m.group(2).getState());
+    TEST_ASSERT_EQUAL(0, m.group(2).getBrewingOptionIndex());
+    TEST_ASSERT_TRUE(m.isSolenoidOpen(2));
+
+    m.run(600);
+    m.press(2, 0);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(2).getState());
+    TEST_ASSERT_FALSE(m.isSolenoidOpen(2));
+    TEST_ASSERT_FALSE(m.isPumpOn());
+
+    m.press(2, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(2).getState());
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(1).getState());
+}
+
+/*----------------------------------------------------------------------*
+/ a long press selects a recipe bank only on an idle group: holding the *
+/ option that brews still stops the shot, and options past the banks   *
+/ keep their release                                                     *
+/-----------------------------------------------------------------------*/
+void test_long_press_stops_shot() {
+    const unsigned long HOLD_MILLIS = MILLIS_TO_SWITCH_RECIPE_BANK + 500;
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    m.press(1, 1, HOLD_MILLIS);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(1).getState());
+    TEST_ASSERT_EQUAL(1, m.group(1).getRecipeBank());
+
+    m.run(600);
+    m.press(1, 0);
+    BrewOption* option = m.group(1).ptrCurrentBrewingOption;
+    TEST_ASSERT_EQUAL(GROUP_BREWING, m.group(1).getState());
+    m.run(600);
+    m.press(1, 0, HOLD_MILLIS);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(1).getState());
+    TEST_ASSERT_EQUAL(STOP_BY_USER, option->getStopReason());
+    TEST_ASSERT_FALSE(m.isSolenoidOpen(1));
+    TEST_ASSERT_FALSE(m.isPumpOn());
+    TEST_ASSERT_EQUAL(1, m.group(1).getRecipeBank());
+
+    // no bank 4: a long press of option 4 is a press
+    m.run(600);
+    m.press(1, RECIPE_BANKS_LEN, HOLD_MILLIS);
+    TEST_ASSERT_EQUAL(GROUP_BREWING, m.group(1).getState());
+    TEST_ASSERT_EQUAL(RECIPE_BANKS_LEN, m.group(1).getBrewingOptionIndex());
+    m.run(600);
+    m.press(1, RECIPE_BANKS_LEN, HOLD_MILLIS);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(1).getState());
+
+    // programming shot stopped by a long press records its dose
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(1).getState());
+    m.press(1, 0);
+    option = m.group(1).ptrCurrentBrewingOption;
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING_BREWING, m.group(1).getState());
+    m.flow(1, 50, 400);
+    m.press(1, 0, HOLD_MILLIS);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(1).getState());
+    TEST_ASSERT_TRUE(option->flagProgrammed);
+    TEST_ASSERT_EQUAL(50, option->doseFlowmeterCount);
+    TEST_ASSERT_FALSE(m.isSolenoidOpen(1));
+}
+
+//! led changes of an option over ms, the led is on while its pin is an output
+static uint16_t ledChanges(TestMachine& m, int8_t groupNumber, int8_t optionIndex, unsigned long ms) {
+    uint16_t changes = 0;
+    bool on = stubGetPinMode(m.optionPin(groupNumber, optionIndex)) == OUTPUT;
+    for (unsigned long i = 0; i < ms; i++) {
+        m.loop();
+        if ((stubGetPinMode(m.optionPin(groupNumber, optionIndex)) == OUTPUT) != on) {
+            on = !on;
+            changes++;
+        }
+    }
+    return changes;
+}
+
+//! programming shot of an option, stopped after pulses flowmeter pulses
+static void programOption(TestMachine& m, int8_t groupNumber, int8_t optionIndex, uint16_t pulses) {
+    m.press(groupNumber, optionIndex);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING_BREWING, m.group(groupNumber).getState());
+    m.flow(groupNumber, pulses, 250);
+    m.press(groupNumber, optionIndex);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(groupNumber).getState());
+    m.run(600);
+}
+
+/*----------------------------------------------------------------------*
+/ copying the dosage to a busy group, or with no option programmed yet, *
+/ is refused with a fast blink of the programmed group, a copy to an    *
+/ idle group lights its leds                                            *
+/-----------------------------------------------------------------------*/
+void test_copy_dosage_refused() {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(1).getState());
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_GREATER_OR_EQUAL(6, ledChanges(m, 1, 0, RECIPE_BANK_FEEDBACK_MILLIS - 200));
+    TEST_ASSERT_FALSE(stubGetPinMode(m.optionPin(2, 0)) == OUTPUT);
+    m.run(200);
+    programOption(m, 1, 0, 50);
+
+    m.press(2, 0);
+    TEST_ASSERT_EQUAL(GROUP_BREWING, m.group(2).getState());
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(1).getState());
+    TEST_ASSERT_GREATER_OR_EQUAL(6, ledChanges(m, 1, 0, RECIPE_BANK_FEEDBACK_MILLIS - 200));
+    m.run(200);
+    TEST_ASSERT_LESS_OR_EQUAL(2, ledChanges(m, 1, 0, 1000));   //!< back to the programming blink
+
+    // group 2 idle again, the copy goes through
+    m.press(2, 0);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(2).getState());
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_LESS_OR_EQUAL(2, ledChanges(m, 1, 0, 500));
+    TEST_ASSERT_EQUAL(OUTPUT, stubGetPinMode(m.optionPin(2, 0)));
+}
+
+/*----------------------------------------------------------------------*
+/ a copy takes only the options programmed in this session, the others *
+/ keep the dosage of the selected bank; a copy the EEPROM refused       *
+/ blinks fast and is saved once the write is retried                    *
+/-----------------------------------------------------------------------*/
+void test_copy_only_programmed() {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    m.press(2, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    programOption(m, 2, 0, 50);
+    m.press(2, CONTINUOUS_BREW_OPTION_INDEX);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(2).getState());
+
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    programOption(m, 1, 1, 70);
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(1).getState());
+    TEST_ASSERT_EQUAL(50, readBank0Record(2).flowMeterPulseArray[0]);
+    TEST_ASSERT_EQUAL(70, readBank0Record(2).flowMeterPulseArray[1]);
+    TEST_ASSERT_EQUAL(DosageRecord().flowMeterPulseArray[2], readBank0Record(2).flowMeterPulseArray[2]);
+    TEST_ASSERT_LESS_OR_EQUAL(2, ledChanges(m, 1, 0, 500));
+    m.run(RECIPE_BANK_FEEDBACK_MILLIS);
+
+    // EEPROM refuses the copy: pending, no confirmation on group 2
+    stubSetEepromFailing(true);
+    programOption(m, 1, 2, 80);
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_GREATER_OR_EQUAL(6, ledChanges(m, 1, 0, RECIPE_BANK_FEEDBACK_MILLIS - 200));
+    TEST_ASSERT_FALSE(stubGetPinMode(m.optionPin(2, 0)) == OUTPUT);
+    TEST_ASSERT_EQUAL(DosageRecord().flowMeterPulseArray[2], readBank0Record(2).flowMeterPulseArray[2]);
+
+    stubSetEepromFailing(false);
+    m.run(EEPROM_WRITE_REFILL_MILLIS + 10);
+    TEST_ASSERT_EQUAL(80, readBank0Record(2).flowMeterPulseArray[2]);
+    TEST_ASSERT_EQUAL(50, readBank0Record(2).flowMeterPulseArray[0]);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_invariants_on_every_state_event_pair);
+    RUN_TEST(test_current_option_stops_shot);
+    RUN_TEST(test_buttons_post_events);
+    RUN_TEST(test_long_press_stops_shot);
+    RUN_TEST(test_copy_dosage_refused);
+    RUN_TEST(test_copy_only_programmed);
+    return UNITY_END();
+}
@@ -0,0 +1,244 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include <TestMachine.h>
+#include <LoadCell.h>
+#include <unity.h>
+#include <stdio.h>
+
+#if !LOAD_CELL || SHOT_QUEUE_LEN == 0
+#error "build with -D LOAD_CELL=1 -D SHOT_QUEUE_LEN=1, see [env:native_load_cell]"
+#endif
+
+const int32_t SCALE_EMPTY_COUNTS = 84000;                           //!< HX711 reading with nothing on the scale
+const float SCALE_NOISE_GRAMS = 0.15;                               //!< peak noise of a reading
+const unsigned long SCALE_CONVERSION_MILLIS = 100;                  //!< HX711 at 10 samples per second
+const float CUP_GRAMS = 180;
+const float STREAM_TAU_SECONDS = 1.2;                               //!< coffee leaving the group reaches the cup with this time constant
+const float GRAMS_PER_PULSE = 0.5;                                  //!< flowmeter pulses while the solenoid is open
+const float AVR_DIGITAL_IO_MICROS = 4;                              //!< upper bound of digitalWrite() / digitalRead() on a 16 MHz Uno
+const uint16_t TARGET_WEIGHT = 360;                                 //!< 0.1 g
+
+/**
+ * MockScale
+ *
+ * HX711 and cup on the simulated pins: a conversion is ready every 100 ms (DOUT low), each SCK
+ * rising edge shifts out the next bit MSB first and the 25th pulls DOUT high again. The coffee
+ * flows into the cup at a constant rate while the group solenoid is open, through a first order
+ * lag, so some is still on its way when the solenoid closes.
+ */
+class MockScale {
+public:
+    MockScale(float gramsPerSecond) : m_gramsPerSecond(gramsPerSecond) { s_scale = this; };
+
+    float cupGrams = 0;                                             //!< cup and coffee on the scale
+    float streamGrams = 0;                                          //!< coffee between the group and the cup
+    unsigned long sckPulses = 0;
+    unsigned long maxSckPulsesPerCall = 0;
+
+    void setup() {
+        stubSetOutputHook(onOutput);
+        stubSetInput(LOAD_CELL_DOUT_PIN, HIGH);
+        m_nextConversionMs = millis() + SCALE_CONVERSION_MILLIS;
+    };
+
+    //! one millisecond of the world; flowmeter pulses go to the group of the scale
+    void step(TestMachine& m) {
+        bool open = m.isSolenoidOpen(LOAD_CELL_GROUP);
+        float flow = open ? m_gramsPerSecond / 1000 : 0;
+        float arriving = streamGrams / (STREAM_TAU_SECONDS * 1000);
+        streamGrams += flow - arriving;
+        cupGrams += arriving;
+        m_pulseGrams += flow;
+        if (m_pulseGrams >= GRAMS_PER_PULSE) {
+            m_pulseGrams -= GRAMS_PER_PULSE;
+            m.flowMeterArray[LOAD_CELL_GROUP - 1].increment();
+        }
+        if (millis() >= m_nextConversionMs) {
+            m_nextConversionMs += SCALE_CONVERSION_MILLIS;
+            if (m_bit == 0) {
+                m_sample = SCALE_EMPTY_COUNTS + (int32_t) ((cupGrams + noise()) * LOAD_CELL_COUNTS_PER_GRAM);
+                stubSetInput(LOAD_CELL_DOUT_PIN, LOW);
+            }
+        }
+    };
+
+    void loopLoadCell(LoadCell& loadCell) {
+        unsigned long pulses = sckPulses;
+        loadCell.loop();
+        maxSckPulsesPerCall = sckPulses - pulses > maxSckPulsesPerCall ? sckPulses - pulses : maxSckPulsesPerCall;
+    };
+
+private:
+    static MockScale* s_scale;
+    float m_gramsPerSecond;
+    float m_pulseGrams = 0;
+    unsigned long m_nextConversionMs = 0;
+    int32_t m_sample = 0;
+    uint8_t m_bit = 0;
+    uint32_t m_noiseState = 12345;
+
+    float noise() {
+        m_noiseState = m_noiseState * 1103515245 + 12345;
+        return ((int) ((m_noiseState >> 16) % 201) - 100) * SCALE_NOISE_GRAMS / 100;
+    };
+
+    static void onOutput(uint8_t pin, uint8_t level) {
+        if (pin == LOAD_CELL_SCK_PIN && level == HIGH) {
+            s_scale->onClock();
+        }
+    };
+
+    void onClock() {
+        sckPulses++;
+        if (m_bit < 24) {
+            stubSetInput(LOAD_CELL_DOUT_PIN, (m_sample >> (23 - m_bit)) & 1);
+            m_bit++;
+        } else {
+            stubSetInput(LOAD_CELL_DOUT_PIN, HIGH);                 //!< 25th pulse, channel A gain 128, busy until the next conversion
+            m_bit = 0;
+        }
+    };
+};
+
+MockScale* MockScale::s_scale = NULL;
+
+/**
+ * Bench
+ *
+ * Machine with the load cell on LOAD_CELL_GROUP, looped like src/gelcoffee.cpp.
+ */
+struct Bench {
+    TestMachine m;
+    LoadCell loadCell;
+    MockScale scale;
+    unsigned long loops = 0;
+
+    Bench(float gramsPerSecond) : loadCell(LOAD_CELL_SCK_PIN, LOAD_CELL_DOUT_PIN), scale(gramsPerSecond) {
+        m.group(LOAD_CELL_GROUP).setLoadCell(&loadCell);
+        m.setup();
+        scale.setup();
+    };
+
+    void run(unsigned long ms) {
+        for (unsigned long i = 0; i < ms; i++) {
+            scale.loopLoadCell(loadCell);
+            m.loop();
+            scale.step(m);
+            loops++;
+        }
+    };
+
+    void press(int8_t optionIndex) {
+        stubSetInput(m.optionPin(LOAD_CELL_GROUP, optionIndex), LOW);
+        run(100);
+        stubSetInput(m.optionPin(LOAD_CELL_GROUP, optionIndex), HIGH);
+        run(50);
+    };
+
+    //! shot on option 1 with the cup put down settleMillis before the press, returns coffee in the cup (0.1 g)
+    int16_t shot(unsigned long settleMillis, StopReason* stopReason) {
+        scale.cupGrams = CUP_GRAMS;
+        run(settleMillis);
+        press(1);
+        TEST_ASSERT_EQUAL(GROUP_BREWING, m.group(LOAD_CELL_GROUP).getState());
+        BrewOption* option = m.group(LOAD_CELL_GROUP).ptrCurrentBrewingOption;
+        unsigned long startMs = millis();
+        while (m.group(LOAD_CELL_GROUP).getState() != GROUP_IDLE && millis() - startMs < 120000UL) {
+            run(1);
+        }
+        run(5000);                                                  //!< drip
+        *stopReason = option->getStopReason();
+        return (int16_t) ((scale.cupGrams - CUP_GRAMS) * 10 + 0.5);
+    };
+};
+
+/*----------------------------------------------------------------------*
+/ stop on predicted weight at slow, normal and fast flow                *
+/-----------------------------------------------------------------------*/
+void test_cutoff_accuracy() {
+    const float RATES[] = { 1.2, 2.0, 3.5 };
+    for (uint8_t i = 0; i < sizeof(RATES) / sizeof(RATES[0]); i++) {
+        Bench bench(RATES[i]);
+        bench.run(1000);
+        bench.loadCell.setTarget(LOAD_CELL_GROUP, 0, 1, TARGET_WEIGHT);
+
+        StopReason stopReason;
+        int16_t weight = bench.shot(2000, &stopReason);
+
+        char message[96];
+        snprintf(message, sizeof(message), "%.1f g/s: %.1f g in the cup for a %.1f g target", RATES[i], weight / 10.0, TARGET_WEIGHT / 10.0);
+        TEST_MESSAGE(message);
+        TEST_ASSERT_EQUAL_MESSAGE(STOP_BY_WEIGHT, stopReason, message);
+        TEST_ASSERT_INT_WITHIN_MESSAGE(10, TARGET_WEIGHT, weight, message);
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ HX711 bits clocked per loop call and what that costs on the Uno       *
+/-----------------------------------------------------------------------*/
+void test_per_loop_cost() {
+    Bench bench(2.0);
+    bench.run(10000);
+
+    // per bit: SCK high, read DOUT, SCK low; plus the DOUT ready check of every call
+    float worstMicros = (bench.scale.maxSckPulsesPerCall * 3 + 1) * AVR_DIGITAL_IO_MICROS;
+    float meanMicros = (bench.scale.sckPulses * 3.0 / bench.loops + 1) * AVR_DIGITAL_IO_MICROS;
+    char message[128];
+    snprintf(message, sizeof(message), "%lu SCK pulses in %lu loops, at most %lu per call: about %.0f us worst, %.1f us mean per loop",
+             bench.scale.sckPulses, bench.loops, bench.scale.maxSckPulsesPerCall, worstMicros, meanMicros);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_GREATER_OR_EQUAL((10000 / SCALE_CONVERSION_MILLIS - 1) * 25, bench.scale.sckPulses); //!< every sample read, 10 per second
+    TEST_ASSERT_EQUAL(LOAD_CELL_BITS_PER_LOOP, bench.scale.maxSckPulsesPerCall);
+    TEST_ASSERT_TRUE(bench.loadCell.isReady());
+    TEST_ASSERT_INT_WITHIN(2, 0, bench.loadCell.getWeight());
+}
+
+/*----------------------------------------------------------------------*
+/ a cup put down right before the press is not tared: the shot doses   *
+/ by volume instead of stopping on a weight measured from the wrong zero *
+/-----------------------------------------------------------------------*/
+void test_unsettled_cup_doses_by_volume() {
+    Bench bench(2.0);
+    bench.run(1000);
+    bench.loadCell.setTarget(LOAD_CELL_GROUP, 0, 1, TARGET_WEIGHT);
+
+    StopReason stopReason;
+    bench.shot(150, &stopReason);
+    TEST_ASSERT_EQUAL(STOP_BY_FLOWMETER, stopReason);
+
+    // once still, the next shot is weighed
+    bench.shot(2000, &stopReason);
+    TEST_ASSERT_EQUAL(STOP_BY_WEIGHT, stopReason);
+}
+
+/*----------------------------------------------------------------------*
+/ a weight dosed option is not queued, its cup has to be swapped first  *
+/-----------------------------------------------------------------------*/
+void test_weight_dosed_option_not_queued() {
+    Bench bench(2.0);
+    bench.run(1000);
+    bench.loadCell.setTarget(LOAD_CELL_GROUP, 0, 1, TARGET_WEIGHT);
+
+    bench.scale.cupGrams = CUP_GRAMS;
+    bench.run(2000);
+    bench.press(0);
+    bench.press(1);                                                 //!< weight dosed, refused
+    bench.press(2);                                                 //!< volumetric, queued
+    while (bench.m.group(LOAD_CELL_GROUP).getBrewingOptionIndex() == 0) {
+        bench.run(1);
+    }
+    TEST_ASSERT_EQUAL(2, bench.m.group(LOAD_CELL_GROUP).getBrewingOptionIndex());
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_per_loop_cost);
+    RUN_TEST(test_cutoff_accuracy);
+    RUN_TEST(test_unsettled_cup_doses_by_volume);
+    RUN_TEST(test_weight_dosed_option_not_queued);
+    return UNITY_END();
+}
@@ -0,0 +1,81 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include <TestMachine.h>
+#include <unity.h>
+#include <stdio.h>
+
+//! an output is forced off within a tick and an interrupt period of its limit, plus the loop that sees it
+const unsigned long SAFETY_REACTION_MICROS = SAFETY_TICK_MILLIS * 1000UL + SAFETY_INTERRUPT_MICROS + TEST_LOOP_MICROS;
+
+//! loops until the output goes off, returns for how long it was on (us)
+static unsigned long onMicros(TestMachine& m, bool (*isOn)(TestMachine&), unsigned long maxMillis) {
+    unsigned long startUs = micros();
+    while (isOn(m) && micros() - startUs < maxMillis * 1000) {
+        m.loop();
+    }
+    return micros() - startUs;
+}
+
+static bool isGroup1SolenoidOpen(TestMachine& m) { return m.isSolenoidOpen(1); }
+static bool isBoilerSolenoidOpen(TestMachine& m) { return m.isBoilerSolenoidOpen(); }
+
+static void assertLimit(unsigned long limitMillis, unsigned long measuredUs, const char* output) {
+    char message[96];
+    snprintf(message, sizeof(message), "%s forced off after %lu us, limit %lu ms", output, measuredUs, limitMillis);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_GREATER_OR_EQUAL_MESSAGE(limitMillis * 1000, measuredUs, message);
+    TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(limitMillis * 1000 + SAFETY_REACTION_MICROS, measuredUs, message);
+}
+
+/*----------------------------------------------------------------------*
+/ a programming shot nobody stops: the group solenoid closes at         *
+/ MAX_SOLENOID_OPEN_MILLIS of real time, not of 1.024 ms interrupts     *
+/-----------------------------------------------------------------------*/
+void test_solenoid_limit() {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX, MILLIS_TO_ENTER_PROGRAM_MODE + 100);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(1).getState());
+
+    stubSetInput(m.optionPin(1, 0), LOW);
+    m.run(100);
+    stubSetInput(m.optionPin(1, 0), HIGH);
+    while (!m.isSolenoidOpen(1)) {
+        m.loop();
+    }
+    unsigned long measuredUs = onMicros(m, isGroup1SolenoidOpen, MAX_SOLENOID_OPEN_MILLIS + 1000);
+    assertLimit(MAX_SOLENOID_OPEN_MILLIS, measuredUs, "group solenoid");
+    TEST_ASSERT_FALSE(m.isSolenoidOpen(1));
+    m.run(10);
+    TEST_ASSERT_EQUAL(GROUP_PROGRAMMING, m.group(1).getState());
+}
+
+/*----------------------------------------------------------------------*
+/ boiler that never fills: solenoid closed at BOILER_FILL_TIMEOUT_MILLIS *
+/-----------------------------------------------------------------------*/
+void test_boiler_fill_limit() {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    stubSetInput(TEST_WATER_LEVEL_PIN, HIGH);                       //!< level low
+    while (!m.isBoilerSolenoidOpen()) {
+        m.loop();
+    }
+    unsigned long measuredUs = onMicros(m, isBoilerSolenoidOpen, BOILER_FILL_TIMEOUT_MILLIS + 1000);
+    assertLimit(BOILER_FILL_TIMEOUT_MILLIS, measuredUs, "boiler solenoid");
+    TEST_ASSERT_FALSE(m.isPumpOn());
+    m.run(10);
+    TEST_ASSERT_TRUE(m.machine.isSafetyFault());
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_solenoid_limit);
+    RUN_TEST(test_boiler_fill_limit);
+    return UNITY_END();
+}
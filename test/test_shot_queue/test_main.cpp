@@ -0,0 +1,184 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include <TestMachine.h>
+#include <unity.h>
+#include <stdio.h>
+
+#if SHOT_QUEUE_LEN == 0
+#error "build with -D SHOT_QUEUE_LEN=1 or 2, see [env:native_shot_queue]"
+#endif
+
+const uint8_t RUSH_ORDERS = 10;                                     //!< shots each group serves
+const unsigned long FLOW_PULSE_MILLIS = 250;                        //!< flowmeter pulse period while a solenoid is open
+const unsigned long BARISTA_REACTION_MILLIS = 3000;                 //!< from the end of a shot to the next press (notice, swap cup)
+const unsigned long BARISTA_PRESS_MILLIS = 120;
+
+/**
+ * Barista
+ *
+ * Works one group through a list of orders. Without the queue the next option is pressed once
+ * the group is idle again, after the reaction time; with it the next option is pressed while
+ * the current shot brews, as soon as it started.
+ */
+struct Barista {
+    int8_t groupNumber;
+    bool useQueue;
+    uint8_t pressed = 0;                                            //!< orders handed to the machine
+    uint8_t started = 0;                                            //!< shots started by the group
+    int8_t brewingOptionIndex = -1;
+    unsigned long releaseAtMs = 0;
+    uint8_t releasePin = 0;
+    unsigned long idleSinceMs = 0;
+    bool wasIdle = true;
+    unsigned long lastPulseMs = 0;
+    unsigned long idleMillis = 0;                                   //!< group idle between the first and the last shot
+    unsigned long firstStartMs = 0;
+
+    Barista(int8_t groupNumber, bool useQueue) : groupNumber(groupNumber), useQueue(useQueue) {};
+
+    int8_t order(uint8_t i) { return (i + groupNumber) % (BREW_OPTIONS_LEN - 1); };
+
+    void press(TestMachine& m, int8_t optionIndex) {
+        releasePin = m.optionPin(groupNumber, optionIndex);
+        stubSetInput(releasePin, LOW);
+        releaseAtMs = millis() + BARISTA_PRESS_MILLIS;
+        pressed++;
+    };
+
+    void step(TestMachine& m) {
+        BrewGroup& group = m.group(groupNumber);
+        unsigned long now = millis();
+
+        // water through the group
+        if (m.isSolenoidOpen(groupNumber) && now - lastPulseMs >= FLOW_PULSE_MILLIS) {
+            m.flowMeterArray[groupNumber-1].increment();
+            lastPulseMs = now;
+        }
+
+        bool idle = group.getState() == GROUP_IDLE;
+        if (group.getBrewingOptionIndex() != brewingOptionIndex) {
+            brewingOptionIndex = group.getBrewingOptionIndex();
+            started += brewingOptionIndex >= 0 ? 1 : 0;
+        }
+        if (idle && !wasIdle) {
+            idleSinceMs = now;
+        } else if (!idle && wasIdle) {
+            if (firstStartMs == 0) {
+                firstStartMs = now;
+            } else {
+                idleMillis += now - idleSinceMs;
+            }
+            lastPulseMs = now;
+        }
+        wasIdle = idle;
+
+        if (releaseAtMs != 0) {
+            if (now >= releaseAtMs) {
+                stubSetInput(releasePin, HIGH);
+                releaseAtMs = 0;
+            }
+            return;
+        }
+        if (pressed == RUSH_ORDERS) {
+            return;
+        }
+        if (idle && (pressed == 0 || now - idleSinceMs >= BARISTA_REACTION_MILLIS)) {
+            press(m, order(pressed));
+        } else if (useQueue && !idle && pressed == started) {
+            press(m, order(pressed));                               //!< queue the next order
+        }
+    };
+};
+
+/*----------------------------------------------------------------------*
+/ rush hour: both groups serve RUSH_ORDERS shots back to back, returns   *
+/ the total idle time of the groups between their first and last shot  *
+/-----------------------------------------------------------------------*/
+static unsigned long rush(bool useQueue, unsigned long* totalMillis) {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    Barista baristaArray[BREW_GROUPS_LEN] = { Barista(1, useQueue), Barista(2, useQueue) };
+    unsigned long startMs = millis();
+    unsigned long deadlineMs = startMs + 30UL * 60 * 1000;
+    bool done = false;
+    while (!done && millis() < deadlineMs) {
+        m.loop();
+        done = true;
+        for (uint8_t i = 0; i < BREW_GROUPS_LEN; i++) {
+            baristaArray[i].step(m);
+            done = done && baristaArray[i].started == RUSH_ORDERS && baristaArray[i].wasIdle;
+        }
+        TEST_ASSERT_TRUE(m.group(1).checkInvariants() && m.group(2).checkInvariants());
+    }
+    TEST_ASSERT_TRUE_MESSAGE(done, "rush not served in 30 minutes");
+
+    unsigned long idleMillis = 0;
+    for (uint8_t i = 0; i < BREW_GROUPS_LEN; i++) {
+        TEST_ASSERT_EQUAL(RUSH_ORDERS, m.usageCounters.getRecord().shotCountArray[i][0] + m.usageCounters.getRecord().shotCountArray[i][1]
+                                     + m.usageCounters.getRecord().shotCountArray[i][2] + m.usageCounters.getRecord().shotCountArray[i][3]);
+        idleMillis += baristaArray[i].idleMillis;
+    }
+    *totalMillis = millis() - startMs;
+    return idleMillis;
+}
+
+void test_rush_idle_time() {
+    unsigned long totalWithout, totalWith;
+    unsigned long idleWithout = rush(false, &totalWithout);
+    unsigned long idleWith = rush(true, &totalWith);
+
+    char message[128];
+    snprintf(message, sizeof(message), "group idle time (ms) without queue %lu, with queue %lu; rush served in %lu ms, %lu ms",
+             idleWithout, idleWith, totalWithout, totalWith);
+    TEST_MESSAGE(message);
+
+    // without the queue each group waits the reaction time between shots, with it the next shot starts right away
+    TEST_ASSERT_GREATER_OR_EQUAL(BREW_GROUPS_LEN * (RUSH_ORDERS - 1) * BARISTA_REACTION_MILLIS, idleWithout);
+    TEST_ASSERT_LESS_OR_EQUAL(BREW_GROUPS_LEN * (RUSH_ORDERS - 1) * 10, idleWith);
+    TEST_ASSERT_LESS_THAN(totalWithout, totalWith);
+}
+
+void test_queue_and_cancel() {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    m.press(1, 0);
+    m.press(1, 2);
+    TEST_ASSERT_EQUAL(GROUP_BREWING, m.group(1).getState());
+    TEST_ASSERT_EQUAL(0, m.group(1).getBrewingOptionIndex());
+
+    // pressed again, the queued shot is cancelled
+    m.run(600);
+    m.press(1, 2);
+    m.flow(1, 40, 100);
+    m.run(10);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(1).getState());
+
+    // queued shot starts as the dose of the current one is reached
+    m.press(1, 1);
+    m.press(1, 3);
+    m.flow(1, 60, 100);
+    m.run(10);
+    TEST_ASSERT_EQUAL(GROUP_BREWING, m.group(1).getState());
+    TEST_ASSERT_EQUAL(3, m.group(1).getBrewingOptionIndex());
+    TEST_ASSERT_TRUE(m.isSolenoidOpen(1));
+
+    // continuous button stops the shot and cancels the queue
+    m.press(1, 0);
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(1).getState());
+    TEST_ASSERT_FALSE(m.isSolenoidOpen(1));
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_queue_and_cancel);
+    RUN_TEST(test_rush_idle_time);
+    return UNITY_END();
+}
@@ -0,0 +1,221 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include <TestMachine.h>
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+
+const uint8_t DOSE_SECONDS = 30;
+const long DOSE_PULSES = 60;
+const long STALLED_PULSES = 10;                                     //!< flowmeter moving, dose far from reached
+
+/**
+ * ReferenceStats
+ *
+ * Same statistics as ShotStatistics in floating point: Welford's mean and population variance
+ * over n = min(count, SHOT_STATS_WINDOW) shots, so the moving average after the window.
+ */
+struct ReferenceStats {
+    uint16_t count = 0;
+    double mean = 0;                                                //!< seconds
+    double variance = 0;                                            //!< seconds^2
+
+    void addShot(double seconds) {
+        count++;
+        uint8_t n = count < SHOT_STATS_WINDOW ? count : SHOT_STATS_WINDOW;
+        double delta = seconds - mean;
+        mean += delta / n;
+        variance += (delta * (seconds - mean) - variance) / n;
+    };
+};
+
+static void addShots(ShotStatistics& stats, ReferenceStats& ref, const float seconds[], uint8_t len) {
+    for (uint8_t i = 0; i < len; i++) {
+        stats.addShot(seconds[i] * 1000, DOSE_PULSES, false);
+        ref.addShot(seconds[i]);
+
+        char message[64];
+        snprintf(message, sizeof(message), "shot %u of %.1f s", ref.count, seconds[i]);
+        // each update truncates less than 1/160 s of mean and one unit of variance
+        TEST_ASSERT_INT_WITHIN_MESSAGE(20, (long) (ref.mean * 1000), (long) stats.getMeanDurationMillis(), message);
+        TEST_ASSERT_INT_WITHIN_MESSAGE(ref.count + 1, (long) (ref.variance * 100), (long) stats.durationVariance, message);
+    }
+}
+
+//! dosage timeout seen by canFinishBrewing(): first elapsed time, in 100 ms steps, at which a stalled shot stops
+static unsigned long doseTimeoutMillis(BrewOption& option) {
+    for (unsigned long elapsed = 0; elapsed <= 4 * DOSE_SECONDS * 1000UL; elapsed += 100) {
+        if (option.canFinishBrewing(elapsed, STALLED_PULSES)) {
+            TEST_ASSERT_EQUAL(STOP_BY_MAX_DURATION, option.getStopReason());
+            return elapsed;
+        }
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------------*
+/ exact mean and variance over the first window of shots                *
+/-----------------------------------------------------------------------*/
+void test_mean_and_variance() {
+    const float SHOTS[] = { 25.0, 26.0, 27.0, 28.0, 29.0 };
+    ShotStatistics stats;
+    ReferenceStats ref;
+    addShots(stats, ref, SHOTS, 5);
+
+    TEST_ASSERT_EQUAL(5, stats.count);
+    TEST_ASSERT_EQUAL(27000, stats.getMeanDurationMillis());
+    TEST_ASSERT_INT_WITHIN(2, 200, stats.durationVariance);        //!< 2 s^2 in (1/10 s)^2
+    TEST_ASSERT_EQUAL(1400, stats.getStdDevDurationMillis());        //!< integer square root, 1.414 s
+    TEST_ASSERT_EQUAL(DOSE_PULSES, stats.getMeanPulseCount());
+    TEST_ASSERT_EQUAL(0, stats.pulseVariance);
+    TEST_ASSERT_EQUAL(0, stats.getTimeoutPercent());
+}
+
+/*----------------------------------------------------------------------*
+/ after SHOT_STATS_WINDOW shots the mean follows recent shots: a step   *
+/ from 25 s to 35 s is 1 - (7/8)^k through after k shots                *
+/-----------------------------------------------------------------------*/
+void test_moving_average_after_window() {
+    const float BEFORE[] = { 25, 25, 25, 25, 25, 25, 25, 25 };
+    const float AFTER[] = { 35, 35, 35, 35, 35, 35, 35, 35 };
+    ShotStatistics stats;
+    ReferenceStats ref;
+    addShots(stats, ref, BEFORE, 8);
+    TEST_ASSERT_EQUAL(25000, stats.getMeanDurationMillis());
+    TEST_ASSERT_EQUAL(0, stats.durationVariance);
+
+    addShots(stats, ref, AFTER, 8);
+    double expected = 35 - 10 * pow(7.0 / 8, 8);
+    TEST_ASSERT_INT_WITHIN(20, (long) (expected * 1000), (long) stats.getMeanDurationMillis());
+    TEST_ASSERT_GREATER_THAN(31000, stats.getMeanDurationMillis()); //!< a cumulative mean would still be at 30 s
+
+    // reset by a new dosage or recipe bank, the next shot is the mean
+    stats.reset();
+    stats.addShot(33000, DOSE_PULSES, true);
+    TEST_ASSERT_EQUAL(33000, stats.getMeanDurationMillis());
+    TEST_ASSERT_EQUAL(100, stats.getTimeoutPercent());
+}
+
+/*----------------------------------------------------------------------*
+/ samples clamp to the fixed point range and the variance saturates at  *
+/ 0xFFFF instead of wrapping, then decays again with steady shots       *
+/-----------------------------------------------------------------------*/
+void test_variance_saturation() {
+    ShotStatistics stats;
+    for (uint8_t i = 0; i < 16; i++) {
+        stats.addShot(i & 1 ? 600000UL : 0, i & 1 ? 5000 : 0, true);
+        TEST_ASSERT_GREATER_OR_EQUAL(stats.count > 1 ? 0x8000 : 0, stats.durationVariance);
+    }
+    TEST_ASSERT_EQUAL(0xFFFF, stats.durationVariance);
+    TEST_ASSERT_EQUAL(0xFFFF, stats.pulseVariance);
+    TEST_ASSERT_EQUAL(25500, stats.getStdDevDurationMillis());
+    TEST_ASSERT_LESS_OR_EQUAL(409500, stats.getMeanDurationMillis());
+    TEST_ASSERT_LESS_OR_EQUAL(4095, stats.getMeanPulseCount());
+
+    for (uint8_t i = 0; i < 64; i++) {
+        stats.addShot(30000, DOSE_PULSES, false);
+    }
+    TEST_ASSERT_INT_WITHIN(100, 30000, stats.getMeanDurationMillis());
+    TEST_ASSERT_LESS_THAN(256, stats.durationVariance);             //!< down by 7/8 a shot, below (1.6 s)^2
+    TEST_ASSERT_EQUAL(20, stats.getTimeoutPercent());
+}
+
+/*----------------------------------------------------------------------*
+/ drift is flagged once SHOT_STATS_MIN_SAMPLES shots have a mean out of  *
+/ the SHOT_DRIFT_BAND_PERCENT band around the programmed duration       *
+/-----------------------------------------------------------------------*/
+void test_drift_band() {
+    const unsigned long SHOT_MILLIS[] = { 35800, 24300, 36200, 23800 };
+    const bool DRIFTING[] = { false, false, true, true };
+    for (uint8_t i = 0; i < sizeof(SHOT_MILLIS) / sizeof(SHOT_MILLIS[0]); i++) {
+        BrewOption option(NO_OPTION_PIN, DOSE_PULSES, DOSE_SECONDS, NULL);
+        for (uint8_t shot = 0; shot < SHOT_STATS_MIN_SAMPLES; shot++) {
+            TEST_ASSERT_FALSE(option.isDrifting());                 //!< not evaluated on too few shots
+            option.shotStats.addShot(SHOT_MILLIS[i], DOSE_PULSES, false);
+        }
+        char message[32];
+        snprintf(message, sizeof(message), "mean %lu ms", SHOT_MILLIS[i]);
+        TEST_ASSERT_EQUAL_MESSAGE(DRIFTING[i], option.isDrifting(), message);
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ dosage timeout of a stalled shot: 2 X duration config, or with the    *
+/ adaptive timeout mean + 4 sigma bounded by 1 and 2 X duration config   *
+/-----------------------------------------------------------------------*/
+void test_dose_timeout_bounds() {
+    const float STEADY_SHOTS[] = { 25.0, 26.0, 27.0, 28.0, 29.0 };
+    BrewOption option(NO_OPTION_PIN, DOSE_PULSES, DOSE_SECONDS, NULL);
+    for (uint8_t i = 0; i < SHOT_STATS_MIN_SAMPLES - 1; i++) {
+        option.shotStats.addShot(STEADY_SHOTS[i] * 1000, DOSE_PULSES, false);
+    }
+    TEST_ASSERT_EQUAL(2 * DOSE_SECONDS * 1000UL, doseTimeoutMillis(option));
+    option.shotStats.addShot(STEADY_SHOTS[SHOT_STATS_MIN_SAMPLES - 1] * 1000, DOSE_PULSES, false);
+
+#if ADAPTIVE_DOSE_TIMEOUT
+    TEST_ASSERT_EQUAL(27000 + ADAPTIVE_TIMEOUT_SIGMAS * 1400, doseTimeoutMillis(option));
+
+    // fast shots: never below the duration config
+    BrewOption fast(NO_OPTION_PIN, DOSE_PULSES, DOSE_SECONDS, NULL);
+    for (uint8_t i = 0; i < SHOT_STATS_MIN_SAMPLES; i++) {
+        fast.shotStats.addShot(20000, DOSE_PULSES, false);
+    }
+    TEST_ASSERT_EQUAL(DOSE_SECONDS * 1000UL, doseTimeoutMillis(fast));
+
+    // erratic shots: never above 2 X the duration config
+    BrewOption erratic(NO_OPTION_PIN, DOSE_PULSES, DOSE_SECONDS, NULL);
+    for (uint8_t i = 0; i < SHOT_STATS_MIN_SAMPLES; i++) {
+        erratic.shotStats.addShot(i & 1 ? 60000 : 20000, DOSE_PULSES, true);
+    }
+    TEST_ASSERT_EQUAL(2 * DOSE_SECONDS * 1000UL, doseTimeoutMillis(erratic));
+#else
+    TEST_ASSERT_EQUAL(2 * DOSE_SECONDS * 1000UL, doseTimeoutMillis(option));
+#endif
+}
+
+/*----------------------------------------------------------------------*
+/ dosed shots are accounted, continuous shots and shots stopped by the  *
+/ barista are not                                                       *
+/-----------------------------------------------------------------------*/
+void test_shots_accounted() {
+    TestMachine m;
+    m.setup();
+    m.run(1000);
+
+    m.press(1, 0);
+    BrewOption* dosed = m.group(1).ptrCurrentBrewingOption;
+    m.flow(1, 40, 500);
+    m.run(10);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(1).getState());
+    TEST_ASSERT_EQUAL(1, dosed->shotStats.count);
+    TEST_ASSERT_INT_WITHIN(300, 20000, dosed->shotStats.getMeanDurationMillis());
+
+    m.press(1, 0);
+    m.flow(1, 10, 500);
+    m.press(1, 0);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(1).getState());
+    TEST_ASSERT_EQUAL(1, dosed->shotStats.count);
+
+    m.press(1, CONTINUOUS_BREW_OPTION_INDEX);
+    BrewOption* continuous = m.group(1).ptrCurrentBrewingOption;
+    TEST_ASSERT_NOT_NULL(continuous);
+    m.flow(1, 240, 500);
+    m.run(10);
+    TEST_ASSERT_EQUAL(GROUP_IDLE, m.group(1).getState());
+    TEST_ASSERT_EQUAL(STOP_BY_MAX_DURATION, continuous->getStopReason());
+    TEST_ASSERT_EQUAL(0, continuous->shotStats.count);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_mean_and_variance);
+    RUN_TEST(test_moving_average_after_window);
+    RUN_TEST(test_variance_saturation);
+    RUN_TEST(test_drift_band);
+    RUN_TEST(test_dose_timeout_bounds);
+    RUN_TEST(test_shots_accounted);
+    return UNITY_END();
+}
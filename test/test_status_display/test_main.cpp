@@ -0,0 +1,265 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#include <TestMachine.h>
+#include <StatusDisplay.h>
+#include <unity.h>
+#include <stdio.h>
+
+const float I2C_SCL_LOW_MICROS = 4.7;                               //!< standard mode minimums
+const float I2C_SCL_HIGH_MICROS = 4.0;
+const float I2C_START_HOLD_MICROS = 4.0;
+const float I2C_STOP_SETUP_MICROS = 4.0;
+const float I2C_BUS_FREE_MICROS = 4.7;
+
+/**
+ * MockBackpack
+ *
+ * PCF8574 backpack and HD44780 display on the simulated D6 (SDA) / D7 (SCL) open drain lines.
+ * sample() runs after every loop call: it decodes line changes into I2C conditions and bits,
+ * acknowledges its address by pulling SDA low through PIND, checks the standard mode timing
+ * and feeds the port writes to an HD44780 model, so the test sees what the display shows.
+ */
+class MockBackpack {
+public:
+    MockBackpack(uint8_t address, bool present) : m_address(address), m_present(present) {
+        memset(screen, ' ', sizeof(screen));
+    };
+
+    char screen[STATUS_DISPLAY_ROWS][STATUS_DISPLAY_COLS + 1] = {};
+    unsigned long bytes = 0;                                        //!< bytes clocked on the bus, address included
+    unsigned long transfers = 0;
+    unsigned long timingViolations = 0;
+    unsigned long maxEdgesPerCall = 0;                              //!< SCL edges seen in a single loop call
+
+    void sample() {
+        bool scl = !(DDRD & _BV(DDD7));
+        bool sdaMaster = !(DDRD & _BV(DDD6));
+        unsigned long now = micros();
+        unsigned long edges = 0;
+
+        // the driver changes SCL before SDA in the same step
+        if (scl != m_scl) {
+            edges++;
+            if (scl) {
+                checkTiming(now - m_sclChangeUs, I2C_SCL_LOW_MICROS);
+                onClockHigh(line(sdaMaster));
+            } else {
+                checkTiming(now - m_sclChangeUs, I2C_SCL_HIGH_MICROS);
+                if (m_startUs != 0) {
+                    checkTiming(now - m_startUs, I2C_START_HOLD_MICROS);
+                    m_startUs = 0;
+                }
+                onClockLow();
+            }
+            m_scl = scl;
+            m_sclChangeUs = now;
+        }
+        bool sda = line(sdaMaster);
+        if (sda != m_sda && m_scl) {
+            if (!sda) {
+                checkTiming(now - m_stopUs, I2C_BUS_FREE_MICROS);
+                m_startUs = now;
+                m_inTransfer = true;
+                m_bit = 0;
+                m_byteIndex = 0;
+                m_addressed = false;
+            } else {
+                checkTiming(now - m_sclChangeUs, I2C_STOP_SETUP_MICROS);
+                m_stopUs = now;
+                if (m_inTransfer) {
+                    transfers++;
+                }
+                m_inTransfer = false;
+            }
+        }
+        m_sda = sda;
+        maxEdgesPerCall = edges > maxEdgesPerCall ? edges : maxEdgesPerCall;
+
+        // what the driver reads back
+        PIND = line(sdaMaster) ? PIND | _BV(PIND6) : PIND & ~_BV(PIND6);
+    };
+
+    bool showing(uint8_t row, const char* text) { return strncmp(screen[row], text, STATUS_DISPLAY_COLS) == 0; };
+
+private:
+    uint8_t m_address;
+    bool m_present;
+    bool m_scl = true;
+    bool m_sda = true;
+    bool m_ackDrive = false;
+    unsigned long m_sclChangeUs = 0;
+    unsigned long m_startUs = 0;
+    unsigned long m_stopUs = 0;
+    bool m_inTransfer = false;
+    bool m_addressed = false;
+    uint8_t m_bit = 0;
+    uint8_t m_byte = 0;
+    uint8_t m_byteIndex = 0;
+    uint8_t m_port = 0xFF;
+    bool m_fourBitMode = false;
+    bool m_highNibble = true;
+    uint8_t m_pending = 0;
+    uint8_t m_ddram = 0;
+
+    bool line(bool sdaMaster) { return sdaMaster && !m_ackDrive; };
+
+    void checkTiming(unsigned long elapsed, float minimum) {
+        if (elapsed < minimum) {
+            timingViolations++;
+        }
+    };
+
+    void onClockHigh(bool sda) {
+        if (!m_inTransfer || m_bit >= 8) {
+            m_bit = m_bit >= 8 ? 9 : m_bit;
+            return;
+        }
+        m_byte = (m_byte << 1) | sda;
+        m_bit++;
+    };
+
+    void onClockLow() {
+        if (!m_inTransfer) {
+            return;
+        }
+        if (m_bit == 8) {
+            bytes++;
+            if (m_byteIndex == 0) {
+                m_addressed = m_present && m_byte == (m_address << 1);
+            } else if (m_addressed) {
+                writePort(m_byte);
+            }
+            m_ackDrive = m_addressed;
+        } else if (m_bit == 9) {
+            m_ackDrive = false;
+            m_bit = 0;
+            m_byteIndex++;
+        }
+    };
+
+    //! PCF8574 outputs: P0 RS, P2 E, P4..P7 data nibble; the display latches on the falling edge of E
+    void writePort(uint8_t port) {
+        if ((m_port & 0x04) && !(port & 0x04)) {
+            latchNibble(m_port >> 4, m_port & 0x01);
+        }
+        m_port = port;
+    };
+
+    void latchNibble(uint8_t nibble, bool isData) {
+        if (!m_fourBitMode) {
+            m_fourBitMode = nibble == 0x02;                         //!< 8-bit mode commands only carry the high nibble
+            return;
+        }
+        if (m_highNibble) {
+            m_pending = nibble << 4;
+            m_highNibble = false;
+            return;
+        }
+        m_highNibble = true;
+        uint8_t value = m_pending | nibble;
+        if (isData) {
+            uint8_t row = m_ddram >= 0x40 ? 1 : 0;
+            uint8_t col = m_ddram & 0x3F;
+            if (col < STATUS_DISPLAY_COLS) {
+                screen[row][col] = value;
+            }
+            m_ddram++;
+        } else if (value & 0x80) {
+            m_ddram = value & 0x7F;
+        } else if (value == 0x01) {
+            for (uint8_t row = 0; row < STATUS_DISPLAY_ROWS; row++) {
+                memset(screen[row], ' ', STATUS_DISPLAY_COLS);
+            }
+            m_ddram = 0;
+        }
+    };
+};
+
+static void run(TestMachine& m, StatusDisplay& display, MockBackpack& backpack, unsigned long ms, unsigned long loopMicros) {
+    unsigned long endMs = millis() + ms;
+    while (millis() < endMs) {
+        m.loop(loopMicros);
+        display.loop();
+        backpack.sample();
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ a loop far faster than the bus allows still gets standard mode timing *
+/-----------------------------------------------------------------------*/
+void test_fast_loop_keeps_i2c_timing() {
+    TestMachine m;
+    m.setup();
+    StatusDisplay display(&m.machine);
+    MockBackpack backpack(STATUS_DISPLAY_ADDRESS, true);
+    display.setup();
+
+    run(m, display, backpack, 2000, 1);
+
+    TEST_ASSERT_EQUAL(0, backpack.timingViolations);
+    TEST_ASSERT_EQUAL(1, backpack.maxEdgesPerCall);
+    TEST_ASSERT_TRUE_MESSAGE(backpack.showing(0, "1-       0000 1 "), backpack.screen[0]);
+    TEST_ASSERT_TRUE_MESSAGE(backpack.showing(1, "2-       0000 1 "), backpack.screen[1]);
+}
+
+/*----------------------------------------------------------------------*
+/ transfer volume with a realistic loop: nothing while idle, only the   *
+/ changed digits while a group brews                                    *
+/-----------------------------------------------------------------------*/
+void test_transfer_volume() {
+    TestMachine m;
+    m.setup();
+    StatusDisplay display(&m.machine);
+    MockBackpack backpack(STATUS_DISPLAY_ADDRESS, true);
+    display.setup();
+    run(m, display, backpack, 3000, 100);
+
+    unsigned long bytes = backpack.bytes;
+    run(m, display, backpack, 5000, 100);
+    TEST_ASSERT_EQUAL_MESSAGE(bytes, backpack.bytes, "bus traffic while nothing changes");
+
+    // shot on group 1, 5 flowmeter pulses per second for 10 seconds
+    stubSetInput(m.optionPin(1, 1), LOW);
+    run(m, display, backpack, 100, 100);
+    stubSetInput(m.optionPin(1, 1), HIGH);
+    bytes = backpack.bytes;
+    for (uint8_t i = 0; i < 50; i++) {
+        run(m, display, backpack, 200, 100);
+        m.flowMeterArray[0].increment();
+    }
+    run(m, display, backpack, 500, 100);
+    unsigned long bytesPerSecond = (backpack.bytes - bytes) / 10;
+
+    char message[96];
+    snprintf(message, sizeof(message), "%lu bytes/s on the bus while brewing, %lu transfers", bytesPerSecond, backpack.transfers);
+    TEST_MESSAGE(message);
+
+    // full redraw of both rows every refresh would be 34 transfers of 5 bytes, 4 times a second
+    TEST_ASSERT_LESS_OR_EQUAL(34 * 5 * 4 / 4, bytesPerSecond);
+    TEST_ASSERT_EQUAL(0, backpack.timingViolations);
+    TEST_ASSERT_EQUAL(GROUP_BREWING, m.group(1).getState());
+    TEST_ASSERT_TRUE_MESSAGE(backpack.showing(0, "1B2 010s 0050 1 "), backpack.screen[0]);
+}
+
+void test_missing_display_releases_bus() {
+    TestMachine m;
+    m.setup();
+    StatusDisplay display(&m.machine);
+    MockBackpack backpack(STATUS_DISPLAY_ADDRESS, false);
+    display.setup();
+
+    run(m, display, backpack, 1000, 100);
+    TEST_ASSERT_EQUAL(1, backpack.transfers);
+    TEST_ASSERT_EQUAL(0, DDRD & (_BV(DDD6) | _BV(DDD7)));
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_fast_loop_keeps_i2c_timing);
+    RUN_TEST(test_transfer_volume);
+    RUN_TEST(test_missing_display_releases_bus);
+    return UNITY_END();
+}
@@ -0,0 +1,40 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+#ifndef SHOT_LOG_FILE_H_INCLUDED
+#define SHOT_LOG_FILE_H_INCLUDED
+
+#include <stdint.h>
+
+/**
+ * Binary shot log written by bus_aggregator: a ShotLogFileHeader followed by fixed size
+ * ShotLogFileRecord entries, little endian. Fixed size records let readers memory map a log
+ * and split it among threads at any record boundary.
+ */
+const char SHOT_LOG_FILE_MAGIC[8] = { 'G', 'E', 'L', 'S', 'H', 'O', 'T', 'S' };
+const uint32_t SHOT_LOG_FILE_VERSION = 1;
+
+struct ShotLogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;                                            //!< sizeof(ShotLogFileRecord) of the writer
+};
+
+struct ShotLogFileRecord {
+    uint32_t hostTime;                                              //!< unix time the aggregator received the shot
+    uint8_t machine;                                                //!< bus address of the controller, unique per site
+    uint8_t groupNumber;
+    int8_t brewOptionIndex;                                         //!< 4 is the continuous option
+    uint8_t stopReason;                                             //!< StopReason, see ExpressoCoffee.h
+    uint16_t sequence;                                              //!< shot sequence of the controller, wraps around
+    uint16_t durationDeciseconds;
+    uint16_t pulseCount;
+    uint16_t reserved;
+};
+
+static_assert(sizeof(ShotLogFileHeader) == 16, "shot log header layout changed");
+static_assert(sizeof(ShotLogFileRecord) == 16, "shot log record layout changed");
+
+#endif
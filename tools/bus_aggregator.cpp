@@ -0,0 +1,480 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+/**
+ * bus_aggregator
+ *
+ * Host side of the controller bus (lib/ExpressoCoffee/BusProtocol.h). Polls the controllers of
+ * every bus for new shots and appends them to a binary shot log (ShotLogFile.h); prints node
+ * status lines on stdout. Each bus is half duplex, so its nodes are polled in turn, while the
+ * buses are polled concurrently, one thread each.
+ *
+ *   g++ -std=c++11 -O2 -pthread -o bus_aggregator tools/bus_aggregator.cpp
+ *
+ *   bus_aggregator [-o shots.bin] [-s status_seconds] PORT:ADDRESS[,ADDRESS...] ...
+ *   bus_aggregator --emulate PORT:ADDRESS[,ADDRESS...] ...
+ *
+ * --emulate answers as the given controllers, brewing a random shot every few seconds, so the
+ * aggregator can be tried on Linux with virtual serial ports standing in for the bus:
+ *
+ *   socat pty,raw,echo=0,link=/tmp/bus-host pty,raw,echo=0,link=/tmp/bus-nodes &
+ *   bus_aggregator --emulate /tmp/bus-nodes:1,2,3 &
+ *   bus_aggregator -o shots.bin /tmp/bus-host:1,2,3
+ */
+
+#include "../lib/ExpressoCoffee/BusProtocol.h"
+#include "ShotLogFile.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+const int RESPONSE_TIMEOUT_MS = 150;                                //!< node turnaround plus a full response at BUS_BAUD
+const int POLL_INTERVAL_MS = 250;                                   //!< pause between polling rounds of a bus
+const int EMULATED_SHOT_INTERVAL_MS = 4000;
+const size_t EMULATED_LOG_LEN = 16;                                 //!< same as SHOT_LOG_LEN of the firmware
+
+static std::atomic<bool> running(true);
+
+struct Node {
+    uint8_t address;
+    uint16_t nextSequence = 0;
+    bool synced = false;                                            //!< nextSequence known, gaps can be reported
+};
+
+struct Bus {
+    std::string port;
+    std::vector<Node> nodes;
+};
+
+struct ShotLogWriter {
+    FILE* file = NULL;
+    std::mutex mutex;
+};
+
+static void onSignal(int) {
+    running = false;
+}
+
+/*----------------------------------------------------------------------*
+/ serial port and framing                                               *
+/-----------------------------------------------------------------------*/
+static int openPort(const std::string& port) {
+    int fd = open(port.c_str(), O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", port.c_str(), strerror(errno));
+        return -1;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, B9600);                                   //!< BUS_BAUD
+        cfsetospeed(&tio, B9600);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    return fd;
+}
+
+static bool readByte(int fd, uint8_t* c, int timeoutMs) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (poll(&pfd, 1, timeoutMs) > 0) {
+        ssize_t n = read(fd, c, 1);
+        if (n == 1) {
+            return true;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static uint8_t frameCrc(const uint8_t* bytes, size_t len) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        crc = busCrc8(crc, bytes[i]);
+    }
+    return crc;
+}
+
+static void writeFrame(int fd, const uint8_t* frame, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, frame, len);
+        if (n < 0 && errno != EINTR) {
+            return;
+        }
+        if (n > 0) {
+            frame += n;
+            len -= n;
+        }
+    }
+}
+
+static void sendRequest(int fd, uint8_t address, uint8_t command, uint16_t sequence) {
+    uint8_t request[BUS_REQUEST_LEN] = { BUS_SYNC, address, command, (uint8_t) (sequence & 0xFF), (uint8_t) (sequence >> 8), 0 };
+    request[BUS_REQUEST_LEN - 1] = frameCrc(&request[1], BUS_REQUEST_LEN - 2);
+    tcflush(fd, TCIFLUSH);
+    writeFrame(fd, request, sizeof(request));
+}
+
+/*----------------------------------------------------------------------*
+/ wait for the response of address to command, returns the payload     *
+/ length or -1 on timeout or corrupted frame                            *
+/-----------------------------------------------------------------------*/
+static int readResponse(int fd, uint8_t address, uint8_t command, uint8_t* payload) {
+    uint8_t frame[BUS_MAX_RESPONSE_LEN];
+    uint8_t c;
+    do {
+        if (!readByte(fd, &c, RESPONSE_TIMEOUT_MS)) {
+            return -1;
+        }
+    } while (c != BUS_SYNC);
+    frame[0] = c;
+    for (int i = 1; i < BUS_RESPONSE_HEADER_LEN; i++) {
+        if (!readByte(fd, &frame[i], RESPONSE_TIMEOUT_MS)) {
+            return -1;
+        }
+    }
+    uint8_t len = frame[3];
+    if (len > BUS_MAX_PAYLOAD_LEN) {
+        return -1;
+    }
+    for (int i = 0; i <= len; i++) {
+        if (!readByte(fd, &frame[BUS_RESPONSE_HEADER_LEN + i], RESPONSE_TIMEOUT_MS)) {
+            return -1;
+        }
+    }
+    if (frame[1] != (address | BUS_RESPONSE) || frame[2] != command
+        || frameCrc(&frame[1], BUS_RESPONSE_HEADER_LEN - 1 + len) != frame[BUS_RESPONSE_HEADER_LEN + len]) {
+        return -1;
+    }
+    memcpy(payload, &frame[BUS_RESPONSE_HEADER_LEN], len);
+    return len;
+}
+
+/*----------------------------------------------------------------------*
+/ aggregator                                                            *
+/-----------------------------------------------------------------------*/
+static uint16_t le16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static void appendShots(ShotLogWriter& writer, const std::vector<ShotLogFileRecord>& records) {
+    std::lock_guard<std::mutex> lock(writer.mutex);
+    fwrite(records.data(), sizeof(ShotLogFileRecord), records.size(), writer.file);
+    fflush(writer.file);
+}
+
+/*----------------------------------------------------------------------*
+/ collect new shots of a node, polling again while frames come full    *
+/-----------------------------------------------------------------------*/
+static void pollShots(int fd, Node& node, ShotLogWriter& writer) {
+    uint8_t payload[BUS_MAX_PAYLOAD_LEN];
+    int len;
+    do {
+        sendRequest(fd, node.address, BUS_CMD_SHOTS, node.nextSequence);
+        len = readResponse(fd, node.address, BUS_CMD_SHOTS, payload);
+        if (len <= 0) {
+            return;
+        }
+        std::vector<ShotLogFileRecord> records;
+        for (int i = 0; i + BUS_SHOT_RECORD_LEN <= len; i += BUS_SHOT_RECORD_LEN) {
+            const uint8_t* p = &payload[i];
+            ShotLogFileRecord rec = ShotLogFileRecord();
+            rec.hostTime = (uint32_t) time(NULL);
+            rec.machine = node.address;
+            rec.sequence = le16(p);
+            rec.groupNumber = p[2];
+            rec.brewOptionIndex = (int8_t) p[3];
+            rec.stopReason = p[4];
+            rec.durationDeciseconds = le16(&p[5]);
+            rec.pulseCount = le16(&p[7]);
+            if (node.synced && rec.sequence != node.nextSequence) {
+                fprintf(stderr, "node %u: expected shot %u, got %u (shots lost or controller restarted)\n",
+                        node.address, node.nextSequence, rec.sequence);
+            }
+            node.nextSequence = rec.sequence + 1;
+            node.synced = true;
+            records.push_back(rec);
+        }
+        appendShots(writer, records);
+    } while (len == BUS_MAX_PAYLOAD_LEN && running);
+}
+
+static void pollStatus(int fd, Node& node) {
+    uint8_t payload[BUS_MAX_PAYLOAD_LEN];
+    sendRequest(fd, node.address, BUS_CMD_STATUS, 0);
+    int len = readResponse(fd, node.address, BUS_CMD_STATUS, payload);
+    if (len < BUS_STATUS_HEADER_LEN) {
+        printf("node %u: no response\n", node.address);
+        return;
+    }
+    printf("node %u: shots %u%s%s%s", node.address, le16(payload),
+           payload[2] & BUS_STATUS_FILLING_BOILER ? " filling" : "",
+           payload[2] & BUS_STATUS_SAFETY_FAULT ? " safety-fault" : "",
+           payload[2] & BUS_STATUS_PROGRAMMING ? " programming" : "");
+    for (int i = BUS_STATUS_HEADER_LEN, g = 1; i + BUS_STATUS_GROUP_LEN <= len; i += BUS_STATUS_GROUP_LEN, g++) {
+        printf(" | group %d state %u option %d bank %u flowmeter %u", g, payload[i], (int8_t) payload[i+1], payload[i+2] + 1, payload[i+3]);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void runBus(Bus* bus, ShotLogWriter* writer, int statusSeconds) {
+    int fd = openPort(bus->port);
+    if (fd < 0) {
+        return;
+    }
+    auto lastStatus = std::chrono::steady_clock::now() - std::chrono::seconds(statusSeconds);
+    while (running) {
+        bool statusDue = std::chrono::steady_clock::now() - lastStatus >= std::chrono::seconds(statusSeconds);
+        for (Node& node : bus->nodes) {
+            pollShots(fd, node, *writer);
+            if (statusDue) {
+                pollStatus(fd, node);
+            }
+        }
+        if (statusDue) {
+            lastStatus = std::chrono::steady_clock::now();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(POLL_INTERVAL_MS));
+    }
+    close(fd);
+}
+
+/*----------------------------------------------------------------------*
+/ resume after the shots already in the log, so a restart of the       *
+/ aggregator does not log them twice                                   *
+/-----------------------------------------------------------------------*/
+static bool openShotLog(const char* path, ShotLogWriter& writer, std::vector<Bus>& buses) {
+    FILE* file = fopen(path, "a+b");
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    ShotLogFileHeader header;
+    rewind(file);
+    if (fread(&header, sizeof(header), 1, file) != 1) {
+        memcpy(header.magic, SHOT_LOG_FILE_MAGIC, sizeof(header.magic));
+        header.version = SHOT_LOG_FILE_VERSION;
+        header.recordSize = sizeof(ShotLogFileRecord);
+        fwrite(&header, sizeof(header), 1, file);
+        fflush(file);
+    } else if (memcmp(header.magic, SHOT_LOG_FILE_MAGIC, sizeof(header.magic)) != 0 || header.recordSize != sizeof(ShotLogFileRecord)) {
+        fprintf(stderr, "%s: not a shot log of this version\n", path);
+        fclose(file);
+        return false;
+    } else {
+        ShotLogFileRecord rec;
+        while (fread(&rec, sizeof(rec), 1, file) == 1) {
+            for (Bus& bus : buses) {
+                for (Node& node : bus.nodes) {
+                    if (node.address == rec.machine) {
+                        node.nextSequence = rec.sequence + 1;
+                        node.synced = true;
+                    }
+                }
+            }
+        }
+    }
+    writer.file = file;
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+/ controller emulator                                                   *
+/-----------------------------------------------------------------------*/
+struct EmulatedNode {
+    uint8_t address;
+    uint16_t nextSequence = 0;
+    std::vector<std::vector<uint8_t>> shots;                        //!< encoded records, oldest first
+};
+
+static void emulateShot(EmulatedNode& node, std::mt19937& rng) {
+    uint8_t option = rng() % 5;
+    uint16_t duration = option == 4 ? 100 + rng() % 400 : 200 + rng() % 120;
+    uint16_t pulses = duration * 2 + rng() % 20;
+    uint8_t stopReason = option == 4 ? 4 : 1;                       //!< STOP_BY_USER, STOP_BY_FLOWMETER
+    std::vector<uint8_t> rec = {
+        (uint8_t) (node.nextSequence & 0xFF), (uint8_t) (node.nextSequence >> 8), (uint8_t) (1 + rng() % 2), option, stopReason,
+        (uint8_t) (duration & 0xFF), (uint8_t) (duration >> 8), (uint8_t) (pulses & 0xFF), (uint8_t) (pulses >> 8)
+    };
+    node.nextSequence++;
+    node.shots.push_back(rec);
+    if (node.shots.size() > EMULATED_LOG_LEN) {
+        node.shots.erase(node.shots.begin());
+    }
+}
+
+static void sendResponse(int fd, uint8_t address, uint8_t command, const std::vector<uint8_t>& payload) {
+    std::vector<uint8_t> frame = { BUS_SYNC, (uint8_t) (address | BUS_RESPONSE), command, (uint8_t) payload.size() };
+    frame.insert(frame.end(), payload.begin(), payload.end());
+    frame.push_back(frameCrc(&frame[1], frame.size() - 1));
+    writeFrame(fd, frame.data(), frame.size());
+}
+
+static void answerRequest(int fd, EmulatedNode& node, const uint8_t* request) {
+    std::vector<uint8_t> payload;
+    if (request[2] == BUS_CMD_STATUS) {
+        payload = { (uint8_t) (node.nextSequence & 0xFF), (uint8_t) (node.nextSequence >> 8), 0, 0, 0xFF, 0, 0, 0, 0xFF, 0, 0 };
+    } else if (request[2] == BUS_CMD_SHOTS) {
+        uint16_t from = le16(&request[3]);
+        uint16_t available = node.nextSequence - from;
+        size_t first = available > node.shots.size() ? 0 : node.shots.size() - available;
+        for (size_t i = first; i < node.shots.size() && payload.size() < BUS_MAX_PAYLOAD_LEN; i++) {
+            payload.insert(payload.end(), node.shots[i].begin(), node.shots[i].end());
+        }
+    } else {
+        return;
+    }
+    sendResponse(fd, node.address, request[2], payload);
+}
+
+static void emulateBus(Bus* bus) {
+    int fd = openPort(bus->port);
+    if (fd < 0) {
+        return;
+    }
+    std::mt19937 rng(bus->nodes.front().address);
+    std::vector<EmulatedNode> nodes;
+    for (const Node& node : bus->nodes) {
+        EmulatedNode emulated;
+        emulated.address = node.address;
+        nodes.push_back(emulated);
+    }
+
+    uint8_t request[BUS_REQUEST_LEN];
+    size_t requestLen = 0;
+    auto nextShot = std::chrono::steady_clock::now();
+    while (running) {
+        if (std::chrono::steady_clock::now() >= nextShot) {
+            emulateShot(nodes[rng() % nodes.size()], rng);
+            nextShot += std::chrono::milliseconds(EMULATED_SHOT_INTERVAL_MS / nodes.size());
+        }
+        uint8_t c;
+        if (!readByte(fd, &c, BUS_FRAME_GAP_MILLIS)) {
+            requestLen = 0;
+            continue;
+        }
+        if (requestLen == 0 && c != BUS_SYNC) {
+            continue;
+        }
+        request[requestLen++] = c;
+        if (requestLen < BUS_REQUEST_LEN) {
+            continue;
+        }
+        requestLen = 0;
+        if (frameCrc(&request[1], BUS_REQUEST_LEN - 2) != request[BUS_REQUEST_LEN - 1]) {
+            continue;
+        }
+        for (EmulatedNode& node : nodes) {
+            if (node.address == request[1]) {
+                answerRequest(fd, node, request);
+            }
+        }
+    }
+    close(fd);
+}
+
+/*----------------------------------------------------------------------*
+/ command line                                                          *
+/-----------------------------------------------------------------------*/
+static bool parseBus(const char* arg, Bus& bus) {
+    const char* colon = strrchr(arg, ':');
+    if (colon == NULL) {
+        return false;
+    }
+    bus.port.assign(arg, colon - arg);
+    for (const char* p = colon + 1; *p; ) {
+        char* end;
+        long address = strtol(p, &end, 0);
+        if (end == p || address < 1 || address > BUS_MAX_NODE_ADDRESS) {
+            return false;
+        }
+        Node node;
+        node.address = (uint8_t) address;
+        bus.nodes.push_back(node);
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return false;
+        }
+    }
+    return !bus.nodes.empty();
+}
+
+static int usage() {
+    fprintf(stderr, "usage: bus_aggregator [-o shots.bin] [-s status_seconds] PORT:ADDRESS[,ADDRESS...] ...\n"
+                    "       bus_aggregator --emulate PORT:ADDRESS[,ADDRESS...] ...\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    const char* outputPath = "shots.bin";
+    int statusSeconds = 60;
+    bool emulate = false;
+    std::vector<Bus> buses;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            statusSeconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--emulate") == 0) {
+            emulate = true;
+        } else {
+            Bus bus;
+            if (!parseBus(argv[i], bus)) {
+                return usage();
+            }
+            buses.push_back(bus);
+        }
+    }
+    if (buses.empty() || statusSeconds <= 0) {
+        return usage();
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    ShotLogWriter writer;
+    if (!emulate && !openShotLog(outputPath, writer, buses)) {
+        return 1;
+    }
+
+    std::vector<std::thread> threads;
+    for (Bus& bus : buses) {
+        if (emulate) {
+            threads.push_back(std::thread(emulateBus, &bus));
+        } else {
+            threads.push_back(std::thread(runBus, &bus, &writer, statusSeconds));
+        }
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    if (writer.file != NULL) {
+        fclose(writer.file);
+    }
+    return 0;
+}
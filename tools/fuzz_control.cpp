@@ -0,0 +1,243 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+/**
+ * fuzz_control
+ *
+ * libFuzzer harness over the control logic: each input is decoded into a stream of button
+ * presses and releases, flowmeter pulses, time steps, boiler water level changes and EEPROM
+ * failures, played against the machine of src/gelcoffee.cpp on the Arduino stubs of
+ * test/stubs (test/stubs/TestMachine). After every loop the outputs are checked:
+ *
+ *   - the pump only runs while a group brews or the boiler fills
+ *   - a group solenoid is only open while its group is in a brewing state
+ *   - the boiler solenoid is only open while no group brews
+ *   - group state and brewing option agree (BrewGroup::checkInvariants)
+ *   - EEPROM record writes stay within the write budget: 16, plus one every 2 minutes
+ *
+ * A violation prints the failed check and aborts, so libFuzzer keeps the input as a crash.
+ * Half of the inputs start the clock just before millis() wraps around.
+ *
+ *   clang++ -std=gnu++11 -O1 -g -fsanitize=fuzzer,address,undefined -D DEBUG_LEVEL=0 \
+ *       -I test/stubs/ArduinoStub -I test/stubs/TestMachine -I lib/ExpressoCoffee \
+ *       -o fuzz_control tools/fuzz_control.cpp $(find test/stubs/ArduinoStub lib/ExpressoCoffee -name '*.cpp')
+ *
+ *   fuzz_control -fork=$(nproc) -max_len=512 -max_total_time=600 corpus/
+ *   fuzz_control crash-<sha1>                   replay an input, the failed check is printed
+ *
+ * Without libFuzzer (g++, add -D FUZZ_STANDALONE and drop -fsanitize=fuzzer) the same binary
+ * plays random inputs on all cores, or replays the files given on the command line:
+ *
+ *   fuzz_control [-j jobs] [-runs n] [-seed s] [file ...]
+ */
+
+#include <TestMachine.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+const uint8_t FUZZ_CLOCK_WRAP_FLAG = 0x80;                          //!< first input byte: start the clock right before millis() wraps
+const unsigned long FUZZ_FLOW_PULSE_MICROS = 20000;                 //!< simulated time after each flowmeter pulse
+const unsigned long FUZZ_LONG_STEP_MICROS = 100000;                 //!< unit of a long time step, a single loop call
+
+enum FuzzOp {
+    OP_PRESS,                                                       //!< button down
+    OP_RELEASE,                                                     //!< button up
+    OP_FLOW,                                                        //!< flowmeter pulses
+    OP_LOOPS,                                                       //!< 1 ms loops
+    OP_LONG_STEP,                                                   //!< one loop of up to 25.6 s
+    OP_WATER_LEVEL,                                                 //!< boiler water level input
+    OP_EEPROM_FAILING,                                              //!< EEPROM writes fail or not
+    FUZZ_OPS_LEN
+};
+
+static void fail(const char* check, unsigned long startMs) {
+    fprintf(stderr, "fuzz_control: %s, %lu ms into the input\n", check, millis() - startMs);
+    abort();
+}
+
+static bool isBrewingState(GroupState state) {
+    return state == GROUP_BREWING || state == GROUP_PROGRAMMING_BREWING || state == GROUP_BREWING_PROGRAMMING_PENDING;
+}
+
+/*----------------------------------------------------------------------*
+/ outputs against group states; checked before checkInvariants(),       *
+/ which also forces a wrong solenoid off                                *
+/-----------------------------------------------------------------------*/
+static void checkOutputs(TestMachine& m, unsigned long startMs, uint16_t eepromWrites) {
+    bool anyBrewing = false;
+    for (int8_t g = 1; g <= BREW_GROUPS_LEN; g++) {
+        bool brewing = isBrewingState(m.group(g).getState());
+        if (m.isSolenoidOpen(g) && !brewing) {
+            fail("group solenoid open while the group is not brewing", startMs);
+        }
+        anyBrewing = anyBrewing || brewing;
+    }
+    if (m.isBoilerSolenoidOpen() && anyBrewing) {
+        fail("boiler solenoid open while a group brews", startMs);
+    }
+    if (m.isPumpOn() && !anyBrewing && !m.isBoilerSolenoidOpen()) {
+        fail("pump on with no group brewing and no boiler filling", startMs);
+    }
+    for (int8_t g = 1; g <= BREW_GROUPS_LEN; g++) {
+        if (!m.group(g).checkInvariants()) {
+            fail("group state and brewing option disagree", startMs);
+        }
+    }
+    if ((unsigned long) (uint16_t) (stubEepromWriteCount() - eepromWrites) > EEPROM_WRITE_BURST + (millis() - startMs) / EEPROM_WRITE_REFILL_MILLIS + 1) {
+        fail("EEPROM writes over the write budget", startMs);
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+
+    if (size < 1) {
+        return 0;
+    }
+
+    TestMachine m;
+    m.setup();
+    if (data[0] & FUZZ_CLOCK_WRAP_FLAG) {
+        stubSetMillis(ULONG_MAX - (unsigned long) (data[0] & ~FUZZ_CLOCK_WRAP_FLAG) * 1000);
+    }
+    unsigned long startMs = millis();
+    uint16_t eepromWrites = stubEepromWriteCount();
+
+    for (size_t i = 1; i + 1 < size; i += 2) {
+        uint8_t arg = data[i + 1];
+        int8_t groupNumber = (arg & 1) + 1;
+        switch (data[i] % FUZZ_OPS_LEN) {
+            case OP_PRESS:
+                stubSetInput(m.optionPin(groupNumber, (arg >> 1) % BREW_OPTIONS_LEN), LOW);
+                m.loop();
+                break;
+            case OP_RELEASE:
+                stubSetInput(m.optionPin(groupNumber, (arg >> 1) % BREW_OPTIONS_LEN), HIGH);
+                m.loop();
+                break;
+            case OP_FLOW:
+                for (uint8_t n = 0; n <= (arg >> 1) % 32; n++) {
+                    m.flowMeterArray[groupNumber - 1].increment();
+                    m.loop(FUZZ_FLOW_PULSE_MICROS);
+                    checkOutputs(m, startMs, eepromWrites);
+                }
+                break;
+            case OP_LOOPS:
+                for (uint16_t n = 0; n <= arg; n++) {
+                    m.loop();
+                    checkOutputs(m, startMs, eepromWrites);
+                }
+                break;
+            case OP_LONG_STEP:
+                m.loop((arg + 1UL) * FUZZ_LONG_STEP_MICROS);
+                break;
+            case OP_WATER_LEVEL:
+                stubSetInput(TEST_WATER_LEVEL_PIN, arg & 1);
+                m.loop();
+                break;
+            case OP_EEPROM_FAILING:
+                stubSetEepromFailing(arg & 1);
+                m.loop();
+                break;
+        }
+        checkOutputs(m, startMs, eepromWrites);
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+#include <unistd.h>
+#include <sys/wait.h>
+#include <random>
+#include <vector>
+#include <chrono>
+#include <thread>
+
+const size_t FUZZ_MAX_LEN = 512;
+
+static int replay(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return 2;
+    }
+    std::vector<uint8_t> input;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        input.push_back(c);
+    }
+    fclose(f);
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+    printf("%s: ok\n", path);
+    return 0;
+}
+
+//! random inputs in a child process; the failing input is written to crash-<seed>-<run>
+static void worker(unsigned long seed, unsigned long runs) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> input(FUZZ_MAX_LEN);
+    for (unsigned long run = 0; run < runs; run++) {
+        input.resize(1 + rng() % FUZZ_MAX_LEN);
+        for (size_t i = 0; i < input.size(); i++) {
+            input[i] = rng();
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "crash-%lu-%lu", seed, run);
+        FILE* f = fopen(path, "wb");
+        if (f != NULL) {
+            fwrite(input.data(), 1, input.size(), f);
+            fclose(f);
+        }
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+        remove(path);
+    }
+}
+
+int main(int argc, char** argv) {
+    unsigned long jobs = std::thread::hardware_concurrency();
+    unsigned long runs = 10000;
+    unsigned long seed = 1;
+    int status = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-runs") == 0 && i + 1 < argc) {
+            runs = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+        } else {
+            status |= replay(argv[i]);
+            jobs = 0;
+        }
+    }
+    if (jobs == 0) {
+        return status;
+    }
+
+    // one process per job: the stubs keep pins, clock and EEPROM in globals
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned long job = 0; job < jobs; job++) {
+        if (fork() == 0) {
+            worker(seed + job, runs);
+            _exit(0);
+        }
+    }
+    for (unsigned long job = 0; job < jobs; job++) {
+        int childStatus;
+        wait(&childStatus);
+        if (!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) {
+            status = 1;
+        }
+    }
+    if (status != 0) {
+        printf("FAILED, the failing input is kept in crash-<seed>-<run>\n");
+        return status;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%lu inputs on %lu jobs in %.1f s, %.0f inputs/min\n", jobs * runs, jobs, seconds, jobs * runs * 60 / seconds);
+    return status;
+}
+#endif
@@ -0,0 +1,383 @@
+// Arduino Expresso Coffee Machine Classes
+// https://github.com/klause/gel-coffee-avr-control-module
+// Copyright (C) 2019 by Klause Nascimento and licensed under
+// GNU GPL v3.0, https://www.gnu.org/licenses/gpl.html
+
+/**
+ * shot_analytics
+ *
+ * Crunches shot logs collected by bus_aggregator (ShotLogFile.h). Logs are memory mapped and
+ * their records split among threads (at most one per core). Histograms are shared by the threads
+ * and counted with relaxed atomic increments, so memory does not grow with the thread count
+ * and nothing is merged; a lock is only taken the first time a thread meets a brew option.
+ * Prints for each machine, group and brew option:
+ *
+ *   - shot count by stop reason and percentiles of shot time and flowmeter pulses
+ *   - drift timeline: mean shot time per period (one day by default)
+ *   - recommended DosageRecord values per machine and group, from shots that reached a
+ *     measured target (see printRecommendations)
+ *
+ *   g++ -std=c++11 -O2 -pthread -o shot_analytics tools/shot_analytics.cpp
+ *
+ *   shot_analytics [-j threads] [-p period_hours] shots.bin ...
+ */
+
+#include "ShotLogFile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+const int STOP_REASONS_LEN = 8;
+const int DOSED_OPTIONS_LEN = 4;                                    //!< BREW_OPTIONS_LEN - 1, option 5 is continuous
+
+// StopReason of ExpressoCoffee.h
+static const char* STOP_REASON_NAMES[STOP_REASONS_LEN] = {
+    "none", "flowmeter", "no-flow", "timeout", "user", "safety", "duration", "weight"
+};
+const uint8_t STOP_BY_FLOWMETER = 1;
+const uint8_t STOP_BY_DURATION = 6;
+const uint8_t STOP_BY_WEIGHT = 7;
+
+// DosageRecord fields are uint8_t
+const int DOSAGE_FIELD_MAX = 255;
+const int DOSAGE_DURATION_MIN = 1;                                  //!< seconds, a 0 s dose would end every time dosed shot at once
+
+const int DURATION_BINS = 3000;                                     //!< 0.1 s bins up to 5 minutes, last bin collects longer shots
+const int PULSE_BINS = 4096;                                        //!< 1 pulse bins, last bin collects larger counts
+
+/**
+ * Shot count per bin, incremented by every thread. Relaxed increments are enough: counts are
+ * only read once the threads are joined.
+ */
+struct SharedHistogram {
+    std::vector<std::atomic<uint32_t>> bins;
+
+    SharedHistogram(int binsLen) : bins(binsLen) {}
+
+    void add(int value) {
+        bins[std::min<int>(value, bins.size() - 1)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        uint64_t count = 0;
+        for (const auto& bin : bins) {
+            count += bin.load(std::memory_order_relaxed);
+        }
+        return count;
+    }
+
+    int percentile(double p) const {
+        uint64_t rank = (uint64_t) (p * (count() - 1));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bins.size(); i++) {
+            seen += bins[i].load(std::memory_order_relaxed);
+            if (seen > rank) {
+                return (int) i;
+            }
+        }
+        return (int) bins.size() - 1;
+    }
+};
+
+struct OptionStats {
+    SharedHistogram durationHistogram;
+    SharedHistogram pulseHistogram;
+    SharedHistogram targetDurationHistogram;                        //!< shots that delivered a measured dose, flowmeter or weight
+    SharedHistogram weightPulseHistogram;                           //!< pulses that reached the target weight
+    std::atomic<uint64_t> reasonCount[STOP_REASONS_LEN];
+
+    OptionStats() : durationHistogram(DURATION_BINS), pulseHistogram(PULSE_BINS),
+                    targetDurationHistogram(DURATION_BINS), weightPulseHistogram(PULSE_BINS) {
+        for (auto& count : reasonCount) {
+            count = 0;
+        }
+    }
+};
+
+//! stats of every brew option seen, created by the first thread that meets it
+struct SharedStats {
+    std::mutex mutex;
+    std::unordered_map<uint32_t, std::unique_ptr<OptionStats>> options;
+
+    OptionStats* get(uint32_t key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_ptr<OptionStats>& stats = options[key];
+        if (!stats) {
+            stats.reset(new OptionStats());
+        }
+        return stats.get();
+    }
+};
+
+struct DriftBucket {
+    uint64_t durationSum = 0;                                       //!< 0.1 s
+    uint64_t count = 0;
+};
+
+struct Partial {
+    std::unordered_map<uint64_t, DriftBucket> drift;                //!< option key << 32 | period
+    uint64_t records = 0;
+};
+
+struct MappedLog {
+    const ShotLogFileRecord* records = NULL;
+    size_t count = 0;
+    void* base = NULL;
+    size_t size = 0;
+};
+
+static uint32_t optionKey(const ShotLogFileRecord& rec) {
+    return (uint32_t) rec.machine << 16 | (uint32_t) rec.groupNumber << 8 | (uint8_t) rec.brewOptionIndex;
+}
+
+static bool mapLog(const char* path, MappedLog& log) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(ShotLogFileHeader)) {
+        fprintf(stderr, "%s: not a shot log\n", path);
+        close(fd);
+        return false;
+    }
+    log.size = st.st_size;
+    log.base = mmap(NULL, log.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (log.base == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    madvise(log.base, log.size, MADV_SEQUENTIAL);
+
+    const ShotLogFileHeader* header = (const ShotLogFileHeader*) log.base;
+    if (memcmp(header->magic, SHOT_LOG_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != SHOT_LOG_FILE_VERSION
+        || header->recordSize != sizeof(ShotLogFileRecord)) {
+        fprintf(stderr, "%s: not a shot log of this version\n", path);
+        munmap(log.base, log.size);
+        return false;
+    }
+    log.records = (const ShotLogFileRecord*) ((const char*) log.base + sizeof(ShotLogFileHeader));
+    log.count = (log.size - sizeof(ShotLogFileHeader)) / sizeof(ShotLogFileRecord);
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+/ thread body: slice t of every log                                     *
+/-----------------------------------------------------------------------*/
+static void crunch(const std::vector<MappedLog>* logs, int slice, int slices, uint32_t periodSeconds, SharedStats* shared, Partial* partial) {
+    std::unordered_map<uint32_t, OptionStats*> known;               //!< options this thread already met, no lock
+    uint32_t lastKey = 0xFFFFFFFF;
+    OptionStats* stats = NULL;
+    for (const MappedLog& log : *logs) {
+        size_t begin = log.count * slice / slices;
+        size_t end = log.count * (slice + 1) / slices;
+        for (size_t i = begin; i < end; i++) {
+            const ShotLogFileRecord& rec = log.records[i];
+            uint32_t key = optionKey(rec);
+            if (key != lastKey) {                                   //!< shots of a machine tend to come in runs
+                OptionStats*& knownStats = known[key];
+                if (knownStats == NULL) {
+                    knownStats = shared->get(key);
+                }
+                stats = knownStats;
+                lastKey = key;
+            }
+            uint8_t reason = rec.stopReason < STOP_REASONS_LEN ? rec.stopReason : 0;
+            stats->reasonCount[reason].fetch_add(1, std::memory_order_relaxed);
+            stats->durationHistogram.add(rec.durationDeciseconds);
+            stats->pulseHistogram.add(rec.pulseCount);
+            if (reason == STOP_BY_WEIGHT) {
+                stats->weightPulseHistogram.add(rec.pulseCount);
+            }
+            if (reason == STOP_BY_FLOWMETER || reason == STOP_BY_WEIGHT) {
+                stats->targetDurationHistogram.add(rec.durationDeciseconds);
+                DriftBucket& bucket = partial->drift[(uint64_t) key << 32 | rec.hostTime / periodSeconds];
+                bucket.durationSum += rec.durationDeciseconds;
+                bucket.count++;
+            }
+        }
+        partial->records += end - begin;
+    }
+}
+
+static void merge(Partial& to, Partial& from) {
+    for (auto& entry : from.drift) {
+        DriftBucket& bucket = to.drift[entry.first];
+        bucket.durationSum += entry.second.durationSum;
+        bucket.count += entry.second.count;
+    }
+    to.records += from.records;
+}
+
+/*----------------------------------------------------------------------*
+/ report                                                                *
+/-----------------------------------------------------------------------*/
+static void printOption(uint32_t key, const OptionStats& stats) {
+    static const double PERCENTILES[] = { 0.10, 0.50, 0.90, 0.99 };
+    int option = (int8_t) (key & 0xFF);
+    printf("machine %u group %u option %d%s: %llu shots (", key >> 16, (key >> 8) & 0xFF, option + 1,
+           option == DOSED_OPTIONS_LEN ? " (continuous)" : "", (unsigned long long) stats.durationHistogram.count());
+    bool first = true;
+    for (int i = 0; i < STOP_REASONS_LEN; i++) {
+        if (stats.reasonCount[i] > 0) {
+            printf("%s%s %llu", first ? "" : ", ", STOP_REASON_NAMES[i], (unsigned long long) stats.reasonCount[i].load());
+            first = false;
+        }
+    }
+    printf(")\n  time (s)  ");
+    for (double p : PERCENTILES) {
+        printf("  p%-2d %6.1f", (int) (p * 100), stats.durationHistogram.percentile(p) / 10.0);
+    }
+    printf("\n  pulses    ");
+    for (double p : PERCENTILES) {
+        printf("  p%-2d %6d", (int) (p * 100), stats.pulseHistogram.percentile(p));
+    }
+    printf("\n");
+}
+
+static void printDrift(const Partial& result, uint32_t periodSeconds) {
+    std::map<uint64_t, DriftBucket> timeline(result.drift.begin(), result.drift.end());
+    uint32_t lastKey = 0xFFFFFFFF;
+    for (const auto& entry : timeline) {
+        uint32_t key = entry.first >> 32;
+        if (key != lastKey) {
+            printf("\nmachine %u group %u option %d, mean shot time of dosed shots:\n", key >> 16, (key >> 8) & 0xFF, (int8_t) (key & 0xFF) + 1);
+            lastKey = key;
+        }
+        time_t start = (time_t) (entry.first & 0xFFFFFFFF) * periodSeconds;
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", gmtime(&start));
+        printf("  %s  %6.1f s  %llu shots\n", date, entry.second.durationSum / 10.0 / entry.second.count, (unsigned long long) entry.second.count);
+    }
+}
+
+/*----------------------------------------------------------------------*
+/ DosageRecord from shots that reached a measured target, clamped to    *
+/ the uint8_t fields:                                                    *
+/   - pulses: median count of the shots stopped on target weight; a    *
+/     flowmeter stop only echoes the programmed count                   *
+/   - duration: median time of the shots stopped on weight or pulse     *
+/     count, rounded; it is the dose of time dosed shots (flowmeter     *
+/     unhealthy), which echo it and are left out, counted apart         *
+/-----------------------------------------------------------------------*/
+static void printRecommendations(const SharedStats& shared) {
+    std::map<uint32_t, std::vector<const OptionStats*>> groups;
+    for (const auto& entry : shared.options) {
+        int option = (int8_t) (entry.first & 0xFF);
+        if (option >= 0 && option < DOSED_OPTIONS_LEN) {
+            std::vector<const OptionStats*>& group = groups[entry.first >> 8];
+            group.resize(DOSED_OPTIONS_LEN);
+            group[option] = entry.second.get();
+        }
+    }
+    for (const auto& entry : groups) {
+        printf("\nrecommended DosageRecord, machine %u group %u:\n  flowMeterPulseArray = [", entry.first >> 8, entry.first & 0xFF);
+        for (int i = 0; i < DOSED_OPTIONS_LEN; i++) {
+            const OptionStats* stats = entry.second[i];
+            if (stats != NULL && stats->weightPulseHistogram.count() > 0) {
+                printf(" %d", std::min(stats->weightPulseHistogram.percentile(0.5), DOSAGE_FIELD_MAX));
+            } else {
+                printf(" -");
+            }
+        }
+        printf(" ]\n  durationArray = [");
+        uint64_t timeDosed = 0;
+        for (int i = 0; i < DOSED_OPTIONS_LEN; i++) {
+            const OptionStats* stats = entry.second[i];
+            if (stats != NULL && stats->targetDurationHistogram.count() > 0) {
+                int seconds = (stats->targetDurationHistogram.percentile(0.5) + 5) / 10;
+                printf(" %d", std::max(DOSAGE_DURATION_MIN, std::min(seconds, DOSAGE_FIELD_MAX)));
+            } else {
+                printf(" -");
+            }
+            timeDosed += stats != NULL ? stats->reasonCount[STOP_BY_DURATION].load() : 0;
+        }
+        printf(" ]\n");
+        if (timeDosed > 0) {
+            printf("  %llu time dosed shots left out, flowmeter diagnosed unhealthy\n", (unsigned long long) timeDosed);
+        }
+    }
+}
+
+static int usage() {
+    fprintf(stderr, "usage: shot_analytics [-j threads] [-p period_hours] shots.bin ...\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    int threadsLen = std::max(1u, std::thread::hardware_concurrency());
+    uint32_t periodSeconds = 24 * 3600;
+    std::vector<MappedLog> logs;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threadsLen = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            periodSeconds = atoi(argv[++i]) * 3600;
+        } else if (argv[i][0] == '-') {
+            return usage();
+        } else {
+            MappedLog log;
+            if (!mapLog(argv[i], log)) {
+                return 1;
+            }
+            logs.push_back(log);
+        }
+    }
+    if (logs.empty() || threadsLen <= 0 || periodSeconds == 0) {
+        return usage();
+    }
+    // more threads than cores only add partials to merge
+    threadsLen = std::min<int>(threadsLen, std::max(1u, std::thread::hardware_concurrency()));
+
+    auto started = std::chrono::steady_clock::now();
+    SharedStats shared;
+    std::vector<Partial> partials(threadsLen);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadsLen; t++) {
+        threads.push_back(std::thread(crunch, &logs, t, threadsLen, periodSeconds, &shared, &partials[t]));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    Partial& result = partials[0];
+    for (int t = 1; t < threadsLen; t++) {
+        merge(result, partials[t]);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    fprintf(stderr, "%llu shots in %.3f s with %d threads\n", (unsigned long long) result.records, seconds, threadsLen);
+
+    std::map<uint32_t, const OptionStats*> sorted;
+    for (const auto& entry : shared.options) {
+        sorted[entry.first] = entry.second.get();
+    }
+    for (const auto& entry : sorted) {
+        printOption(entry.first, *entry.second);
+    }
+    printDrift(result, periodSeconds);
+    printRecommendations(shared);
+
+    for (MappedLog& log : logs) {
+        munmap(log.base, log.size);
+    }
+    return 0;
+}